@@ -17,17 +17,22 @@
 #include "usb_device.h"
 
 
-// Not defined in usb_device.h
-extern USBD_HandleTypeDef hUsbDeviceFS;
-
-
 static uint8_t  USBD_MTP_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t  USBD_MTP_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t  USBD_MTP_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
-static uint8_t* USBD_MTP_GetCfgDesc(uint16_t *length);
+static uint8_t* USBD_MTP_GetHSCfgDesc(uint16_t *length);
+static uint8_t* USBD_MTP_GetFSCfgDesc(uint16_t *length);
+static uint8_t* USBD_MTP_GetOtherSpeedCfgDesc(uint16_t *length);
 static uint8_t  USBD_MTP_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_MTP_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_MTP_EP0_RxReady(USBD_HandleTypeDef *pdev);
+static void     USBD_MTP_TxFlush(USBD_HandleTypeDef *pdev);
+static void     USBD_MTP_TxNext(USBD_HandleTypeDef *pdev);
+static void     USBD_MTP_RxDone(USBD_HandleTypeDef *pdev, uint32_t len);
+#ifdef MTP_WORKER
+static void     USBD_MTP_WorkQueue(USBD_MTP_HandleTypeDef *hMtp, uint8_t epnum, uint32_t len);
+static void     USBD_MTP_WorkReset(USBD_HandleTypeDef *pdev);
+#endif
 static uint8_t* USBD_MTP_GetDeviceQualifierDesc(uint16_t *length);
 
 
@@ -43,61 +48,72 @@ USBD_ClassTypeDef USBD_MTP =
     NULL, /*SOF */
     NULL,
     NULL,
-    USBD_MTP_GetCfgDesc,
-    USBD_MTP_GetCfgDesc,
-    USBD_MTP_GetCfgDesc,
+    USBD_MTP_GetHSCfgDesc,
+    USBD_MTP_GetFSCfgDesc,
+    USBD_MTP_GetOtherSpeedCfgDesc,
 	USBD_MTP_GetDeviceQualifierDesc,
 };
 
 
-/* USB CUSTOM_HID device Configuration Descriptor */
-__ALIGN_BEGIN static uint8_t USBD_MTP_CfgDesc[39] __ALIGN_END =
-{
-    0x09, /* bLength: Configuration Descriptor size */
-    USB_DESC_TYPE_CONFIGURATION, /* bDescriptorType: Configuration */
-    WBVAL(sizeof(USBD_MTP_CfgDesc)),  /* wTotalLength: Bytes returned */
-    0x01,         /*bNumInterfaces: 1 interface*/
-    0x01,         /*bConfigurationValue: Configuration value*/
-    0x00,         /*iConfiguration: Index of string descriptor describing
-    the configuration*/
-    0xC0,         /*bmAttributes: bus powered */
-    0x32,         /*MaxPower 100 mA: this current is used for detecting Vbus*/
-
-    /************** Descriptor of MTP interface ****************/
-    /* 09 */
-    0x09,         /*bLength: Interface Descriptor size*/
-    USB_DESC_TYPE_INTERFACE,/*bDescriptorType: Interface descriptor type*/
-    0x00,         /*bInterfaceNumber: Number of Interface*/
-    0x00,         /*bAlternateSetting: Alternate setting*/
-    0x03,         /*bNumEndpoints*/
-    0x06,         /*bInterfaceClass: MTP*/
-    0x01,         /*bInterfaceSubClass */
-    0x01,         /*nInterfaceProtocol */
-    USBD_IDX_CONFIG_STR,   /*iInterface: Index of string descriptor*/
-    /******************** Descriptors of MTP endpoints ********************/
-    /* 18 */
-    0x07,	         /* bLength: Endpoint Descriptor size */
-    USB_DESC_TYPE_ENDPOINT,	/* bDescriptorType: */
-    MTP_EPOUT_ADDR,  /*bEndpointAddress: Endpoint Address (OUT)*/
-    USB_ENDPOINT_TYPE_BULK,	/* bmAttributes: Interrupt endpoint */
-	WBVAL(MTP_EP_SIZE),	/* wMaxPacketSize: 64 Bytes max  */
-    0,			/* bInterval */
-    /* 25 */
-    0x07,          /*bLength: Endpoint Descriptor size*/
-    USB_DESC_TYPE_ENDPOINT, /*bDescriptorType:*/
-    MTP_EPIN_ADDR,     /*bEndpointAddress: Endpoint Address (IN)*/
-    USB_ENDPOINT_TYPE_BULK,          /*bmAttributes: Interrupt endpoint*/
-	WBVAL(MTP_EP_SIZE), /*wMaxPacketSize: 64 Byte max */
-    0,          			/*bInterval */
-    /* 32 */
-    0x07,            /* bLength */
-    USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType */
-    MTP_EP2IN_ADDR,                /* bEndpointAddress */
-    USB_ENDPOINT_TYPE_INTERRUPT,       /* bmAttributes */
-	WBVAL(MTP_EP2_SIZE),         /* wMaxPacketSize */
-    100, /* ms */                      /* bInterval */
-    /* 39 */
-} ;
+/* USB MTP device Configuration Descriptor, the same for both speeds except for
+ * the packet size of the bulk endpoints and the interval of the interrupt one */
+#define USBD_MTP_CFG_DESC(type, epsize, interval) \
+{ \
+    0x09, /* bLength: Configuration Descriptor size */ \
+    type, /* bDescriptorType: Configuration or Other Speed Configuration */ \
+    WBVAL(USBD_MTP_CFG_DESC_SIZE),  /* wTotalLength: Bytes returned */ \
+    0x01,         /*bNumInterfaces: 1 interface*/ \
+    0x01,         /*bConfigurationValue: Configuration value*/ \
+    0x00,         /*iConfiguration: Index of string descriptor describing the configuration*/ \
+    0xC0,         /*bmAttributes: bus powered */ \
+    0x32,         /*MaxPower 100 mA: this current is used for detecting Vbus*/ \
+ \
+    /************** Descriptor of MTP interface ****************/ \
+    /* 09 */ \
+    0x09,         /*bLength: Interface Descriptor size*/ \
+    USB_DESC_TYPE_INTERFACE,/*bDescriptorType: Interface descriptor type*/ \
+    0x00,         /*bInterfaceNumber: Number of Interface*/ \
+    0x00,         /*bAlternateSetting: Alternate setting*/ \
+    0x03,         /*bNumEndpoints*/ \
+    0x06,         /*bInterfaceClass: MTP*/ \
+    0x01,         /*bInterfaceSubClass */ \
+    0x01,         /*nInterfaceProtocol */ \
+    USBD_IDX_CONFIG_STR,   /*iInterface: Index of string descriptor*/ \
+    /******************** Descriptors of MTP endpoints ********************/ \
+    /* 18 */ \
+    0x07,	         /* bLength: Endpoint Descriptor size */ \
+    USB_DESC_TYPE_ENDPOINT,	/* bDescriptorType: */ \
+    MTP_EPOUT_ADDR,  /*bEndpointAddress: Endpoint Address (OUT)*/ \
+    USB_ENDPOINT_TYPE_BULK,	/* bmAttributes: Bulk endpoint */ \
+	WBVAL(epsize),	/* wMaxPacketSize */ \
+    0,			/* bInterval */ \
+    /* 25 */ \
+    0x07,          /*bLength: Endpoint Descriptor size*/ \
+    USB_DESC_TYPE_ENDPOINT, /*bDescriptorType:*/ \
+    MTP_EPIN_ADDR,     /*bEndpointAddress: Endpoint Address (IN)*/ \
+    USB_ENDPOINT_TYPE_BULK,          /*bmAttributes: Bulk endpoint*/ \
+	WBVAL(epsize), /*wMaxPacketSize */ \
+    0,          			/*bInterval */ \
+    /* 32 */ \
+    0x07,            /* bLength */ \
+    USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType */ \
+    MTP_EP2IN_ADDR,                /* bEndpointAddress */ \
+    USB_ENDPOINT_TYPE_INTERRUPT,       /* bmAttributes */ \
+	WBVAL(MTP_EP2_SIZE),         /* wMaxPacketSize */ \
+    interval,                          /* bInterval */ \
+    /* 39 */ \
+}
+#define USBD_MTP_CFG_DESC_SIZE      39
+
+__ALIGN_BEGIN static uint8_t USBD_MTP_CfgHSDesc[USBD_MTP_CFG_DESC_SIZE] __ALIGN_END =
+    USBD_MTP_CFG_DESC(USB_DESC_TYPE_CONFIGURATION, MTP_HS_EP_SIZE, MTP_EP2_HS_INTERVAL);
+
+__ALIGN_BEGIN static uint8_t USBD_MTP_CfgFSDesc[USBD_MTP_CFG_DESC_SIZE] __ALIGN_END =
+    USBD_MTP_CFG_DESC(USB_DESC_TYPE_CONFIGURATION, MTP_FS_EP_SIZE, MTP_EP2_FS_INTERVAL);
+
+// Describes the full-speed configuration while running at high speed
+__ALIGN_BEGIN static uint8_t USBD_MTP_OtherSpeedCfgDesc[USBD_MTP_CFG_DESC_SIZE] __ALIGN_END =
+    USBD_MTP_CFG_DESC(USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION, MTP_FS_EP_SIZE, MTP_EP2_FS_INTERVAL);
 
 /* USB Standard Device Descriptor */
 __ALIGN_BEGIN static uint8_t USBD_MTP_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_DESC]  __ALIGN_END =
@@ -109,7 +125,7 @@ __ALIGN_BEGIN static uint8_t USBD_MTP_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_
   0x00,
   0x00,
   0x00,
-  MTP_EP_SIZE,
+  0x40,   /* bMaxPacketSize0 of the control endpoint */
   0x01,
   0x00,
 };
@@ -125,25 +141,67 @@ __ALIGN_BEGIN static uint8_t USBD_MTP_DeviceQualifierDesc[USB_LEN_DEV_QUALIFIER_
 static uint8_t USBD_MTP_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
     uint8_t ret = 0;
+    uint16_t size = MTP_FS_EP_SIZE;
     USBD_MTP_HandleTypeDef *hMtp;
+    PtpContext_t *ptp;
+
+#ifdef USE_USB_HS
+    if (pdev->dev_speed == USBD_SPEED_HIGH)
+    {
+        size = MTP_HS_EP_SIZE;
+    }
+#endif
+    // No protocol engine for this USB core, MTP_INSTANCES is too low
+    if (ptp = PtpContext(pdev), ptp == nullptr)
+    {
+        return USBD_FAIL;
+    }
 
     /* Open EP IN */
-    USBD_LL_OpenEP(pdev, MTP_EPIN_ADDR, USBD_EP_TYPE_BULK, MTP_EP_SIZE);
+    USBD_LL_OpenEP(pdev, MTP_EPIN_ADDR, USBD_EP_TYPE_BULK, size);
     /* Open EP OUT */
-    USBD_LL_OpenEP(pdev, MTP_EPOUT_ADDR, USBD_EP_TYPE_BULK, MTP_EP_SIZE);
+    USBD_LL_OpenEP(pdev, MTP_EPOUT_ADDR, USBD_EP_TYPE_BULK, size);
 
     USBD_LL_OpenEP(pdev, MTP_EP2IN_ADDR, USBD_EP_TYPE_INTR, MTP_EP2_SIZE);
 
-    if (pdev->pClassData = USBD_malloc(sizeof (USBD_MTP_HandleTypeDef)), pdev->pClassData == nullptr)
+#ifdef MTP_WORKER
+    // The handle of the previous configuration is kept, the worker may still use it
+    if (pdev->pClassData == nullptr)
+    {
+        if (pdev->pClassData = USBD_malloc(sizeof (USBD_MTP_HandleTypeDef)), pdev->pClassData != nullptr)
+        {
+            hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+            hMtp->TxBusy = 0;
+            hMtp->Work.head = 0;
+            hMtp->Work.tail = 0;
+            hMtp->Work.cancel = 0;
+        }
+    }
+#else
+    pdev->pClassData = USBD_malloc(sizeof (USBD_MTP_HandleTypeDef));
+#endif
+    if (pdev->pClassData == nullptr)
     {
         ret = 1;
     }
     else
     {
     	hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
-
-        /* Prepare Out endpoint to receive 1st packet */
-        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtp->MtpDataBuf, MTP_EP_SIZE);
+        hMtp->Ptp = ptp;
+        hMtp->MaxPacket = size;
+#ifdef MTP_WORKER
+        // The worker resets the engine and prepares the Out endpoint
+        hMtp->Work.active = 1;
+        hMtp->Work.reset = 1;
+        MTP_WORKER_SIGNAL();
+#else
+        hMtp->TxBusy = 0;
+        USBD_MTP_TxFlush(pdev);
+        hMtp->RxNext = 0;
+
+        /* Prepare Out endpoint to receive 1st transfer */
+        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtp->RxBuf[hMtp->RxNext], MTP_RX_BUF_SIZE);
+#endif
     }
     return ret;
 }
@@ -168,10 +226,18 @@ static uint8_t USBD_MTP_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* FRee allocated memory */
     if (pdev->pClassData != nullptr)
     {
-        PtpReset();
+#ifdef MTP_WORKER
+        // Freeing here pulls the handle from under a running worker, it resets
+        // the engine instead and the next Init takes the handle over
+        ((USBD_MTP_HandleTypeDef*)pdev->pClassData)->Work.active = 0;
+        ((USBD_MTP_HandleTypeDef*)pdev->pClassData)->Work.reset = 1;
+        MTP_WORKER_SIGNAL();
+#else
+        PtpReset(((USBD_MTP_HandleTypeDef*)pdev->pClassData)->Ptp);
 
         USBD_free(pdev->pClassData);
         pdev->pClassData = nullptr;
+#endif
     }
     return USBD_OK;
 }
@@ -204,7 +270,12 @@ static uint8_t USBD_MTP_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
                     break;
 
                 case 0x67:
-                    pbuf = MtpGetDeviceStatus(&len);
+#ifdef MTP_WORKER
+                    // Device_Busy until the worker has dropped a cancelled transaction
+                    pbuf = MtpGetDeviceStatus(hMtp->Ptp, hMtp->Work.cancel, &len);
+#else
+                    pbuf = MtpGetDeviceStatus(hMtp->Ptp, false, &len);
+#endif
                     USBD_CtlSendData(pdev, (uint8_t*)pbuf, len);
                     break;
 
@@ -230,16 +301,39 @@ static uint8_t USBD_MTP_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *re
 }
 
 /**
-  * @brief  USBD_MTP_GetCfgDesc
-  *         return configuration descriptor
-  * @param  speed : current device speed
+  * @brief  USBD_MTP_GetHSCfgDesc
+  *         return configuration descriptor for high speed
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t *USBD_MTP_GetHSCfgDesc(uint16_t *length)
+{
+    *length = sizeof (USBD_MTP_CfgHSDesc);
+    return USBD_MTP_CfgHSDesc;
+}
+
+/**
+  * @brief  USBD_MTP_GetFSCfgDesc
+  *         return configuration descriptor for full speed
   * @param  length : pointer data length
   * @retval pointer to descriptor buffer
   */
-static uint8_t *USBD_MTP_GetCfgDesc(uint16_t *length)
+static uint8_t *USBD_MTP_GetFSCfgDesc(uint16_t *length)
 {
-    *length = sizeof (USBD_MTP_CfgDesc);
-    return USBD_MTP_CfgDesc;
+    *length = sizeof (USBD_MTP_CfgFSDesc);
+    return USBD_MTP_CfgFSDesc;
+}
+
+/**
+  * @brief  USBD_MTP_GetOtherSpeedCfgDesc
+  *         return other speed configuration descriptor
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t *USBD_MTP_GetOtherSpeedCfgDesc(uint16_t *length)
+{
+    *length = sizeof (USBD_MTP_OtherSpeedCfgDesc);
+    return USBD_MTP_OtherSpeedCfgDesc;
 }
 
 /**
@@ -251,28 +345,111 @@ static uint8_t *USBD_MTP_GetCfgDesc(uint16_t *length)
   */
 static uint8_t USBD_MTP_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-    uint32_t len = 0;
-    //USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+    USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
 
     epnum |= 0x80;
     if (epnum == MTP_EPIN_ADDR)
     {
-        uint8_t *pTx;
+#ifdef MTP_WORKER
+        USBD_MTP_WorkQueue(hMtp, MTP_EPIN_ADDR, 0);
+#else
+        hMtp->TxBusy = 0;
+        USBD_MTP_TxNext(pdev);
+#endif
+    }
+    else if (epnum == MTP_EP2IN_ADDR)
+    {
+    }
+    return USBD_OK;
+}
+
+/**
+  * @brief  USBD_MTP_TxFlush
+  *         Drop the chunks waiting in the transmit buffers, and the one on
+  *         the wire, before the buffers are reused
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void USBD_MTP_TxFlush(USBD_HandleTypeDef *pdev)
+{
+    USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+
+    if (hMtp->TxBusy)
+    {
+        USBD_LL_FlushEP(pdev, MTP_EPIN_ADDR);
+    }
+    hMtp->TxReady[0] = 0;
+    hMtp->TxReady[1] = 0;
+    hMtp->TxNext = 0;
+    hMtp->TxBusy = 0;
+}
+
+/**
+  * @brief  USBD_MTP_TxNext
+  *         Send the chunk that is ready, then fill the other buffer with the
+  *         chunk after it while this one is on the wire
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void USBD_MTP_TxNext(USBD_HandleTypeDef *pdev)
+{
+    USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+    uint8_t tx = hMtp->TxNext;
+    uint8_t fill = tx ^ 1;
+
+    // Nothing prepared when a response starts, fill the buffer here
+    if (!hMtp->TxReady[tx])
+    {
+        hMtp->TxReady[tx] = PtpPayloadOut(hMtp->Ptp, hMtp->TxBuf[tx], MTP_TX_BUF_SIZE, hMtp->MaxPacket, &hMtp->TxLength[tx]);
+    }
+    if (hMtp->TxReady[tx])
+    {
+        hMtp->TxReady[tx] = 0;
+        hMtp->TxNext = fill;
+        hMtp->TxBusy = 1;
+        // Up to a buffer of whole packets per transfer, DataIn runs again once all are sent
+        USBD_LL_Transmit(pdev, MTP_EPIN_ADDR, hMtp->TxBuf[tx], hMtp->TxLength[tx]);
 
-        if (pTx = PtpPayloadOut(MTP_EP_SIZE, &len), pTx != nullptr)
+        if (!hMtp->TxReady[fill])
         {
-            USBD_LL_Transmit(pdev, MTP_EPIN_ADDR, pTx, len);
+            hMtp->TxReady[fill] = PtpPayloadOut(hMtp->Ptp, hMtp->TxBuf[fill], MTP_TX_BUF_SIZE, hMtp->MaxPacket, &hMtp->TxLength[fill]);
         }
-        else
+    }
+}
+
+/**
+  * @brief  USBD_MTP_RxDone
+  *         Pass a received transfer to the core
+  * @param  pdev: device instance
+  * @param  len: bytes received
+  * @retval None
+  */
+static void USBD_MTP_RxDone(USBD_HandleTypeDef *pdev, uint32_t len)
+{
+    USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+    uint8_t rx = hMtp->RxNext;
+
+    // Re-arm with the other buffer first, the host sends the next chunk while this one is written
+    hMtp->RxNext = rx ^ 1;
+    USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtp->RxBuf[hMtp->RxNext], MTP_RX_BUF_SIZE);
+
+    if (len == 0)
+    {
+        // Zero-length packet, only ends a data phase of whole packets
+    }
+    else if (PtpPayloadIn(hMtp->Ptp, hMtp->RxBuf[rx], len))
+    {
+        // Start sending the response, unless the pipeline is still running
+        if (!hMtp->TxBusy)
         {
-        //    printf("EPIN STALL\n");
-        //    USBD_LL_StallEP(pdev, MTP_EPIN_ADDR);
+            USBD_MTP_TxNext(pdev);
         }
     }
-    else if (epnum == MTP_EP2IN_ADDR)
+    else
     {
+        printf("ENDP2 stall\n");
+        USBD_LL_StallEP(pdev, MTP_EPOUT_ADDR);
     }
-    return USBD_OK;
 }
 
 /**
@@ -283,25 +460,118 @@ static uint8_t USBD_MTP_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
   * @retval status
   */
 static uint8_t USBD_MTP_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    if (epnum == MTP_EPOUT_ADDR)
+    {
+#ifdef MTP_WORKER
+        USBD_MTP_WorkQueue((USBD_MTP_HandleTypeDef*)pdev->pClassData, MTP_EPOUT_ADDR, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR));
+#else
+        USBD_MTP_RxDone(pdev, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR));
+#endif
+    }
+    return USBD_OK;
+}
+
+#ifdef MTP_WORKER
+/**
+  * @brief  USBD_MTP_WorkQueue
+  *         Queue a completion for USBD_MTP_Process, called from the interrupt
+  * @param  hMtp: MTP handle
+  * @param  epnum: endpoint of the completed transfer, 0 for a cancel request
+  * @param  len: bytes received
+  * @retval None
+  */
+static void USBD_MTP_WorkQueue(USBD_MTP_HandleTypeDef *hMtp, uint8_t epnum, uint32_t len)
+{
+    uint8_t slot = hMtp->Work.head & (MTP_WORK_QUEUE - 1);
+
+    if (epnum == 0)
+    {
+        // The waiting request reads the command buffer once it runs, a repeat adds nothing
+        if (hMtp->Work.cancel)
+        {
+            return;
+        }
+        hMtp->Work.cancel = 1;
+    }
+    // Never full, see USBD_MTP_WorkQueueTypeDef; a lost completion leaves its endpoint unarmed
+    hMtp->Work.epnum[slot] = epnum;
+    hMtp->Work.length[slot] = len;
+    hMtp->Work.head++;      // Publish the entry once it is complete
+    MTP_WORKER_SIGNAL();
+}
+
+/**
+  * @brief  USBD_MTP_WorkReset
+  *         Reset the engine after Init or DeInit, which run in the interrupt,
+  *         and drop the completions of the previous configuration
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void USBD_MTP_WorkReset(USBD_HandleTypeDef *pdev)
 {
     USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
 
-    if (epnum == MTP_EPOUT_ADDR)
+    hMtp->Work.reset = 0;
+    hMtp->Work.tail = hMtp->Work.head;
+    hMtp->Work.cancel = 0;
+    PtpReset(hMtp->Ptp);
+    USBD_MTP_TxFlush(pdev);
+    hMtp->RxNext = 0;
+
+    // Another Init or DeInit in the meantime sets reset again and runs this once more
+    if (hMtp->Work.active)
     {
-        if (PtpPayloadIn(hMtp->MtpDataBuf, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR)))
+        /* Prepare Out endpoint to receive 1st transfer */
+        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtp->RxBuf[hMtp->RxNext], MTP_RX_BUF_SIZE);
+    }
+}
+
+/**
+  * @brief  USBD_MTP_Process
+  *         Run the transfers queued by the interrupt through the core. Call
+  *         from the main loop, or from the task woken by MTP_WORKER_SIGNAL
+  * @param  pdev: device instance
+  * @retval None
+  */
+void USBD_MTP_Process(USBD_HandleTypeDef *pdev)
+{
+    USBD_MTP_HandleTypeDef *hMtp = (USBD_MTP_HandleTypeDef*)pdev->pClassData;
+
+    if (hMtp == NULL)
+    {
+        return;
+    }
+    while (hMtp->Work.reset || (hMtp->Work.tail != hMtp->Work.head))
+    {
+        uint8_t slot = hMtp->Work.tail & (MTP_WORK_QUEUE - 1);
+
+        if (hMtp->Work.reset)
         {
-            // Start sending the response
-        	USBD_MTP_DataIn(pdev, MTP_EPIN_ADDR);
+            USBD_MTP_WorkReset(pdev);
+            continue;
         }
-        else
+        switch (hMtp->Work.epnum[slot])
         {
-            printf("ENDP2 stall\n");
-            USBD_LL_StallEP(pdev, MTP_EPOUT_ADDR);
+            case MTP_EPOUT_ADDR:
+                USBD_MTP_RxDone(pdev, hMtp->Work.length[slot]);
+                break;
+
+            case MTP_EPIN_ADDR:
+                hMtp->TxBusy = 0;
+                USBD_MTP_TxNext(pdev);
+                break;
+
+            default:
+                hMtp->Work.cancel = 0;
+                PtpCancelRequest(hMtp->Ptp, hMtp->MtpCmdBuf);
+                USBD_MTP_TxFlush(pdev);
+                break;
         }
-        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtp->MtpDataBuf, MTP_EP_SIZE);
+        hMtp->Work.tail++;      // Hand the entry back to the interrupt
     }
-    return USBD_OK;
 }
+#endif
 
 /**
   * @brief  USBD_MTP_EP0_RxReady
@@ -319,7 +589,12 @@ uint8_t USBD_MTP_EP0_RxReady(USBD_HandleTypeDef *pdev)
             switch (pdev->request.bRequest)
             {
                 case 0x64:
-                    PtpCancelRequest(hMtp->MtpCmdBuf);
+#ifdef MTP_WORKER
+                    USBD_MTP_WorkQueue(hMtp, 0, 0);
+#else
+                    PtpCancelRequest(hMtp->Ptp, hMtp->MtpCmdBuf);
+                    USBD_MTP_TxFlush(pdev);
+#endif
                     break;
             }
     }
@@ -357,11 +632,11 @@ uint8_t USBD_MTP_RegisterInterface(USBD_HandleTypeDef *pdev, USBD_MTP_ItfTypeDef
     return ret;
 }
 
-uint8_t USBD_MTP_SendInterruptData(uint8_t* buf, uint32_t len)
+uint8_t USBD_MTP_SendInterruptData(USBD_HandleTypeDef *pdev, uint8_t* buf, uint32_t len)
 {
-    if (hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED)
+    if ((pdev != NULL) && (pdev->dev_state == USBD_STATE_CONFIGURED))
     {
-        USBD_LL_Transmit(&hUsbDeviceFS, MTP_EP2IN_ADDR, buf, len);
+        USBD_LL_Transmit(pdev, MTP_EP2IN_ADDR, buf, len);
     }
     return(len);
 }
@@ -28,9 +28,33 @@
 #define MTP_EPOUT_ADDR                  0x01
 #define MTP_EP2IN_ADDR                  0x82
 
-#define MTP_EP_SIZE                     64
+#define MTP_FS_EP_SIZE                  64
+#define MTP_HS_EP_SIZE                  512
+#ifdef USE_USB_HS
+#define MTP_EP_SIZE                     MTP_HS_EP_SIZE  // Largest bulk packet, sizes the buffers
+#else
+#define MTP_EP_SIZE                     MTP_FS_EP_SIZE
+#endif
 #define MTP_EP2_SIZE                    8
 
+#ifndef MTP_TX_BUF_SIZE
+#define MTP_TX_BUF_SIZE                 2048    // Bytes per IN transfer, two of these are allocated
+#endif
+#ifndef MTP_RX_BUF_SIZE
+#define MTP_RX_BUF_SIZE                 2048    // Bytes per OUT transfer, two of these are allocated
+#endif
+#if ((MTP_TX_BUF_SIZE % MTP_EP_SIZE) != 0) || ((MTP_RX_BUF_SIZE % MTP_EP_SIZE) != 0)
+#error "MTP_TX_BUF_SIZE and MTP_RX_BUF_SIZE must be multiples of MTP_EP_SIZE"
+#endif
+#ifdef MTP_WORKER
+#define MTP_WORK_QUEUE                  8       // Completions waiting for the worker (power of 2)
+#ifndef MTP_WORKER_SIGNAL
+#define MTP_WORKER_SIGNAL()                     // Wake the task running USBD_MTP_Process, called from the interrupt
+#endif
+#endif
+#define MTP_EP2_FS_INTERVAL             100     // ms
+#define MTP_EP2_HS_INTERVAL             11      // 2^(11-1) microframes, 128 ms
+
 #define USB_ENDPOINT_TYPE_BULK          0x02
 #define USB_ENDPOINT_TYPE_INTERRUPT     0x03
 
@@ -51,12 +75,48 @@ typedef struct _USBD_MTP_Itf
 }
 USBD_MTP_ItfTypeDef;
 
+#ifdef MTP_WORKER
+/* Transfers completed by the USB interrupt, waiting for the worker. The interrupt
+ * only writes head and the worker only writes tail, so no lock is needed.
+ * Only the worker arms the bulk endpoints, one transfer each, so per endpoint at
+ * most the entry being run and the one it armed are queued. The same holds for
+ * cancel requests, as a repeat is merged into one still waiting, so the ring
+ * never holds more than six entries. */
 typedef struct
 {
+    volatile uint8_t  epnum[MTP_WORK_QUEUE];    // Endpoint of the completion, 0 for a cancel request
+    volatile uint32_t length[MTP_WORK_QUEUE];   // Bytes received
+    volatile uint8_t  head;                     // Next entry to write, interrupt side
+    volatile uint8_t  tail;                     // Next entry to read, worker side
+    volatile uint8_t  cancel;                   // A cancel request is queued, repeats are merged into it
+    volatile uint8_t  reset;                    // Init or DeInit ran, the worker resets the engine
+    volatile uint8_t  active;                   // Configured, the worker arms the OUT endpoint after the reset
+}
+USBD_MTP_WorkQueueTypeDef;
+#endif
+
+typedef struct
+{
+    /* Ping-pong transmit buffers, one is on the wire while the other is filled.
+     * The buffers come first, to stay word aligned for the DMA of the OTG core. */
+    uint8_t  TxBuf[2][MTP_TX_BUF_SIZE];
+    /* Receive buffers, the endpoint fills one while the core consumes the other */
+    uint8_t  RxBuf[2][MTP_RX_BUF_SIZE];
+
 	uint8_t  MtpCmdBuf[10];
-	uint8_t  MtpDataBuf[MTP_EP_SIZE];
 
+    PtpContext_t *Ptp;      // Protocol engine of this instance
     uint32_t AltSetting;
+    uint16_t MaxPacket;     // Bulk packet size of the speed in use
+
+    uint32_t TxLength[2];   // Bytes to send from each buffer
+    uint8_t  TxReady[2];    // Buffer is filled and waits for the endpoint
+    uint8_t  TxNext;        // Buffer to send at the next completion
+    uint8_t  TxBusy;        // A transfer is on the wire
+    uint8_t  RxNext;        // Buffer armed on the endpoint
+#ifdef MTP_WORKER
+    USBD_MTP_WorkQueueTypeDef Work;
+#endif
 }
 USBD_MTP_HandleTypeDef;
 
@@ -66,7 +126,10 @@ extern USBD_ClassTypeDef  USBD_MTP;
 
 
 uint8_t USBD_MTP_RegisterInterface(USBD_HandleTypeDef *pdev, USBD_MTP_ItfTypeDef *fops);
-uint8_t USBD_MTP_SendInterruptData(uint8_t* buf, uint32_t len);
+uint8_t USBD_MTP_SendInterruptData(USBD_HandleTypeDef *pdev, uint8_t* buf, uint32_t len);
+#ifdef MTP_WORKER
+void    USBD_MTP_Process(USBD_HandleTypeDef *pdev);
+#endif
 
 
 #ifdef __cplusplus
@@ -74,6 +74,7 @@
  by FENIT.
 ****************************************************************************/
 
+#include <stddef.h>
 #include "usbd_mtp_core.h"
 #include "usbd_mtp.h"
 
@@ -147,115 +148,1401 @@
 #define MTP_FOLDER_CACHE_FILE	"/_.MTP"
 #endif
 
-#define PTP_BUF_SIZE    MTP_EP_SIZE
-//#define PTP_BUF_SIZE    512
+#ifndef MTP_FOLDER_HASH_SIZE
+    #define MTP_FOLDER_HASH_SIZE    256     // Hash buckets in the folder index file (power of 2)
+#endif
+#ifndef MTP_HANDLE_INDEX_SIZE
+    #define MTP_HANDLE_INDEX_SIZE   32      // Objects remembered per session (power of 2), 0 disables the index
+#endif
+#ifndef MTP_HANDLE_NAME_POOL
+    #define MTP_HANDLE_NAME_POOL    (MTP_HANDLE_INDEX_SIZE * 16)    // Bytes reserved for the object names in the index
+#endif
+#ifndef MTP_RENAME_ALIASES
+    #define MTP_RENAME_ALIASES      8       // Renamed files keeping their handle for the session, 0 reports a rename as remove and add
+#endif
+#ifndef MTP_RENAME_ALIAS_POOL
+    #define MTP_RENAME_ALIAS_POOL   (MTP_RENAME_ALIASES * 32)   // Bytes reserved for the new names of renamed files
+#endif
+#ifndef MTP_LOOKUP_CACHE_SIZE
+    #define MTP_LOOKUP_CACHE_SIZE   4       // Recently resolved handles kept with full path and info, 0 disables
+#endif
+#ifndef MTP_DATASET_POOL
+    #define MTP_DATASET_POOL        768     // Bytes for the prebuilt DeviceInfo and property datasets, 0 disables
+#endif
+#ifndef MTP_INSTANCES
+    #define MTP_INSTANCES           1       // Protocol engines, for class drivers running on several USB cores
+#endif
+#if (MTP_INSTANCES > 1) && !defined(MTP_WORKER)
+    #error "MTP_INSTANCES > 1 needs MTP_WORKER, the engines share the storage state and cannot run from two USB interrupts"
+#endif
+
+#define PTP_BUF_SIZE    (MAX_PATH + 1)  // Path of SendObjectInfo, the data phases use the buffers of the class driver
 
 #ifndef MTP_SEND_OBJECT_HOOK
     #define MTP_SEND_OBJECT_HOOK(handle, path)
 #endif
 
+#ifndef MTP_USER_FORMATS
+    #define MTP_USER_FORMATS        // Extra rows for the format table, as {format, "EXT"}, with extensions of up to 4 characters
+#endif
+
 #ifndef MTP_SESSION_OPEN_HOOK
     #define MTP_SESSION_OPEN_HOOK(session)
 #endif
 
-#ifndef MTP_SESSION_CLOSE_HOOK
-    #define MTP_SESSION_CLOSE_HOOK()
-#endif
+#ifndef MTP_SESSION_CLOSE_HOOK
+    #define MTP_SESSION_CLOSE_HOOK()
+#endif
+
+#ifndef MTP_DBG_LVL0
+    #define MTP_DBG_LVL0(x, ...)
+#endif
+#ifndef MTP_DBG_LVL1
+    #define MTP_DBG_LVL1(x, ...)
+#endif
+#ifndef MTP_DBG_LVL2
+    #define MTP_DBG_LVL2(x, ...)
+#endif
+#ifndef MTP_DBG_LVL3
+    #define MTP_DBG_LVL3(x, ...)
+#endif
+
+#if (MTP_READONLY == 0)
+    #undef MTP_READONLY
+#endif
+#ifdef MTP_FATFS
+    #if (FF_FS_READONLY != 0) && (MTP_READONLY != 1)
+        #define MTP_READONLY FF_FS_READONLY
+    #endif
+#endif
+
+#ifndef MTP_MANUFACTURER
+    #define MTP_MANUFACTURER        "White Bream"
+#endif
+#ifndef MTP_FRIENDLYNAME
+    #define MTP_FRIENDLYNAME        "STM32 MTP Class"
+#endif
+#ifndef MTP_SERIAL
+    #define MTP_SERIAL              "0123456789"
+#endif
+
+
+static VfsFile_t vIconFile = {0};   // Opened and closed again by each read of the DeviceIcon property
+static uint32_t vCurrentParent = 0;
+
+#if (FF_USE_LFN <= 2)
+#define STATIC_WORKPATH
+#endif
+#ifdef STATIC_WORKPATH
+static char vWorkPath[MAX_PATH + 1];    // Static to keep track of current directory
+static VfsInfo_t vFilInfo;  // Cached to accommodate multiple property request on a file
+#endif
+
+
+/* Next 32 bits of the input, in the byte order of the CPU like the word access
+ * of the original implementation so the handles do not change. The memcpy is
+ * safe for unaligned names, the last word is padded with zeroes. */
+static inline uint32_t
+CrcWord(const char** input, size_t* size)
+{
+    uint32_t w = 0;
+
+    if (*size >= sizeof(w))
+    {
+        memcpy(&w, *input, sizeof(w));
+        *input += sizeof(w);
+        *size -= sizeof(w);
+    }
+    else
+    {
+        memcpy(&w, *input, *size);
+        *size = 0;
+    }
+    return(w);
+}
+
+
+#if defined(MTP_CRC_HW) && !defined(MTP_WORKER)
+    #undef MTP_CRC_HW   // The CRC unit is not used from the USB interrupt
+#endif
+
+#if !(defined(MTP_CRC_HW) || defined(MTP_CRC_SLICE4)) || defined(MTP_CRC_BENCHMARK)
+static uint32_t
+Crc32Nibble(uint32_t crc, const char* input, size_t size)
+{
+    static const uint32_t CrcTable[16] =
+    {   // Nibble lookup table for 0x04C11DB7 polynomial
+        0x00000000,0x04C11DB7,0x09823B6E,0x0D4326D9,0x130476DC,0x17C56B6B,0x1A864DB2,0x1E475005,
+        0x2608EDB8,0x22C9F00F,0x2F8AD6D6,0x2B4BCB61,0x350C9B64,0x31CD86D3,0x3C8EA00A,0x384FBDBD
+    };
+
+    while (size > 0)
+    {
+        crc = crc ^ CrcWord(&input, &size); // Apply all 32-bits
+        // Process 32-bits, 4 at a time, or 8 rounds
+        crc = (crc << 4) ^ CrcTable[crc >> 28]; // Assumes 32-bit reg, masking index to 4-bits
+        crc = (crc << 4) ^ CrcTable[crc >> 28]; //  0x04C11DB7 Polynomial used in STM32
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+        crc = (crc << 4) ^ CrcTable[crc >> 28];
+    }
+    return(crc);
+}
+#endif
+
+
+#if defined(MTP_CRC_SLICE4) || defined(MTP_CRC_BENCHMARK)
+/* Same CRC a word at a time, 4 KiB of tables: CrcTable[k][n] is byte n
+ * followed by k zero bytes */
+static uint32_t
+Crc32Slice4(uint32_t crc, const char* input, size_t size)
+{
+    static const uint32_t CrcTable[4][256] =
+    {
+        {
+            0x00000000,0x04C11DB7,0x09823B6E,0x0D4326D9,0x130476DC,0x17C56B6B,0x1A864DB2,0x1E475005,
+            0x2608EDB8,0x22C9F00F,0x2F8AD6D6,0x2B4BCB61,0x350C9B64,0x31CD86D3,0x3C8EA00A,0x384FBDBD,
+            0x4C11DB70,0x48D0C6C7,0x4593E01E,0x4152FDA9,0x5F15ADAC,0x5BD4B01B,0x569796C2,0x52568B75,
+            0x6A1936C8,0x6ED82B7F,0x639B0DA6,0x675A1011,0x791D4014,0x7DDC5DA3,0x709F7B7A,0x745E66CD,
+            0x9823B6E0,0x9CE2AB57,0x91A18D8E,0x95609039,0x8B27C03C,0x8FE6DD8B,0x82A5FB52,0x8664E6E5,
+            0xBE2B5B58,0xBAEA46EF,0xB7A96036,0xB3687D81,0xAD2F2D84,0xA9EE3033,0xA4AD16EA,0xA06C0B5D,
+            0xD4326D90,0xD0F37027,0xDDB056FE,0xD9714B49,0xC7361B4C,0xC3F706FB,0xCEB42022,0xCA753D95,
+            0xF23A8028,0xF6FB9D9F,0xFBB8BB46,0xFF79A6F1,0xE13EF6F4,0xE5FFEB43,0xE8BCCD9A,0xEC7DD02D,
+            0x34867077,0x30476DC0,0x3D044B19,0x39C556AE,0x278206AB,0x23431B1C,0x2E003DC5,0x2AC12072,
+            0x128E9DCF,0x164F8078,0x1B0CA6A1,0x1FCDBB16,0x018AEB13,0x054BF6A4,0x0808D07D,0x0CC9CDCA,
+            0x7897AB07,0x7C56B6B0,0x71159069,0x75D48DDE,0x6B93DDDB,0x6F52C06C,0x6211E6B5,0x66D0FB02,
+            0x5E9F46BF,0x5A5E5B08,0x571D7DD1,0x53DC6066,0x4D9B3063,0x495A2DD4,0x44190B0D,0x40D816BA,
+            0xACA5C697,0xA864DB20,0xA527FDF9,0xA1E6E04E,0xBFA1B04B,0xBB60ADFC,0xB6238B25,0xB2E29692,
+            0x8AAD2B2F,0x8E6C3698,0x832F1041,0x87EE0DF6,0x99A95DF3,0x9D684044,0x902B669D,0x94EA7B2A,
+            0xE0B41DE7,0xE4750050,0xE9362689,0xEDF73B3E,0xF3B06B3B,0xF771768C,0xFA325055,0xFEF34DE2,
+            0xC6BCF05F,0xC27DEDE8,0xCF3ECB31,0xCBFFD686,0xD5B88683,0xD1799B34,0xDC3ABDED,0xD8FBA05A,
+            0x690CE0EE,0x6DCDFD59,0x608EDB80,0x644FC637,0x7A089632,0x7EC98B85,0x738AAD5C,0x774BB0EB,
+            0x4F040D56,0x4BC510E1,0x46863638,0x42472B8F,0x5C007B8A,0x58C1663D,0x558240E4,0x51435D53,
+            0x251D3B9E,0x21DC2629,0x2C9F00F0,0x285E1D47,0x36194D42,0x32D850F5,0x3F9B762C,0x3B5A6B9B,
+            0x0315D626,0x07D4CB91,0x0A97ED48,0x0E56F0FF,0x1011A0FA,0x14D0BD4D,0x19939B94,0x1D528623,
+            0xF12F560E,0xF5EE4BB9,0xF8AD6D60,0xFC6C70D7,0xE22B20D2,0xE6EA3D65,0xEBA91BBC,0xEF68060B,
+            0xD727BBB6,0xD3E6A601,0xDEA580D8,0xDA649D6F,0xC423CD6A,0xC0E2D0DD,0xCDA1F604,0xC960EBB3,
+            0xBD3E8D7E,0xB9FF90C9,0xB4BCB610,0xB07DABA7,0xAE3AFBA2,0xAAFBE615,0xA7B8C0CC,0xA379DD7B,
+            0x9B3660C6,0x9FF77D71,0x92B45BA8,0x9675461F,0x8832161A,0x8CF30BAD,0x81B02D74,0x857130C3,
+            0x5D8A9099,0x594B8D2E,0x5408ABF7,0x50C9B640,0x4E8EE645,0x4A4FFBF2,0x470CDD2B,0x43CDC09C,
+            0x7B827D21,0x7F436096,0x7200464F,0x76C15BF8,0x68860BFD,0x6C47164A,0x61043093,0x65C52D24,
+            0x119B4BE9,0x155A565E,0x18197087,0x1CD86D30,0x029F3D35,0x065E2082,0x0B1D065B,0x0FDC1BEC,
+            0x3793A651,0x3352BBE6,0x3E119D3F,0x3AD08088,0x2497D08D,0x2056CD3A,0x2D15EBE3,0x29D4F654,
+            0xC5A92679,0xC1683BCE,0xCC2B1D17,0xC8EA00A0,0xD6AD50A5,0xD26C4D12,0xDF2F6BCB,0xDBEE767C,
+            0xE3A1CBC1,0xE760D676,0xEA23F0AF,0xEEE2ED18,0xF0A5BD1D,0xF464A0AA,0xF9278673,0xFDE69BC4,
+            0x89B8FD09,0x8D79E0BE,0x803AC667,0x84FBDBD0,0x9ABC8BD5,0x9E7D9662,0x933EB0BB,0x97FFAD0C,
+            0xAFB010B1,0xAB710D06,0xA6322BDF,0xA2F33668,0xBCB4666D,0xB8757BDA,0xB5365D03,0xB1F740B4
+        },
+        {
+            0x00000000,0xD219C1DC,0xA0F29E0F,0x72EB5FD3,0x452421A9,0x973DE075,0xE5D6BFA6,0x37CF7E7A,
+            0x8A484352,0x5851828E,0x2ABADD5D,0xF8A31C81,0xCF6C62FB,0x1D75A327,0x6F9EFCF4,0xBD873D28,
+            0x10519B13,0xC2485ACF,0xB0A3051C,0x62BAC4C0,0x5575BABA,0x876C7B66,0xF58724B5,0x279EE569,
+            0x9A19D841,0x4800199D,0x3AEB464E,0xE8F28792,0xDF3DF9E8,0x0D243834,0x7FCF67E7,0xADD6A63B,
+            0x20A33626,0xF2BAF7FA,0x8051A829,0x524869F5,0x6587178F,0xB79ED653,0xC5758980,0x176C485C,
+            0xAAEB7574,0x78F2B4A8,0x0A19EB7B,0xD8002AA7,0xEFCF54DD,0x3DD69501,0x4F3DCAD2,0x9D240B0E,
+            0x30F2AD35,0xE2EB6CE9,0x9000333A,0x4219F2E6,0x75D68C9C,0xA7CF4D40,0xD5241293,0x073DD34F,
+            0xBABAEE67,0x68A32FBB,0x1A487068,0xC851B1B4,0xFF9ECFCE,0x2D870E12,0x5F6C51C1,0x8D75901D,
+            0x41466C4C,0x935FAD90,0xE1B4F243,0x33AD339F,0x04624DE5,0xD67B8C39,0xA490D3EA,0x76891236,
+            0xCB0E2F1E,0x1917EEC2,0x6BFCB111,0xB9E570CD,0x8E2A0EB7,0x5C33CF6B,0x2ED890B8,0xFCC15164,
+            0x5117F75F,0x830E3683,0xF1E56950,0x23FCA88C,0x1433D6F6,0xC62A172A,0xB4C148F9,0x66D88925,
+            0xDB5FB40D,0x094675D1,0x7BAD2A02,0xA9B4EBDE,0x9E7B95A4,0x4C625478,0x3E890BAB,0xEC90CA77,
+            0x61E55A6A,0xB3FC9BB6,0xC117C465,0x130E05B9,0x24C17BC3,0xF6D8BA1F,0x8433E5CC,0x562A2410,
+            0xEBAD1938,0x39B4D8E4,0x4B5F8737,0x994646EB,0xAE893891,0x7C90F94D,0x0E7BA69E,0xDC626742,
+            0x71B4C179,0xA3AD00A5,0xD1465F76,0x035F9EAA,0x3490E0D0,0xE689210C,0x94627EDF,0x467BBF03,
+            0xFBFC822B,0x29E543F7,0x5B0E1C24,0x8917DDF8,0xBED8A382,0x6CC1625E,0x1E2A3D8D,0xCC33FC51,
+            0x828CD898,0x50951944,0x227E4697,0xF067874B,0xC7A8F931,0x15B138ED,0x675A673E,0xB543A6E2,
+            0x08C49BCA,0xDADD5A16,0xA83605C5,0x7A2FC419,0x4DE0BA63,0x9FF97BBF,0xED12246C,0x3F0BE5B0,
+            0x92DD438B,0x40C48257,0x322FDD84,0xE0361C58,0xD7F96222,0x05E0A3FE,0x770BFC2D,0xA5123DF1,
+            0x189500D9,0xCA8CC105,0xB8679ED6,0x6A7E5F0A,0x5DB12170,0x8FA8E0AC,0xFD43BF7F,0x2F5A7EA3,
+            0xA22FEEBE,0x70362F62,0x02DD70B1,0xD0C4B16D,0xE70BCF17,0x35120ECB,0x47F95118,0x95E090C4,
+            0x2867ADEC,0xFA7E6C30,0x889533E3,0x5A8CF23F,0x6D438C45,0xBF5A4D99,0xCDB1124A,0x1FA8D396,
+            0xB27E75AD,0x6067B471,0x128CEBA2,0xC0952A7E,0xF75A5404,0x254395D8,0x57A8CA0B,0x85B10BD7,
+            0x383636FF,0xEA2FF723,0x98C4A8F0,0x4ADD692C,0x7D121756,0xAF0BD68A,0xDDE08959,0x0FF94885,
+            0xC3CAB4D4,0x11D37508,0x63382ADB,0xB121EB07,0x86EE957D,0x54F754A1,0x261C0B72,0xF405CAAE,
+            0x4982F786,0x9B9B365A,0xE9706989,0x3B69A855,0x0CA6D62F,0xDEBF17F3,0xAC544820,0x7E4D89FC,
+            0xD39B2FC7,0x0182EE1B,0x7369B1C8,0xA1707014,0x96BF0E6E,0x44A6CFB2,0x364D9061,0xE45451BD,
+            0x59D36C95,0x8BCAAD49,0xF921F29A,0x2B383346,0x1CF74D3C,0xCEEE8CE0,0xBC05D333,0x6E1C12EF,
+            0xE36982F2,0x3170432E,0x439B1CFD,0x9182DD21,0xA64DA35B,0x74546287,0x06BF3D54,0xD4A6FC88,
+            0x6921C1A0,0xBB38007C,0xC9D35FAF,0x1BCA9E73,0x2C05E009,0xFE1C21D5,0x8CF77E06,0x5EEEBFDA,
+            0xF33819E1,0x2121D83D,0x53CA87EE,0x81D34632,0xB61C3848,0x6405F994,0x16EEA647,0xC4F7679B,
+            0x79705AB3,0xAB699B6F,0xD982C4BC,0x0B9B0560,0x3C547B1A,0xEE4DBAC6,0x9CA6E515,0x4EBF24C9
+        },
+        {
+            0x00000000,0x01D8AC87,0x03B1590E,0x0269F589,0x0762B21C,0x06BA1E9B,0x04D3EB12,0x050B4795,
+            0x0EC56438,0x0F1DC8BF,0x0D743D36,0x0CAC91B1,0x09A7D624,0x087F7AA3,0x0A168F2A,0x0BCE23AD,
+            0x1D8AC870,0x1C5264F7,0x1E3B917E,0x1FE33DF9,0x1AE87A6C,0x1B30D6EB,0x19592362,0x18818FE5,
+            0x134FAC48,0x129700CF,0x10FEF546,0x112659C1,0x142D1E54,0x15F5B2D3,0x179C475A,0x1644EBDD,
+            0x3B1590E0,0x3ACD3C67,0x38A4C9EE,0x397C6569,0x3C7722FC,0x3DAF8E7B,0x3FC67BF2,0x3E1ED775,
+            0x35D0F4D8,0x3408585F,0x3661ADD6,0x37B90151,0x32B246C4,0x336AEA43,0x31031FCA,0x30DBB34D,
+            0x269F5890,0x2747F417,0x252E019E,0x24F6AD19,0x21FDEA8C,0x2025460B,0x224CB382,0x23941F05,
+            0x285A3CA8,0x2982902F,0x2BEB65A6,0x2A33C921,0x2F388EB4,0x2EE02233,0x2C89D7BA,0x2D517B3D,
+            0x762B21C0,0x77F38D47,0x759A78CE,0x7442D449,0x714993DC,0x70913F5B,0x72F8CAD2,0x73206655,
+            0x78EE45F8,0x7936E97F,0x7B5F1CF6,0x7A87B071,0x7F8CF7E4,0x7E545B63,0x7C3DAEEA,0x7DE5026D,
+            0x6BA1E9B0,0x6A794537,0x6810B0BE,0x69C81C39,0x6CC35BAC,0x6D1BF72B,0x6F7202A2,0x6EAAAE25,
+            0x65648D88,0x64BC210F,0x66D5D486,0x670D7801,0x62063F94,0x63DE9313,0x61B7669A,0x606FCA1D,
+            0x4D3EB120,0x4CE61DA7,0x4E8FE82E,0x4F5744A9,0x4A5C033C,0x4B84AFBB,0x49ED5A32,0x4835F6B5,
+            0x43FBD518,0x4223799F,0x404A8C16,0x41922091,0x44996704,0x4541CB83,0x47283E0A,0x46F0928D,
+            0x50B47950,0x516CD5D7,0x5305205E,0x52DD8CD9,0x57D6CB4C,0x560E67CB,0x54679242,0x55BF3EC5,
+            0x5E711D68,0x5FA9B1EF,0x5DC04466,0x5C18E8E1,0x5913AF74,0x58CB03F3,0x5AA2F67A,0x5B7A5AFD,
+            0xEC564380,0xED8EEF07,0xEFE71A8E,0xEE3FB609,0xEB34F19C,0xEAEC5D1B,0xE885A892,0xE95D0415,
+            0xE29327B8,0xE34B8B3F,0xE1227EB6,0xE0FAD231,0xE5F195A4,0xE4293923,0xE640CCAA,0xE798602D,
+            0xF1DC8BF0,0xF0042777,0xF26DD2FE,0xF3B57E79,0xF6BE39EC,0xF766956B,0xF50F60E2,0xF4D7CC65,
+            0xFF19EFC8,0xFEC1434F,0xFCA8B6C6,0xFD701A41,0xF87B5DD4,0xF9A3F153,0xFBCA04DA,0xFA12A85D,
+            0xD743D360,0xD69B7FE7,0xD4F28A6E,0xD52A26E9,0xD021617C,0xD1F9CDFB,0xD3903872,0xD24894F5,
+            0xD986B758,0xD85E1BDF,0xDA37EE56,0xDBEF42D1,0xDEE40544,0xDF3CA9C3,0xDD555C4A,0xDC8DF0CD,
+            0xCAC91B10,0xCB11B797,0xC978421E,0xC8A0EE99,0xCDABA90C,0xCC73058B,0xCE1AF002,0xCFC25C85,
+            0xC40C7F28,0xC5D4D3AF,0xC7BD2626,0xC6658AA1,0xC36ECD34,0xC2B661B3,0xC0DF943A,0xC10738BD,
+            0x9A7D6240,0x9BA5CEC7,0x99CC3B4E,0x981497C9,0x9D1FD05C,0x9CC77CDB,0x9EAE8952,0x9F7625D5,
+            0x94B80678,0x9560AAFF,0x97095F76,0x96D1F3F1,0x93DAB464,0x920218E3,0x906BED6A,0x91B341ED,
+            0x87F7AA30,0x862F06B7,0x8446F33E,0x859E5FB9,0x8095182C,0x814DB4AB,0x83244122,0x82FCEDA5,
+            0x8932CE08,0x88EA628F,0x8A839706,0x8B5B3B81,0x8E507C14,0x8F88D093,0x8DE1251A,0x8C39899D,
+            0xA168F2A0,0xA0B05E27,0xA2D9ABAE,0xA3010729,0xA60A40BC,0xA7D2EC3B,0xA5BB19B2,0xA463B535,
+            0xAFAD9698,0xAE753A1F,0xAC1CCF96,0xADC46311,0xA8CF2484,0xA9178803,0xAB7E7D8A,0xAAA6D10D,
+            0xBCE23AD0,0xBD3A9657,0xBF5363DE,0xBE8BCF59,0xBB8088CC,0xBA58244B,0xB831D1C2,0xB9E97D45,
+            0xB2275EE8,0xB3FFF26F,0xB19607E6,0xB04EAB61,0xB545ECF4,0xB49D4073,0xB6F4B5FA,0xB72C197D
+        },
+        {
+            0x00000000,0xDC6D9AB7,0xBC1A28D9,0x6077B26E,0x7CF54C05,0xA098D6B2,0xC0EF64DC,0x1C82FE6B,
+            0xF9EA980A,0x258702BD,0x45F0B0D3,0x999D2A64,0x851FD40F,0x59724EB8,0x3905FCD6,0xE5686661,
+            0xF7142DA3,0x2B79B714,0x4B0E057A,0x97639FCD,0x8BE161A6,0x578CFB11,0x37FB497F,0xEB96D3C8,
+            0x0EFEB5A9,0xD2932F1E,0xB2E49D70,0x6E8907C7,0x720BF9AC,0xAE66631B,0xCE11D175,0x127C4BC2,
+            0xEAE946F1,0x3684DC46,0x56F36E28,0x8A9EF49F,0x961C0AF4,0x4A719043,0x2A06222D,0xF66BB89A,
+            0x1303DEFB,0xCF6E444C,0xAF19F622,0x73746C95,0x6FF692FE,0xB39B0849,0xD3ECBA27,0x0F812090,
+            0x1DFD6B52,0xC190F1E5,0xA1E7438B,0x7D8AD93C,0x61082757,0xBD65BDE0,0xDD120F8E,0x017F9539,
+            0xE417F358,0x387A69EF,0x580DDB81,0x84604136,0x98E2BF5D,0x448F25EA,0x24F89784,0xF8950D33,
+            0xD1139055,0x0D7E0AE2,0x6D09B88C,0xB164223B,0xADE6DC50,0x718B46E7,0x11FCF489,0xCD916E3E,
+            0x28F9085F,0xF49492E8,0x94E32086,0x488EBA31,0x540C445A,0x8861DEED,0xE8166C83,0x347BF634,
+            0x2607BDF6,0xFA6A2741,0x9A1D952F,0x46700F98,0x5AF2F1F3,0x869F6B44,0xE6E8D92A,0x3A85439D,
+            0xDFED25FC,0x0380BF4B,0x63F70D25,0xBF9A9792,0xA31869F9,0x7F75F34E,0x1F024120,0xC36FDB97,
+            0x3BFAD6A4,0xE7974C13,0x87E0FE7D,0x5B8D64CA,0x470F9AA1,0x9B620016,0xFB15B278,0x277828CF,
+            0xC2104EAE,0x1E7DD419,0x7E0A6677,0xA267FCC0,0xBEE502AB,0x6288981C,0x02FF2A72,0xDE92B0C5,
+            0xCCEEFB07,0x108361B0,0x70F4D3DE,0xAC994969,0xB01BB702,0x6C762DB5,0x0C019FDB,0xD06C056C,
+            0x3504630D,0xE969F9BA,0x891E4BD4,0x5573D163,0x49F12F08,0x959CB5BF,0xF5EB07D1,0x29869D66,
+            0xA6E63D1D,0x7A8BA7AA,0x1AFC15C4,0xC6918F73,0xDA137118,0x067EEBAF,0x660959C1,0xBA64C376,
+            0x5F0CA517,0x83613FA0,0xE3168DCE,0x3F7B1779,0x23F9E912,0xFF9473A5,0x9FE3C1CB,0x438E5B7C,
+            0x51F210BE,0x8D9F8A09,0xEDE83867,0x3185A2D0,0x2D075CBB,0xF16AC60C,0x911D7462,0x4D70EED5,
+            0xA81888B4,0x74751203,0x1402A06D,0xC86F3ADA,0xD4EDC4B1,0x08805E06,0x68F7EC68,0xB49A76DF,
+            0x4C0F7BEC,0x9062E15B,0xF0155335,0x2C78C982,0x30FA37E9,0xEC97AD5E,0x8CE01F30,0x508D8587,
+            0xB5E5E3E6,0x69887951,0x09FFCB3F,0xD5925188,0xC910AFE3,0x157D3554,0x750A873A,0xA9671D8D,
+            0xBB1B564F,0x6776CCF8,0x07017E96,0xDB6CE421,0xC7EE1A4A,0x1B8380FD,0x7BF43293,0xA799A824,
+            0x42F1CE45,0x9E9C54F2,0xFEEBE69C,0x22867C2B,0x3E048240,0xE26918F7,0x821EAA99,0x5E73302E,
+            0x77F5AD48,0xAB9837FF,0xCBEF8591,0x17821F26,0x0B00E14D,0xD76D7BFA,0xB71AC994,0x6B775323,
+            0x8E1F3542,0x5272AFF5,0x32051D9B,0xEE68872C,0xF2EA7947,0x2E87E3F0,0x4EF0519E,0x929DCB29,
+            0x80E180EB,0x5C8C1A5C,0x3CFBA832,0xE0963285,0xFC14CCEE,0x20795659,0x400EE437,0x9C637E80,
+            0x790B18E1,0xA5668256,0xC5113038,0x197CAA8F,0x05FE54E4,0xD993CE53,0xB9E47C3D,0x6589E68A,
+            0x9D1CEBB9,0x4171710E,0x2106C360,0xFD6B59D7,0xE1E9A7BC,0x3D843D0B,0x5DF38F65,0x819E15D2,
+            0x64F673B3,0xB89BE904,0xD8EC5B6A,0x0481C1DD,0x18033FB6,0xC46EA501,0xA419176F,0x78748DD8,
+            0x6A08C61A,0xB6655CAD,0xD612EEC3,0x0A7F7474,0x16FD8A1F,0xCA9010A8,0xAAE7A2C6,0x768A3871,
+            0x93E25E10,0x4F8FC4A7,0x2FF876C9,0xF395EC7E,0xEF171215,0x337A88A2,0x530D3ACC,0x8F60A07B
+        }
+    };
+
+    while (size > 0)
+    {
+        crc = crc ^ CrcWord(&input, &size);
+        crc = CrcTable[3][crc >> 24] ^ CrcTable[2][(crc >> 16) & 0xFF] ^ CrcTable[1][(crc >> 8) & 0xFF] ^ CrcTable[0][crc & 0xFF];
+    }
+    return(crc);
+}
+#endif
+
+
+#ifdef MTP_CRC_HW
+/* Same CRC in the STM32 CRC unit, see usbd_mtp_core.h for who may use it. The
+ * unit starts at 0xFFFFFFFF, the seed is applied by folding it into the first
+ * word. Units with a programmable initial value and polynomial get the
+ * defaults back first, the reset then loads INIT, and writing CR whole also
+ * clears the bit reversal and polynomial size settings of another user. */
+static uint32_t
+Crc32Hw(uint32_t crc, const char* input, size_t size)
+{
+    if (size == 0)
+    {
+        return(crc);
+    }
+    __HAL_RCC_CRC_CLK_ENABLE();
+#ifdef CRC_INIT_INIT
+    CRC->INIT = 0xFFFFFFFF;
+#endif
+#ifdef CRC_POL_POL
+    CRC->POL = 0x04C11DB7;
+#endif
+    CRC->CR = CRC_CR_RESET;
+    CRC->DR = CrcWord(&input, &size) ^ crc ^ 0xFFFFFFFF;
+    while (size > 0)
+    {
+        CRC->DR = CrcWord(&input, &size);
+    }
+    return(CRC->DR);
+}
+#endif
+
+#if defined(MTP_CRC_HW)
+    #define Crc32       Crc32Hw
+#elif defined(MTP_CRC_SLICE4)
+    #define Crc32       Crc32Slice4
+#else
+    #define Crc32       Crc32Nibble
+#endif
+
+
+#ifdef MTP_CRC_BENCHMARK
+#ifndef MTP_BENCHMARK_TIME
+    #define MTP_BENCHMARK_TIME()    HAL_GetTick()   // Millisecond time base
+#endif
+
+/* Time the CRC variants over a list of typical file names, and check that
+ * they all give the same handles. Returns false on a mismatch. */
+bool
+MtpCrcBenchmark(uint32_t rounds)
+{
+    static const char* const vNames[] =
+    {
+        "DCIM", "100MEDIA", "IMG_0001.JPG", "IMG_0427.JPG", "DSC04211.ARW", "MOV_0012.MP4",
+        "README.TXT", "CONFIG.INI", "L0001.LOG", "L0037.LOG", "FIRMWARE.FWX", "index.html",
+        "System Volume Information", "Quarterly report 2024 (final).docx",
+        "measurement_2024-03-18T14-22-05.csv", "a", "ab", "abc",
+    };
+    static const struct
+    {
+        const char* name;
+        uint32_t (*proc)(uint32_t crc, const char* input, size_t size);
+    }
+    vVariants[] =
+    {
+        {"nibble", Crc32Nibble},
+        {"slice4", Crc32Slice4},
+    #ifdef MTP_CRC_HW
+        {"hw", Crc32Hw},
+    #endif
+    };
+    size_t len[sizeof(vNames) / sizeof(vNames[0])];
+    volatile uint32_t sink = 0;
+    uint32_t start;
+    uint32_t r, i, v;
+    bool ret = true;
+
+    for (i = 0; i < sizeof(vNames) / sizeof(vNames[0]); i++)
+    {
+        len[i] = strlen(vNames[i]);
+    }
+    for (v = 0; v < sizeof(vVariants) / sizeof(vVariants[0]); v++)
+    {
+        // Same results as the reference, also with the seeds used by the folder index
+        for (i = 0; i < sizeof(vNames) / sizeof(vNames[0]); i++)
+        {
+            if (((vVariants[v].proc)(0xFFFFFFFF, vNames[i], len[i]) != Crc32Nibble(0xFFFFFFFF, vNames[i], len[i])) ||
+                ((vVariants[v].proc)(i * 0x9E3779B1UL, vNames[i], len[i]) != Crc32Nibble(i * 0x9E3779B1UL, vNames[i], len[i])))
+            {
+                MTP_DBG_LVL0("%s[%u] %s differs on %s", __FUNCTION__, __LINE__, vVariants[v].name, vNames[i]);
+                ret = false;
+            }
+        }
+
+        start = MTP_BENCHMARK_TIME();
+        for (r = 0; r < rounds; r++)
+        {
+            for (i = 0; i < sizeof(vNames) / sizeof(vNames[0]); i++)
+            {
+                sink ^= (vVariants[v].proc)(0xFFFFFFFF, vNames[i], len[i]);
+            }
+        }
+        MTP_DBG_LVL0("%s[%u] %s: %lu names in %lu ms", __FUNCTION__, __LINE__, vVariants[v].name,
+                (unsigned long)(rounds * (sizeof(vNames) / sizeof(vNames[0]))), (unsigned long)(MTP_BENCHMARK_TIME() - start));
+    }
+    (void)sink;
+    return(ret);
+}
+#endif
+
+
+uint32_t
+HandleFilenameBits(char* input)
+{
+    uint32_t crc = Crc32(0xFFFFFFFF, input, strlen(input));
+
+    crc &= INODE_ITEM_MASK;
+    if (crc == 1)	// file ID 0 is reserved by MTP
+    {
+        crc = 1;
+    }
+    if (crc == INODE_ITEM_MASK)	// file ID -1 is used for directory entries
+    {
+        crc = INODE_ITEM_MASK - 1;
+    }
+    return(crc);
+}
+
+
+#if (MTP_HANDLE_INDEX_SIZE > 0) || (MTP_RENAME_ALIASES > 0)
+/* Append 'name' to the folder path and read the current info of the file. When
+ * the file is gone the path is restored. */
+static bool
+FolderEntryStat(char* path, const char* name, VfsInfo_t* info)
+{
+    size_t n = strlen(path);
+    char* p;
+
+    if (p = strrchr(path, '/'), (p == nullptr) || (p[1] != '\0'))
+    {
+        strcat(path, "/");
+    }
+    strcat(path, name);
+    if (vfs_stat(path, info) == 0)
+    {
+        strcpy(info->name, name);
+        return(true);
+    }
+    path[n] = '\0';
+    return(false);
+}
+#endif
+
+
+#if (MTP_HANDLE_INDEX_SIZE > 0)
+#define HANDLE_INDEX_PROBES     8
+#define HANDLE_INDEX_HASH(h)    (((h) * 0x9E3779B1UL) >> 16)    // Names differing in a few characters give close handles
+
+/* Name of an enumerated file, enough to resolve its path without scanning the
+ * folder again. Size, dates and attributes are not kept: the firmware may
+ * change the file at any time, so they are read from the file system at each
+ * lookup. Entries are refreshed each time the folder is listed. */
+typedef struct HandleIndex_s
+{
+    uint32_t handle;        // 0 marks a free entry
+    uint16_t name;          // Offset of the name in vHandleNames
+} HandleIndex_t;
+
+_Static_assert(MTP_HANDLE_NAME_POOL <= 65535, "MTP_HANDLE_NAME_POOL too large for the 16 bit name offset");
+
+static HandleIndex_t vHandleIndex[MTP_HANDLE_INDEX_SIZE];
+static char vHandleNames[MTP_HANDLE_NAME_POOL];
+static uint32_t vHandleNamesUsed = 0;
+
+
+static void
+HandleIndexClear(void)
+{
+    memset(vHandleIndex, 0, sizeof(vHandleIndex));
+    vHandleNamesUsed = 0;
+}
+
+
+static HandleIndex_t*
+HandleIndexFind(uint32_t handle)
+{
+    uint32_t i;
+    uint32_t x = HANDLE_INDEX_HASH(handle);
+
+    if (handle != 0)
+    {
+        for (i = 0; i < HANDLE_INDEX_PROBES; i++)
+        {
+            if (vHandleIndex[(x + i) & (MTP_HANDLE_INDEX_SIZE - 1)].handle == handle)
+            {
+                return(&vHandleIndex[(x + i) & (MTP_HANDLE_INDEX_SIZE - 1)]);
+            }
+        }
+    }
+    return(nullptr);
+}
+
+
+static void
+HandleIndexAdd(uint32_t handle, const char* name)
+{
+    HandleIndex_t* e;
+    uint32_t i;
+    uint32_t x = HANDLE_INDEX_HASH(handle);
+    size_t n = strlen(name) + 1;
+
+    if (e = HandleIndexFind(handle), e != nullptr)
+    {
+        if (strcmp(&vHandleNames[e->name], name) == 0)
+        {
+            n = 0;  // Known name, keep it where it is
+        }
+    }
+    else
+    {
+        // Take a free entry near the home position, or replace the one at home
+        e = &vHandleIndex[x & (MTP_HANDLE_INDEX_SIZE - 1)];
+        for (i = 0; i < HANDLE_INDEX_PROBES; i++)
+        {
+            if (vHandleIndex[(x + i) & (MTP_HANDLE_INDEX_SIZE - 1)].handle == 0)
+            {
+                e = &vHandleIndex[(x + i) & (MTP_HANDLE_INDEX_SIZE - 1)];
+                break;
+            }
+        }
+    }
+
+    if (n > 0)
+    {
+        if (n > sizeof(vHandleNames))
+        {
+            return;
+        }
+        if (n > sizeof(vHandleNames) - vHandleNamesUsed)
+        {
+            // Name pool exhausted, start over
+            HandleIndexClear();
+        }
+        e->name = vHandleNamesUsed;
+        memcpy(&vHandleNames[vHandleNamesUsed], name, n);
+        vHandleNamesUsed += n;
+    }
+    e->handle = handle;
+}
+
+
+static void
+HandleIndexRemove(uint32_t handle)
+{
+    HandleIndex_t* e;
+
+    if (e = HandleIndexFind(handle), e != nullptr)
+    {
+        e->handle = 0;
+    }
+}
+
+
+/* Append the indexed name to the folder path and read the current info of the
+ * file. When the file is gone the entry is dropped and the path restored, so
+ * that the folder is scanned instead. */
+static bool
+HandleIndexStat(HandleIndex_t* e, char* path, VfsInfo_t* info)
+{
+    if (FolderEntryStat(path, &vHandleNames[e->name], info))
+    {
+        return(true);
+    }
+    e->handle = 0;
+    return(false);
+}
+#else
+#define HandleIndexClear()
+#define HandleIndexAdd(handle, name)
+#define HandleIndexRemove(handle)
+#endif
+
+
+#if (MTP_LOOKUP_CACHE_SIZE > 0)
+/* Handles resolved most recently, with everything GetFileById() returns. A
+ * host reading properties of a whole listing alternates between objects and
+ * folders, one cached lookup is not enough for that. Any write to the media
+ * clears the cache. */
+typedef struct LookupCache_s
+{
+    uint32_t handle;        // 0 marks a free entry
+    uint32_t used;          // Stamp of the last hit, the lowest one is replaced
+    char path[MAX_PATH + 1];
+    VfsInfo_t info;
+} LookupCache_t;
+
+static LookupCache_t vLookupCache[MTP_LOOKUP_CACHE_SIZE];
+static uint32_t vLookupStamp = 0;
+
+
+static void
+LookupCacheClear(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < MTP_LOOKUP_CACHE_SIZE; i++)
+    {
+        vLookupCache[i].handle = 0;
+    }
+}
+
+
+static LookupCache_t*
+LookupCacheFind(uint32_t handle)
+{
+    uint32_t i;
+
+    for (i = 0; i < MTP_LOOKUP_CACHE_SIZE; i++)
+    {
+        if ((vLookupCache[i].handle == handle) && (handle != 0))
+        {
+            vLookupCache[i].used = ++vLookupStamp;
+            return(&vLookupCache[i]);
+        }
+    }
+    return(nullptr);
+}
+
+
+static void
+LookupCacheAdd(uint32_t handle, const char* path, const VfsInfo_t* info)
+{
+    LookupCache_t* e = &vLookupCache[0];
+    uint32_t i;
+
+    for (i = 0; i < MTP_LOOKUP_CACHE_SIZE; i++)
+    {
+        if (vLookupCache[i].handle == handle)
+        {
+            e = &vLookupCache[i];
+            break;
+        }
+        if ((e->handle != 0) && ((vLookupCache[i].handle == 0) || (vLookupCache[i].used < e->used)))
+        {
+            e = &vLookupCache[i];
+        }
+    }
+    e->handle = handle;
+    e->used = ++vLookupStamp;
+    strcpy(e->path, path);
+    memcpy(&e->info, info, sizeof(VfsInfo_t));
+}
+#else
+#define LookupCacheClear()
+#endif
+
+
+#if (MTP_RENAME_ALIASES > 0)
+/* A renamed file keeps the handle the host knows it by, although its new name
+ * hashes to another one. Unlike the handle index these entries are never
+ * evicted, they last until the session ends or the file is gone. A rename
+ * that does not fit is reported to the host as a removed and an added object. */
+typedef struct RenameAlias_s
+{
+    uint32_t handle;        // Handle from before the rename, 0 marks a free entry
+    uint16_t name;          // Offset of the new name in vAliasNames, the old name follows it
+} RenameAlias_t;
+
+static RenameAlias_t vRenameAlias[MTP_RENAME_ALIASES];
+static char vAliasNames[MTP_RENAME_ALIAS_POOL];
+static uint32_t vAliasNamesUsed = 0;
+
+
+static void
+RenameAliasClear(void)
+{
+    memset(vRenameAlias, 0, sizeof(vRenameAlias));
+    vAliasNamesUsed = 0;
+}
+
+
+static RenameAlias_t*
+RenameAliasFind(uint32_t handle)
+{
+    uint32_t i;
+
+    for (i = 0; (handle != 0) && (i < MTP_RENAME_ALIASES); i++)
+    {
+        if (vRenameAlias[i].handle == handle)
+        {
+            return(&vRenameAlias[i]);
+        }
+    }
+    return(nullptr);
+}
+
+
+/* Drop an alias, the names behind it move down to keep the pool packed */
+static void
+RenameAliasRemove(uint32_t handle)
+{
+    RenameAlias_t* e;
+    uint32_t n;
+    uint32_t i;
+
+    if (e = RenameAliasFind(handle), e == nullptr)
+    {
+        return;
+    }
+    n = strlen(&vAliasNames[e->name]) + 1;
+    n += strlen(&vAliasNames[e->name + n]) + 1;
+    memmove(&vAliasNames[e->name], &vAliasNames[e->name + n], vAliasNamesUsed - e->name - n);
+    vAliasNamesUsed -= n;
+    for (i = 0; i < MTP_RENAME_ALIASES; i++)
+    {
+        if ((vRenameAlias[i].handle != 0) && (vRenameAlias[i].name > e->name))
+        {
+            vRenameAlias[i].name -= n;
+        }
+    }
+    e->handle = 0;
+}
+
+
+/* Keep 'handle' for the file 'old' now called 'name', false when there is no room */
+static bool
+RenameAliasAdd(uint32_t handle, const char* name, const char* old)
+{
+    RenameAlias_t* e;
+    size_t n = strlen(name) + 1;
+    size_t o = strlen(old) + 1;
+
+    RenameAliasRemove(handle);
+    for (e = &vRenameAlias[0]; (e < &vRenameAlias[MTP_RENAME_ALIASES]) && (e->handle != 0); e++)
+    {
+    }
+    if ((e == &vRenameAlias[MTP_RENAME_ALIASES]) || (n + o > sizeof(vAliasNames) - vAliasNamesUsed))
+    {
+        return(false);
+    }
+    e->handle = handle;
+    e->name = vAliasNamesUsed;
+    memcpy(&vAliasNames[vAliasNamesUsed], name, n);
+    memcpy(&vAliasNames[vAliasNamesUsed + n], old, o);
+    vAliasNamesUsed += n + o;
+    return(true);
+}
+
+
+#if VFS_NODIRS != 1
+static bool FolderIndexPath(uint32_t folder, char* path, size_t size);
+#endif
+
+/* True when a file with the old name is back in the folder, it then owns the
+ * handle. Needed when a listing shows the new name before the old one. */
+static bool
+RenameAliasReturned(RenameAlias_t* e)
+{
+    char path[MAX_PATH + 1];
+    VfsInfo_t info;
+    const char* old = &vAliasNames[e->name];
+
+    old += strlen(old) + 1;
+#if VFS_NODIRS != 1
+    if (!FolderIndexPath(e->handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK), path, sizeof(path)))
+    {
+        return(false);
+    }
+#else
+    if (vfs_volume(INODE_STORAGE(e->handle)) == nullptr)
+    {
+        return(false);
+    }
+    strcpy(path, vfs_volume(INODE_STORAGE(e->handle)));
+#endif
+    return(FolderEntryStat(path, old, &info));
+}
+
+
+/* Handle to report for file 'name' in 'folder', 'handle' is the one its name
+ * gives. An alias whose handle is taken by a new file with the old name is
+ * given up, the renamed file goes back to the handle of its new name. */
+static uint32_t
+RenameAliasHandle(uint32_t folder, const char* name, uint32_t handle)
+{
+    RenameAlias_t* e;
+    uint32_t i;
+
+    if (vAliasNamesUsed == 0)
+    {
+        return(handle);
+    }
+    for (i = 0; i < MTP_RENAME_ALIASES; i++)
+    {
+        if ((vRenameAlias[i].handle != 0) && ((vRenameAlias[i].handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK)) == folder) &&
+            (strcmp(&vAliasNames[vRenameAlias[i].name], name) == 0))
+        {
+            if (!RenameAliasReturned(&vRenameAlias[i]))
+            {
+                return(vRenameAlias[i].handle);
+            }
+            e = &vRenameAlias[i];
+        #ifdef MTP_EVENTS
+            PtpEvent(PTP_EVENT_OBJECT_INFO_CHANGED, e->handle);
+            PtpEvent(PTP_EVENT_OBJECT_ADDED, handle);
+        #endif
+            RenameAliasRemove(e->handle);
+            LookupCacheClear();
+            return(handle);
+        }
+    }
+    if (e = RenameAliasFind(handle), e != nullptr)
+    {
+    #ifdef MTP_EVENTS
+        PtpEvent(PTP_EVENT_OBJECT_INFO_CHANGED, handle);
+        PtpEvent(PTP_EVENT_OBJECT_ADDED, HandleFilenameBits(&vAliasNames[e->name]) | folder);
+    #endif
+        RenameAliasRemove(handle);
+        LookupCacheClear();
+    }
+    return(handle);
+}
+
+
+/* As HandleIndexStat(), an alias of a file that is gone is dropped */
+static bool
+RenameAliasStat(RenameAlias_t* e, char* path, VfsInfo_t* info)
+{
+    if (FolderEntryStat(path, &vAliasNames[e->name], info))
+    {
+        return(true);
+    }
+    RenameAliasRemove(e->handle);
+    return(false);
+}
+#else
+#define RenameAliasClear()
+#define RenameAliasRemove(handle)
+#define RenameAliasAdd(handle, name, old)           (false)
+#define RenameAliasHandle(folder, name, handle)     (handle)
+#endif
+
+
+#if VFS_NODIRS != 1
+/* The folder index is a file of fixed size records on each volume, the record
+ * number is the folder part of the handle. A folder path is built by walking
+ * the parent records up to the root, a folder is found by parent and name
+ * through a table of hash buckets between the header and the records, each
+ * bucket chains its records. The index is kept between sessions so folder
+ * handles stay valid. Every create, delete and rename updates the index in
+ * place and flags the header dirty while it does; a change that did not
+ * finish, or a different volume in the slot, causes a rebuild. Records of
+ * deleted folders are chained in a free list and reused by the next new
+ * folder. A folder removed while no session was open is dropped from the index
+ * when its handle no longer resolves. */
+#define FOLDER_INDEX_MAGIC      0x4D54504D  // "MPTM"
+#define FOLDER_INDEX_VERSION    5
+#define FOLDER_ROOT             (INODE_FOLDER_MASK >> INODE_ITEM_BITS)  // Folder number of the root, never stored
+#define FOLDER_HANDLE(storage, x)   (((uint32_t)(storage) << (32 - INODE_STORAGE_BITS)) | ((uint32_t)(x) << INODE_ITEM_BITS))
+#define FOLDER_BUCKET_OFFSET(hash)  (sizeof(FolderIndexHeader_t) + ((hash) & (MTP_FOLDER_HASH_SIZE - 1)) * sizeof(uint32_t))
+#define FOLDER_RECORD_OFFSET(x)     (sizeof(FolderIndexHeader_t) + MTP_FOLDER_HASH_SIZE * sizeof(uint32_t) + ((x) - 1) * sizeof(FolderRecord_t))
+
+#if (MTP_FOLDER_HASH_SIZE & (MTP_FOLDER_HASH_SIZE - 1)) != 0
+    #error "MTP_FOLDER_HASH_SIZE must be a power of 2"
+#endif
+
+typedef struct FolderIndexHeader_s
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordsize;
+    uint32_t count;         // Number of folder records following the header
+    uint32_t free;          // First record of the free list, 0 when empty
+    uint32_t volume;        // Fingerprint of the volume the index belongs to
+    uint32_t dirty;         // Non zero while a change is written
+    uint32_t buckets;       // Number of hash buckets following the header
+} FolderIndexHeader_t;
+
+typedef struct FolderRecord_s
+{
+    uint32_t parent;        // Handle of the parent folder, 0 for a free record
+    uint32_t hash;          // Hash of parent handle and name
+    uint32_t next;          // Next record in the same bucket, next free record for a free record
+    char name[sizeof(((VfsInfo_t*)0)->name)];
+} FolderRecord_t;
+
+static VfsFile_t vFolderFile;
+static FolderRecord_t vFolderRecord;    // Scratch record, too big for the stack with long file names
+static uint32_t vFolderCount[1 << INODE_STORAGE_BITS];
+static uint32_t vFolderFree[1 << INODE_STORAGE_BITS];
+static uint32_t vFolderIndexValid = 0;     // Storages with a folder index in use
+static uint32_t vFolderParentOf = 0;       // Folder of the last FolderIndexParent() lookup, 0 when none
+static uint32_t vFolderParent;
+
+
+static bool
+FolderIndexOpen(uint32_t storage, int mode)
+{
+    char tmp[13];
+    int err;
+
+    if (vfs_volume(storage) == nullptr)
+    {
+        return(false);
+    }
+    siprintf(tmp, "%s%s", vfs_volume(storage), MTP_FOLDER_CACHE_FILE);
+    if (err = vfs_file_open(&vFolderFile, tmp, mode), err != 0)
+    {
+        MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), tmp);
+        return(false);
+    }
+    return(true);
+}
+
+
+static bool
+FolderIndexRead(uint32_t x)
+{
+    if ((x == 0) || (x >= FOLDER_ROOT))
+    {
+        return(false);
+    }
+    if (vfs_file_seek(&vFolderFile, FOLDER_RECORD_OFFSET(x), SEEK_SET) != 0)
+    {
+        return(false);
+    }
+    return(vfs_file_read(&vFolderFile, &vFolderRecord, sizeof(vFolderRecord)) == sizeof(vFolderRecord));
+}
+
+
+static bool
+FolderIndexWrite(uint32_t x)
+{
+    return((vfs_file_seek(&vFolderFile, FOLDER_RECORD_OFFSET(x), SEEK_SET) == 0) &&
+           (vfs_file_write(&vFolderFile, &vFolderRecord, sizeof(vFolderRecord)) == sizeof(vFolderRecord)));
+}
+
+
+/* First record in the bucket of 'hash', 0 when the bucket is empty */
+static uint32_t
+FolderBucketRead(uint32_t hash)
+{
+    uint32_t x;
+
+    if ((vfs_file_seek(&vFolderFile, FOLDER_BUCKET_OFFSET(hash), SEEK_SET) != 0) ||
+        (vfs_file_read(&vFolderFile, &x, sizeof(x)) != sizeof(x)) || (x >= FOLDER_ROOT))
+    {
+        return(0);
+    }
+    return(x);
+}
+
+
+static bool
+FolderBucketWrite(uint32_t hash, uint32_t x)
+{
+    return((vfs_file_seek(&vFolderFile, FOLDER_BUCKET_OFFSET(hash), SEEK_SET) == 0) &&
+           (vfs_file_write(&vFolderFile, &x, sizeof(x)) == sizeof(x)));
+}
+
+
+/* Flag a change of the index, set before the first write and cleared after the
+ * last one. The flag is synced so that it reaches the medium ahead of the
+ * change. The index file must be open. */
+static bool
+FolderIndexDirty(uint32_t dirty)
+{
+    return((vfs_file_seek(&vFolderFile, offsetof(FolderIndexHeader_t, dirty), SEEK_SET) == 0) &&
+           (vfs_file_write(&vFolderFile, &dirty, sizeof(dirty)) == sizeof(dirty)) &&
+           (vfs_file_sync(&vFolderFile) == 0));
+}
+
+
+/* Take record x out of the chain of its bucket, the index file must be open.
+ * Uses vFolderRecord. */
+static bool
+FolderBucketUnlink(uint32_t storage, uint32_t x, uint32_t hash, uint32_t next)
+{
+    uint32_t prev;
+    uint32_t n;
+
+    if (prev = FolderBucketRead(hash), prev == x)
+    {
+        return(FolderBucketWrite(hash, next));
+    }
+    // Count check protects against a damaged chain
+    for (n = 0; (prev != 0) && (n < vFolderCount[storage]); n++)
+    {
+        if (!FolderIndexRead(prev))
+        {
+            break;
+        }
+        if (vFolderRecord.next == x)
+        {
+            vFolderRecord.next = next;
+            return(FolderIndexWrite(prev));
+        }
+        prev = vFolderRecord.next;
+    }
+    return(false);
+}
+
+
+static uint32_t
+FolderIndexFingerprint(uint32_t storage)
+{
+    VfsInfo_t info;
+
+    if (vfs_stat(vfs_volume(storage), &info) != 0)
+    {
+        return(0);
+    }
+    return(Crc32(info.blocks ^ info.blocksize, info.name, strlen(info.name)));
+}
+
+
+/* Start an empty folder index on a volume */
+static void
+FolderIndexReset(uint32_t storage)
+{
+    FolderIndexHeader_t hdr = {FOLDER_INDEX_MAGIC, FOLDER_INDEX_VERSION, sizeof(FolderRecord_t), 0, 0, 0, 1, MTP_FOLDER_HASH_SIZE};
+    VfsInfo_t info;
+    char tmp[13];
+    uint32_t i;
+    uint32_t n;
+
+    vFolderCount[storage] = 0;
+    vFolderFree[storage] = 0;
+    vFolderParentOf = 0;
+    vFolderIndexValid &= ~(1 << storage);
+    hdr.volume = FolderIndexFingerprint(storage);
+    if (FolderIndexOpen(storage, VFS_RDWR | VFS_CREAT | VFS_TRUNC))
+    {
+        if (vfs_file_write(&vFolderFile, &hdr, sizeof(hdr)) == sizeof(hdr))
+        {
+            // Empty buckets, written a record size at a time
+            memset(&vFolderRecord, 0, sizeof(vFolderRecord));
+            for (i = 0; i < MTP_FOLDER_HASH_SIZE * sizeof(uint32_t); i += n)
+            {
+                n = MTP_FOLDER_HASH_SIZE * sizeof(uint32_t) - i;
+                n = (n > sizeof(vFolderRecord)) ? sizeof(vFolderRecord) : n;
+                if (vfs_file_write(&vFolderFile, &vFolderRecord, n) != n)
+                {
+                    break;
+                }
+            }
+            if ((i >= MTP_FOLDER_HASH_SIZE * sizeof(uint32_t)) && FolderIndexDirty(0))
+            {
+                vFolderIndexValid |= 1 << storage;
+            }
+        }
+        vfs_file_close(&vFolderFile);
+
+        siprintf(tmp, "%s%s", vfs_volume(storage), MTP_FOLDER_CACHE_FILE);
+        if (vfs_stat(tmp, &info) == 0)
+        {
+            if (!(info.attrib & ATR_HID))
+            {
+                info.attrib |= ATR_HID;
+                vfs_touch(tmp, &info);
+            }
+        }
+    }
+}
+
+
+/* Take the folder index of a previous session in use, returns false when it
+ * has to be rebuilt */
+static bool
+FolderIndexLoad(uint32_t storage)
+{
+    FolderIndexHeader_t hdr;
+    bool ret = false;
+
+    if (!FolderIndexOpen(storage, VFS_RDONLY))
+    {
+        return(false);
+    }
+    if ((vfs_file_read(&vFolderFile, &hdr, sizeof(hdr)) == sizeof(hdr)) &&
+        (hdr.magic == FOLDER_INDEX_MAGIC) && (hdr.version == FOLDER_INDEX_VERSION) &&
+        (hdr.recordsize == sizeof(FolderRecord_t)) && (hdr.buckets == MTP_FOLDER_HASH_SIZE) &&
+        (hdr.count < FOLDER_ROOT) && (hdr.free <= hdr.count) &&
+        (hdr.dirty == 0) && (hdr.volume == FolderIndexFingerprint(storage)) &&
+        ((uint32_t)vfs_file_size(&vFolderFile) >= FOLDER_RECORD_OFFSET(hdr.count + 1)))
+    {
+        vFolderCount[storage] = hdr.count;
+        vFolderFree[storage] = hdr.free;
+        vFolderIndexValid |= 1 << storage;
+        ret = true;
+    }
+    vfs_file_close(&vFolderFile);
+    MTP_DBG_LVL1("%s[%u] %s %lu folders", __FUNCTION__, __LINE__, vfs_volume(storage), ret ? hdr.count : 0);
+    return(ret);
+}
+
+
+/* Find folder 'name' in folder 'parent', returns its handle or 0 */
+static uint32_t
+FolderIndexFind(uint32_t parent, const char* name)
+{
+    uint32_t storage = INODE_STORAGE(parent);
+    uint32_t hash = Crc32(parent, name, strlen(name));
+    uint32_t folder = 0;
+    uint32_t n;
+    uint32_t x;
+
+    if (!(vFolderIndexValid & (1 << storage)) || !FolderIndexOpen(storage, VFS_RDONLY))
+    {
+        return(0);
+    }
+    // Count check protects against a damaged chain
+    for (x = FolderBucketRead(hash), n = 0; (x != 0) && (n < vFolderCount[storage]); x = vFolderRecord.next, n++)
+    {
+        if (!FolderIndexRead(x))
+        {
+            break;
+        }
+        // Confirm, the hash may collide
+        if ((vFolderRecord.hash == hash) && (vFolderRecord.parent == parent) && (strcmp(vFolderRecord.name, name) == 0))
+        {
+            folder = FOLDER_HANDLE(storage, x);
+            break;
+        }
+    }
+    vfs_file_close(&vFolderFile);
+    return(folder);
+}
+
+
+/* Find folder 'name' in folder 'parent', add it to the index when it is new */
+static uint32_t
+FolderIndexRegister(uint32_t parent, const char* name)
+{
+    uint32_t storage = INODE_STORAGE(parent);
+    uint32_t folder;
+    uint32_t next = 0;
+    uint32_t x;
+
+    if (folder = FolderIndexFind(parent, name), folder != 0)
+    {
+        return(folder);
+    }
+    if (!(vFolderIndexValid & (1 << storage)))
+    {
+        return(0);
+    }
+    if (x = vFolderCount[storage] + 1, (vFolderFree[storage] == 0) && (x >= FOLDER_ROOT))
+    {
+        MTP_DBG_LVL0("%s[%u] folder index full", __FUNCTION__, __LINE__);
+        return(0);
+    }
+    if (!FolderIndexOpen(storage, VFS_RDWR))
+    {
+        return(0);
+    }
+    if (vFolderFree[storage] != 0)
+    {
+        // Take the first record of the free list
+        x = vFolderFree[storage];
+        if (!FolderIndexRead(x) || (vFolderRecord.parent != 0))
+        {
+            MTP_DBG_LVL0("%s[%u] free list damaged", __FUNCTION__, __LINE__);
+            vfs_file_close(&vFolderFile);
+            return(0);
+        }
+        next = vFolderRecord.next;
+    }
+    if (!FolderIndexDirty(1))
+    {
+        vfs_file_close(&vFolderFile);
+        return(0);
+    }
+    memset(&vFolderRecord, 0, sizeof(vFolderRecord));
+    vFolderRecord.parent = parent;
+    vFolderRecord.hash = Crc32(parent, name, strlen(name));
+    vFolderRecord.next = FolderBucketRead(vFolderRecord.hash);
+    strncpy(vFolderRecord.name, name, sizeof(vFolderRecord.name) - 1);
+
+    if (FolderIndexWrite(x) && FolderBucketWrite(vFolderRecord.hash, x))
+    {
+        if (x == vFolderFree[storage])
+        {
+            vFolderFree[storage] = next;
+            vfs_file_seek(&vFolderFile, offsetof(FolderIndexHeader_t, free), SEEK_SET);
+            vfs_file_write(&vFolderFile, &next, sizeof(next));
+        }
+        else
+        {
+            vfs_file_seek(&vFolderFile, offsetof(FolderIndexHeader_t, count), SEEK_SET);
+            vfs_file_write(&vFolderFile, &x, sizeof(x));
+            vFolderCount[storage] = x;
+        }
+        if (FolderIndexDirty(0))
+        {
+            folder = FOLDER_HANDLE(storage, x);
+        }
+    }
+    if (folder == 0)
+    {
+        // Left dirty, rebuilt by the next session
+        vFolderIndexValid &= ~(1 << storage);
+    }
+    vfs_file_close(&vFolderFile);
+    return(folder);
+}
 
-#ifndef MTP_DBG_LVL0
-    #define MTP_DBG_LVL0(x, ...)
-#endif
-#ifndef MTP_DBG_LVL1
-    #define MTP_DBG_LVL1(x, ...)
-#endif
-#ifndef MTP_DBG_LVL2
-    #define MTP_DBG_LVL2(x, ...)
-#endif
-#ifndef MTP_DBG_LVL3
-    #define MTP_DBG_LVL3(x, ...)
-#endif
 
-#if (MTP_READONLY == 0)
-    #undef MTP_READONLY
-#endif
-#ifdef MTP_FATFS
-    #if (FF_FS_READONLY != 0) && (MTP_READONLY != 1)
-        #define MTP_READONLY FF_FS_READONLY
-    #endif
-#endif
+/* Put record x on the free list, the index file must be open */
+static bool
+FolderIndexFree(uint32_t storage, uint32_t x)
+{
+    if (!FolderIndexRead(x) || (vFolderRecord.parent == 0) ||
+        !FolderBucketUnlink(storage, x, vFolderRecord.hash, vFolderRecord.next))
+    {
+        return(false);
+    }
+    vFolderParentOf = 0;
 
-#ifndef MTP_MANUFACTURER
-    #define MTP_MANUFACTURER        "White Bream"
-#endif
-#ifndef MTP_FRIENDLYNAME
-    #define MTP_FRIENDLYNAME        "STM32 MTP Class"
-#endif
-#ifndef MTP_SERIAL
-    #define MTP_SERIAL              "0123456789"
-#endif
+    memset(&vFolderRecord, 0, sizeof(vFolderRecord));
+    vFolderRecord.next = vFolderFree[storage];
+    if (FolderIndexWrite(x))
+    {
+        vFolderFree[storage] = x;
+        vfs_file_seek(&vFolderFile, offsetof(FolderIndexHeader_t, free), SEEK_SET);
+        vfs_file_write(&vFolderFile, &x, sizeof(x));
+        return(true);
+    }
+    return(false);
+}
 
 
-static VfsFile_t vSendObjectHandle = {0};
-static uint32_t vCurrentParent = 0;
-static uint32_t vFolderCacheDirty = 0;
+/* Remove a deleted folder and all folders below it from the index */
+static void
+FolderIndexRemove(uint32_t folder)
+{
+    uint32_t storage = INODE_STORAGE(folder);
+    uint32_t x;
+    bool more;
 
-#if (FF_USE_LFN <= 2)
-#define STATIC_WORKPATH
-#endif
-#ifdef STATIC_WORKPATH
-static char vWorkPath[MAX_PATH + 1];    // Static to keep track of current directory
-static VfsInfo_t vFilInfo;  // Cached to accommodate multiple property request on a file
-#endif
+    if (!(vFolderIndexValid & (1 << storage)) || (INODE_FOLDER(folder) == FOLDER_ROOT))
+    {
+        return;
+    }
+    if (!FolderIndexOpen(storage, VFS_RDWR))
+    {
+        return;
+    }
+    if (FolderIndexDirty(1) && FolderIndexFree(storage, INODE_FOLDER(folder)))
+    {
+        // Free records whose parent was freed, until a pass finds none
+        do
+        {
+            more = false;
+            for (x = 1; x <= vFolderCount[storage]; x++)
+            {
+                if (!FolderIndexRead(x) || (vFolderRecord.parent == 0) || (INODE_FOLDER(vFolderRecord.parent) == FOLDER_ROOT))
+                {
+                    continue;
+                }
+                if (FolderIndexRead(INODE_FOLDER(vFolderRecord.parent)) && (vFolderRecord.parent == 0))
+                {
+                    more |= FolderIndexFree(storage, x);
+                }
+            }
+        } while (more);
+    }
+    if (!FolderIndexDirty(0))
+    {
+        vFolderIndexValid &= ~(1 << storage);
+    }
+    vfs_file_close(&vFolderFile);
+}
 
 
-uint32_t
-HandleFilenameBits(char* input)
+/* Give a renamed folder its new name, the handle stays the same */
+static bool
+FolderIndexRename(uint32_t folder, const char* name)
 {
-    uint32_t crc = 0xFFFFFFFF;
-    char buf[4] = {0};
-    size_t size = strlen(input);
+    uint32_t storage = INODE_STORAGE(folder);
+    uint32_t x = INODE_FOLDER(folder);
+    uint32_t parent;
+    bool ret = false;
 
-    static const uint32_t CrcTable[16] =
-    {   // Nibble lookup table for 0x04C11DB7 polynomial
-        0x00000000,0x04C11DB7,0x09823B6E,0x0D4326D9,0x130476DC,0x17C56B6B,0x1A864DB2,0x1E475005,
-        0x2608EDB8,0x22C9F00F,0x2F8AD6D6,0x2B4BCB61,0x350C9B64,0x31CD86D3,0x3C8EA00A,0x384FBDBD
-    };
+    if (!(vFolderIndexValid & (1 << storage)) || !FolderIndexOpen(storage, VFS_RDWR))
+    {
+        return(false);
+    }
+    // The new name hashes to another bucket
+    if (FolderIndexRead(x) && (parent = vFolderRecord.parent, parent != 0) && FolderIndexDirty(1) &&
+        FolderBucketUnlink(storage, x, vFolderRecord.hash, vFolderRecord.next))
+    {
+        memset(&vFolderRecord, 0, sizeof(vFolderRecord));
+        vFolderRecord.parent = parent;
+        vFolderRecord.hash = Crc32(parent, name, strlen(name));
+        vFolderRecord.next = FolderBucketRead(vFolderRecord.hash);
+        strncpy(vFolderRecord.name, name, sizeof(vFolderRecord.name) - 1);
+
+        ret = FolderIndexWrite(x) && FolderBucketWrite(vFolderRecord.hash, x) && FolderIndexDirty(0);
+        if (!ret)
+        {
+            vFolderIndexValid &= ~(1 << storage);
+        }
+    }
+    vfs_file_close(&vFolderFile);
+    return(ret);
+}
 
-    while (size > 0)
+
+/* Parent folder handle of a folder, as recorded when its handle was issued.
+ * Returns 0 for an unknown folder. */
+static uint32_t
+FolderIndexParent(uint32_t folder)
+{
+    if (INODE_FOLDER(folder) == FOLDER_ROOT)
     {
-        if (size < 4)
+        return(folder);
+    }
+    if (folder != vFolderParentOf)
+    {
+        // Property requests ask for the same folder a few times in a row
+        vFolderParentOf = 0;
+        if (!FolderIndexOpen(INODE_STORAGE(folder), VFS_RDONLY))
         {
-            memcpy(buf, input, size);
-            crc = crc ^ *(uint32_t*)buf; // Apply all 32-bits
-            size = 0;
+            return(0);
         }
-        else
+        if (FolderIndexRead(INODE_FOLDER(folder)) && (vFolderRecord.parent != 0))
         {
-            crc = crc ^ *(uint32_t*)input; // Apply all 32-bits
-            input += sizeof(uint32_t);
-            size -= sizeof(uint32_t);
+            vFolderParentOf = folder;
+            vFolderParent = vFolderRecord.parent;
+        }
+        vfs_file_close(&vFolderFile);
+        if (vFolderParentOf == 0)
+        {
+            return(0);
         }
-        // Process 32-bits, 4 at a time, or 8 rounds
-        crc = (crc << 4) ^ CrcTable[crc >> 28]; // Assumes 32-bit reg, masking index to 4-bits
-        crc = (crc << 4) ^ CrcTable[crc >> 28]; //  0x04C11DB7 Polynomial used in STM32
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
-        crc = (crc << 4) ^ CrcTable[crc >> 28];
     }
-    crc &= INODE_ITEM_MASK;
-    if (crc == 1)	// file ID 0 is reserved by MTP
+    return(vFolderParent);
+}
+
+
+/* Build the full path of a folder handle, walking up the parent records */
+static bool
+FolderIndexPath(uint32_t folder, char* path, size_t size)
+{
+    const char* drive = vfs_volume(INODE_STORAGE(folder));
+    char* p = &path[size - 1];
+    size_t n;
+    uint32_t depth = 0;
+    bool ret = true;
+
+    if (drive == nullptr)
     {
-        crc = 1;
+        return(false);
     }
-    if (crc == INODE_ITEM_MASK)	// file ID -1 is used for directory entries
+    *p = '\0';
+    if (INODE_FOLDER(folder) != FOLDER_ROOT)
     {
-        crc = INODE_ITEM_MASK - 1;
+        if (!FolderIndexOpen(INODE_STORAGE(folder), VFS_RDONLY))
+        {
+            return(false);
+        }
+        while (INODE_FOLDER(folder) != FOLDER_ROOT)
+        {
+            // Depth check protects against a damaged index
+            if ((++depth >= FOLDER_ROOT) || !FolderIndexRead(INODE_FOLDER(folder)) || (vFolderRecord.parent == 0))
+            {
+                ret = false;
+                break;
+            }
+            n = strlen(vFolderRecord.name);
+            if ((size_t)(p - path) < n + 1 + strlen(drive))
+            {
+                ret = false;
+                break;
+            }
+            p -= n;
+            memcpy(p, vFolderRecord.name, n);
+            *--p = '/';
+            folder = vFolderRecord.parent;
+        }
+        vfs_file_close(&vFolderFile);
     }
-    return(crc);
+    if (ret)
+    {
+        if (*p == '\0')
+        {
+            *--p = '/';
+        }
+        n = strlen(drive);
+        memmove(&path[n], p, strlen(p) + 1);
+        memcpy(path, drive, n);
+    }
+    return(ret);
 }
+#endif
 
 
 static bool
@@ -267,6 +1554,15 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
     static uint32_t vPreviousHandle = UINT32_MAX;
 
     VfsDir_t scanhandle;
+#if (MTP_HANDLE_INDEX_SIZE > 0)
+    HandleIndex_t* pIndex;
+#endif
+#if (MTP_RENAME_ALIASES > 0)
+    RenameAlias_t* pAlias;
+#endif
+#if (MTP_LOOKUP_CACHE_SIZE > 0)
+    LookupCache_t* pCache;
+#endif
     char* p;
     char* prev = nullptr;
     bool prevmatched;
@@ -288,6 +1584,10 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
         }
         pFilInfo = nullptr;
     #endif
+        // Nothing is cached anymore, the next session starts from the drive root
+        vPreviousHandle = UINT32_MAX;
+        vPathLen = 0;
+        LookupCacheClear();
 
         return(false);
     }
@@ -325,6 +1625,23 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
         }
         ret = true;
     }
+#if (MTP_LOOKUP_CACHE_SIZE > 0)
+    else if (pCache = LookupCacheFind(handle), (pCache != nullptr) && !parent)
+    {
+        strcpy(pWorkPath, pCache->path);
+        memcpy(pFilInfo, &pCache->info, sizeof(VfsInfo_t));
+
+        // Folder part of the path, as if the folder was made current by this lookup
+        vPathLen = strlen(pWorkPath);
+        if ((handle & INODE_ITEM_MASK) != 0)
+        {
+            p = strrchr(pWorkPath, '/');
+            vPathLen = (p == strchr(pWorkPath, '/')) ? (p + 1 - pWorkPath) : (p - pWorkPath);
+        }
+        vPreviousHandle = handle;
+        ret = true;
+    }
+#endif
     else
     {
         if (handle == 0) // NOTE catch 0 handles - not sure why we see this
@@ -364,36 +1681,25 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
             	else
             	{
 				#if VFS_NODIRS != 1
-            		uint32_t x = 0;
-            		char cachePath[13];
-
-					// Fetch folder entry from cache file
-                    sniprintf(cachePath, sizeof(cachePath), "%s%s", vfs_volume(INODE_STORAGE(handle)), MTP_FOLDER_CACHE_FILE);
-					if (err = vfs_file_open(&vSendObjectHandle, cachePath, VFS_RDONLY), err == 0)
+				#if (MTP_LOOKUP_CACHE_SIZE > 0)
+					// Path of a recently resolved folder
+					if (pCache = LookupCacheFind(handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK)), pCache != nullptr)
 					{
-						while (vfs_gets(pFilInfo->name, sizeof(pFilInfo->name), &vSendObjectHandle) != nullptr)
-						{
-							if (++x == INODE_FOLDER(handle))
-							{
-			                    sniprintf(pWorkPath, MAX_PATH + 1, "%s%s", vfs_volume(INODE_STORAGE(handle)), pFilInfo->name);
-			                    if (p = strchr(pWorkPath, '\n'), p != nullptr)
-			                    {
-			                    	*p = '\0';
-			                    }
-			   	   	   	   	   	if (parent)
-			   	   	   	   	   	{
-			   	   	   	   	   		vCurrentParent = handle;
-			   	   	   	   	 //XXX  		vPathLen = strlen(pWorkPath);
-			   	   	   	   	   	}
-		   	   	   	   	   		vPathLen = strlen(pWorkPath);
-			   	   	   	   	   	break;
-							}
-						}
-						vfs_file_close(&vSendObjectHandle);
+						strcpy(pWorkPath, pCache->path);
+						vPathLen = strlen(pWorkPath);
+					}
+					else
+				#endif
+					// Fetch folder path from the folder index
+					if (FolderIndexPath(handle, pWorkPath, MAX_PATH + 1))
+					{
+						vPathLen = strlen(pWorkPath);
 					}
-					if (err != 0)
+					else
 					{
-						MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), cachePath);
+						// Unknown folder, the next lookup starts again from the drive root
+						vPreviousHandle = UINT32_MAX;
+						return(false);
 					}
 				#endif
             	}
@@ -402,14 +1708,43 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
 			{
 				pWorkPath[vPathLen] = '\0';
 			}
+			if (parent)
+			{
+				// Also when the folder was already current, files listed next are indexed under it
+				vCurrentParent = handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK);
+			}
 
 			if ((handle & INODE_ITEM_MASK) == 0)	// Looking for the folder entry itself?
 			{
-				if (vfs_stat(pWorkPath, pFilInfo) == 0)
+				if (err = vfs_stat(pWorkPath, pFilInfo), err == 0)
 				{
 					ret = true;
 				}
+			#if VFS_NODIRS != 1
+				else if (err == -ENOENT)
+				{
+					// Removed outside a session, forget it
+					FolderIndexRemove(handle);
+					LookupCacheClear();
+				}
+			#endif
+			}
+		#if (MTP_RENAME_ALIASES > 0)
+			else if ((pAlias = RenameAliasFind(handle), pAlias != nullptr) && RenameAliasStat(pAlias, pWorkPath, pFilInfo))
+			{
+				// Renamed in this session, its name no longer gives this handle
+				MTP_DBG_LVL3("%lX => %s", handle, pWorkPath);
+				ret = true;
 			}
+		#endif
+		#if (MTP_HANDLE_INDEX_SIZE > 0)
+			else if ((pIndex = HandleIndexFind(handle), pIndex != nullptr) && HandleIndexStat(pIndex, pWorkPath, pFilInfo))
+			{
+				// Known from an earlier listing, no need to scan the folder
+				MTP_DBG_LVL3("%lX => %s", handle, pWorkPath);
+				ret = true;
+			}
+		#endif
 			else
 			{
 				// Search folder for handle
@@ -427,8 +1762,9 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
 								continue;
 							}
 						}
-						if ((HandleFilenameBits(pFilInfo->name) | vCurrentParent) == handle)
+						if ((HandleFilenameBits(pFilInfo->name) | (handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK))) == handle)
 						{
+							HandleIndexAdd(handle, pFilInfo->name);
 							if (p = strrchr(pWorkPath, '/'), (p == nullptr) || (p[1] != '\0'))
 							{
 								strcat(pWorkPath, "/");
@@ -445,9 +1781,22 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
 				if (err != 0)
 				{
 					MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), pWorkPath);
+				#if VFS_NODIRS != 1
+					if (err == -ENOENT)
+					{
+						FolderIndexRemove(handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK));
+						LookupCacheClear();
+					}
+				#endif
 				}
 			}
         	vPreviousHandle = handle;
+		#if (MTP_LOOKUP_CACHE_SIZE > 0)
+			if (ret)
+			{
+				LookupCacheAdd(handle, pWorkPath, pFilInfo);
+			}
+		#endif
         }
     }
 	if (pFil != nullptr)
@@ -462,6 +1811,106 @@ GetFileById(VfsInfo_t** pFil, uint32_t handle, bool parent, char** pPath)
 }
 
 
+/* Enumeration state of the folder listed by GetObjectHandles or
+ * GetObjectPropList. The directory stays open for the lifetime of the
+ * transaction, so that each entry is read and hashed once instead of once per
+ * data packet. */
+typedef struct DirCursor_s
+{
+    VfsDir_t dir;
+    uint32_t parent;        // Handle bits of the listed folder
+    uint32_t storage;       // Storage bits of the listed folder
+    uint32_t count;         // Number of entries read so far
+    uint32_t handle;        // Handle of the last entry read
+    VfsInfo_t info;         // Last entry read
+    bool open;
+    bool counting;          // Only count the entries, file names are not hashed
+} DirCursor_t;
+
+
+static void
+DirCursorClose(DirCursor_t* cursor)
+{
+    if (cursor->open)
+    {
+        vfs_dir_close(&cursor->dir);
+        cursor->open = false;
+    }
+}
+
+
+static int
+DirCursorOpen(DirCursor_t* cursor, char* path, uint32_t storage)
+{
+    int err;
+
+    DirCursorClose(cursor);
+
+    if (err = vfs_dir_open(&cursor->dir, path), err != 0)
+    {
+        return(err);
+    }
+    cursor->parent = vCurrentParent;
+    cursor->storage = storage << (32 - INODE_STORAGE_BITS);
+    cursor->count = 0;
+    cursor->handle = 0;
+    cursor->open = true;
+    return(0);
+}
+
+
+static bool
+DirCursorNext(DirCursor_t* cursor)
+{
+    if (!cursor->open)
+    {
+        return(false);
+    }
+    while (vfs_dir_read(&cursor->dir, &cursor->info) == 0)
+    {
+        if (cursor->info.name[0] == '.')
+        {
+            // Skip self and parent directory entries
+            if ((cursor->info.name[1] == '\0') || ((cursor->info.name[1] == '.') && (cursor->info.name[2] == '\0')))
+            {
+                continue;
+            }
+        }
+        if (cursor->info.attrib & ATR_HID)
+        {
+            continue;
+        }
+
+        if (cursor->info.attrib & ATR_DIR)
+        {
+        #if VFS_NODIRS != 1
+            cursor->handle = FolderIndexRegister(cursor->parent, cursor->info.name);
+        #else
+            cursor->handle = cursor->storage;
+        #endif
+        }
+        else if (!cursor->counting)
+        {
+            // Determine the hash-based handle
+            cursor->handle = HandleFilenameBits(cursor->info.name) | cursor->parent;
+            cursor->handle = RenameAliasHandle(cursor->parent, cursor->info.name, cursor->handle);
+            HandleIndexAdd(cursor->handle, cursor->info.name);
+        }
+        else
+        {
+            cursor->handle = 0;
+        }
+        if (!cursor->counting)
+        {
+            MTP_DBG_LVL0("List: %lX - %s", (unsigned long)cursor->handle, cursor->info.name);
+        }
+        cursor->count++;
+        return(true);
+    }
+    return(false);
+}
+
+
 void
 ByteBuffer(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint8_t var)
 {
@@ -480,6 +1929,41 @@ ByteBuffer(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint8_t var)
 }
 
 
+/* Fast path of the encoders for a field of size bytes: skip it at once when it
+ * lies before or past the window of the current packet, or store it at once
+ * when it lies entirely inside. Returns false at the window edges, where the
+ * field has to go through ByteBuffer byte by byte. With var == nullptr only
+ * index and reqlen are advanced and the caller stores the field itself. */
+static inline bool
+BlockBuffer(uint8_t** buf, uint32_t* index, uint32_t* reqlen, const void* var, uint32_t size)
+{
+    if (*index >= size)
+    {
+        *index -= size;
+        return(true);
+    }
+    if (*index > 0)
+    {
+        return(false);
+    }
+    if (*reqlen == 0)
+    {
+        return(true);   // Measure pass, or the packet is full
+    }
+    if (*reqlen < size)
+    {
+        return(false);
+    }
+    if ((*buf != nullptr) && (var != nullptr))
+    {
+        memcpy(*buf, var, size);    // Little-endian, as on the wire
+        *buf += size;
+    }
+    *reqlen -= size;
+    return(true);
+}
+
+
 static uint16_t
 GetUint16(uint8_t* buf)
 {
@@ -491,7 +1975,7 @@ GetUint16(uint8_t* buf)
 static uint32_t
 GetUint32(uint8_t* buf)
 {
-    uint32_t p = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+    uint32_t p = ((uint32_t)buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
     return(p);
 }
 
@@ -514,9 +1998,12 @@ Uint16(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint16_t var)
 {
     uint8_t i;
 
-    for (i = 0; i < sizeof(uint16_t); i++)
+    if (!BlockBuffer(buf, index, reqlen, &var, sizeof(var)))
     {
-        ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        for (i = 0; i < sizeof(uint16_t); i++)
+        {
+            ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        }
     }
     return((uint8_t)sizeof(uint16_t));
 }
@@ -527,9 +2014,12 @@ Uint32(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t var)
 {
     uint8_t i;
 
-    for (i = 0; i < sizeof(uint32_t); i++)
+    if (!BlockBuffer(buf, index, reqlen, &var, sizeof(var)))
     {
-        ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        for (i = 0; i < sizeof(uint32_t); i++)
+        {
+            ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        }
     }
     return((uint8_t)sizeof(uint32_t));
 }
@@ -540,40 +2030,483 @@ Uint64(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint64_t var)
 {
     uint8_t i;
 
-    for (i = 0; i < sizeof(uint64_t); i++)
+    if (!BlockBuffer(buf, index, reqlen, &var, sizeof(var)))
     {
-        ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        for (i = 0; i < sizeof(uint64_t); i++)
+        {
+            ByteBuffer(buf, index, reqlen, (var >> (i * 8)) & 0xFF);
+        }
     }
     return((uint8_t)sizeof(uint64_t));
 }
 
 
-static uint8_t
-String(uint8_t** buf, uint32_t* index, uint32_t* reqlen, const char* str)
+/* Filenames are UTF-8 in the file system and UTF-16 on the wire. Runs of plain
+ * ASCII go four characters at a time, everything else through its code point,
+ * malformed sequences and lone surrogates come out as U+FFFD. */
+#define UTF_REPLACEMENT         0xFFFD
+#define UTF8_ASCII_WORD(w)      (((w) & 0x80808080) == 0)
+#define UTF16_ASCII_PAIR(w)     (((w) & 0xFF80FF80) == 0)
+#define UTF16_HIGH(u)           (((u) & 0xFC00) == 0xD800)
+#define UTF16_LOW(u)            (((u) & 0xFC00) == 0xDC00)
+
+static uint32_t
+Utf8Next(const char** str)
 {
-    uint8_t i = 0;
+    static const uint32_t vMin[4] = {0, 0x80, 0x800, 0x10000};
+    const uint8_t* s = (const uint8_t*)*str;
+    uint32_t cp = s[0];
+    uint8_t n, i;
 
-    if (str != nullptr)
+    if (cp < 0x80)
     {
-        for (i = 0; (str[i] != '\0') && (i < UINT8_MAX); i++)
+        n = 0;
+    }
+    else if ((cp & 0xE0) == 0xC0)
+    {
+        cp &= 0x1F;
+        n = 1;
+    }
+    else if ((cp & 0xF0) == 0xE0)
+    {
+        cp &= 0x0F;
+        n = 2;
+    }
+    else if ((cp & 0xF8) == 0xF0)
+    {
+        cp &= 0x07;
+        n = 3;
+    }
+    else
+    {
+        *str += 1;
+        return(UTF_REPLACEMENT);
+    }
+    for (i = 1; i <= n; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)  // Also stops at the terminator
+        {
+            *str += i;
+            return(UTF_REPLACEMENT);
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *str += n + 1;
+    if ((cp < vMin[n]) || (cp > 0x10FFFF) || UTF16_HIGH(cp) || UTF16_LOW(cp))
+    {
+        return(UTF_REPLACEMENT);
+    }
+    return(cp);
+}
+
+
+/* Number of UTF-16 code units of str, up to max without splitting a pair */
+static uint32_t
+Utf8Units(const char* str, uint32_t max)
+{
+    const char* run;
+    uint32_t units = 0;
+    uint32_t n;
+
+    for (;;)
+    {
+        for (run = str; (uint8_t)(*str - 1) < 0x7F; str++)  // ASCII without the terminator
         {}
-        ByteBuffer(buf, index, reqlen, i + 1);
+        if (units += str - run, units >= max)
+        {
+            return(max);
+        }
+        if (*str == '\0')
+        {
+            return(units);
+        }
+        if (n = (Utf8Next(&str) >= 0x10000) ? 2 : 1, units + n > max)
+        {
+            return(units);
+        }
+        units += n;
+    }
+}
 
-        for (i = 0; (str[i] != '\0') && (i < UINT8_MAX); i++)
+
+/* Store the first units UTF-16 code units of str at out, little-endian. Every
+ * unit takes at least one byte of str, so a word read with four or more units
+ * to go stays inside the string. */
+static uint8_t*
+Utf8ToUtf16(uint8_t* out, const char* str, uint32_t units)
+{
+    uint32_t w, cp;
+
+    while (units > 0)
+    {
+        if (units >= 4)
+        {
+            memcpy(&w, str, sizeof(w));
+            if (UTF8_ASCII_WORD(w))
+            {
+                out[0] = w;
+                out[1] = 0;
+                out[2] = w >> 8;
+                out[3] = 0;
+                out[4] = w >> 16;
+                out[5] = 0;
+                out[6] = w >> 24;
+                out[7] = 0;
+                out += 8;
+                str += 4;
+                units -= 4;
+                continue;
+            }
+        }
+        if ((uint8_t)*str < 0x80)
         {
-            ByteBuffer(buf, index, reqlen, str[i]);
-            ByteBuffer(buf, index, reqlen, 0);
+            *out++ = *str++;
+            *out++ = 0;
+            units--;
+            continue;
         }
-        ByteBuffer(buf, index, reqlen, 0);
-        ByteBuffer(buf, index, reqlen, 0);
-        i++;
+        cp = Utf8Next(&str);
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            *out++ = LOBYTE(0xD800 | (cp >> 10));
+            *out++ = HIBYTE(0xD800 | (cp >> 10));
+            cp = 0xDC00 | (cp & 0x3FF);
+            units--;
+        }
+        *out++ = LOBYTE(cp);
+        *out++ = HIBYTE(cp);
+        units--;
     }
-    else
+    return(out);
+}
+
+
+static uint16_t
+String(uint8_t** buf, uint32_t* index, uint32_t* reqlen, const char* str)
+{
+    uint32_t units, size, left, cp;
+    uint8_t* p;
+
+    if (str == nullptr)
     {
         ByteBuffer(buf, index, reqlen, 0);
+        return(1);
+    }
+
+    units = Utf8Units(str, UINT8_MAX - 1);
+    size = 1 + ((units + 1) << 1);  // Length, characters and terminator
+    left = *reqlen;
+    if (BlockBuffer(buf, index, reqlen, nullptr, size))
+    {
+        if ((*reqlen != left) && (*buf != nullptr))
+        {
+            // The whole string lies inside the window, convert it in place
+            p = *buf;
+            *p++ = units + 1;
+            p = Utf8ToUtf16(p, str, units);
+            *p++ = 0;
+            *p++ = 0;
+            *buf = p;
+        }
+        return(size);
+    }
+
+    ByteBuffer(buf, index, reqlen, units + 1);
+    while (units > 0)
+    {
+        cp = Utf8Next(&str);
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            Uint16(buf, index, reqlen, 0xD800 | (cp >> 10));
+            cp = 0xDC00 | (cp & 0x3FF);
+            units--;
+        }
+        Uint16(buf, index, reqlen, cp);
+        units--;
+    }
+    Uint16(buf, index, reqlen, 0);
+    return(size);
+}
+
+
+#if (MTP_READONLY != 1)
+/* Incremental UTF-16 to UTF-8 conversion of a string received over several
+ * packets, into out of size bytes that is kept terminated. A character that
+ * does not fit anymore is dropped as a whole. */
+typedef struct Utf16Stream_s
+{
+    char* out;
+    char* end;      // Place of the terminator of a full buffer
+    uint16_t unit;  // Low byte of a split code unit
+    uint16_t high;  // High surrogate waiting for its pair
+    bool odd;
+} Utf16Stream_t;
+
+
+static void
+Utf16StreamStart(Utf16Stream_t* st, char* out, uint32_t size)
+{
+    st->out = out;
+    st->end = out + size - 1;
+    st->unit = 0;
+    st->high = 0;
+    st->odd = false;
+    *out = '\0';
+}
+
+
+static void
+Utf16StreamChar(Utf16Stream_t* st, uint32_t cp)
+{
+    uint8_t n = (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+    char* p = st->out;
+
+    if ((cp == 0) || (p + n > st->end))
+    {
+        return;
+    }
+    switch (n)
+    {
+        case 1:
+            *p++ = cp;
+            break;
+        case 2:
+            *p++ = 0xC0 | (cp >> 6);
+            *p++ = 0x80 | (cp & 0x3F);
+            break;
+        case 3:
+            *p++ = 0xE0 | (cp >> 12);
+            *p++ = 0x80 | ((cp >> 6) & 0x3F);
+            *p++ = 0x80 | (cp & 0x3F);
+            break;
+        default:
+            *p++ = 0xF0 | (cp >> 18);
+            *p++ = 0x80 | ((cp >> 12) & 0x3F);
+            *p++ = 0x80 | ((cp >> 6) & 0x3F);
+            *p++ = 0x80 | (cp & 0x3F);
+            break;
+    }
+    *p = '\0';
+    st->out = p;
+}
+
+
+static void
+Utf16StreamPut(Utf16Stream_t* st, const uint8_t* in, uint32_t len)
+{
+    uint32_t w[2];
+    uint32_t cp;
+    uint16_t u;
+
+    while (len > 0)
+    {
+        if (!st->odd && (st->high == 0) && (len >= sizeof(w)) && (st->out + 4 <= st->end))
+        {
+            memcpy(w, in, sizeof(w));   // Four code units, little-endian like the wire
+            if (UTF16_ASCII_PAIR(w[0]) && UTF16_ASCII_PAIR(w[1]) && (in[0] != 0) && (in[2] != 0) && (in[4] != 0) && (in[6] != 0))
+            {
+                st->out[0] = in[0];
+                st->out[1] = in[2];
+                st->out[2] = in[4];
+                st->out[3] = in[6];
+                st->out += 4;
+                *st->out = '\0';
+                in += sizeof(w);
+                len -= sizeof(w);
+                continue;
+            }
+        }
+        if (!st->odd)
+        {
+            st->unit = *in++;
+            st->odd = true;
+            len--;
+            continue;
+        }
+        u = st->unit | (*in++ << 8);
+        st->odd = false;
+        len--;
+
+        if (UTF16_HIGH(u))
+        {
+            if (st->high != 0)
+            {
+                Utf16StreamChar(st, UTF_REPLACEMENT);
+            }
+            st->high = u;
+            continue;
+        }
+        if (UTF16_LOW(u) && (st->high != 0))
+        {
+            cp = 0x10000 + ((st->high & 0x3FF) << 10) + (u & 0x3FF);
+        }
+        else
+        {
+            if (st->high != 0)
+            {
+                Utf16StreamChar(st, UTF_REPLACEMENT);
+            }
+            cp = UTF16_LOW(u) ? UTF_REPLACEMENT : u;
+        }
+        st->high = 0;
+        Utf16StreamChar(st, cp);
+    }
+}
+#endif
+
+
+/* MTP DateTime strings "YYYYMMDDThhmmss[.s][Z|+hhmm|-hhmm]" against time_t,
+ * with the civil calendar in integers (H. Hinnant, chrono-compatible low-level
+ * date algorithms) instead of gmtime and mktime. Times of the file system go
+ * out without a suffix, like before. */
+#define DATE_LENGTH             15          // YYYYMMDDThhmmss
+#define DATE_DEFAULT            978307200   // 20010101T000000
+#define SECONDS_PER_DAY         86400
+
+static void
+DateTimeFormat(char* str, time_t t)
+{
+    int32_t z, era;
+    uint32_t doe, yoe, doy, mp, y, m, d, sec;
+
+    z = t / SECONDS_PER_DAY;
+    if (sec = t % SECONDS_PER_DAY, (int32_t)sec < 0)
+    {
+        sec += SECONDS_PER_DAY;
+        z--;
+    }
+    z += 719468;
+    era = ((z >= 0) ? z : (z - 146096)) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = (mp < 10) ? (mp + 3) : (mp - 9);
+    y = yoe + era * 400 + (m <= 2);
+
+    str[0] = '0' + (y / 1000) % 10;
+    str[1] = '0' + (y / 100) % 10;
+    str[2] = '0' + (y / 10) % 10;
+    str[3] = '0' + y % 10;
+    str[4] = '0' + m / 10;
+    str[5] = '0' + m % 10;
+    str[6] = '0' + d / 10;
+    str[7] = '0' + d % 10;
+    str[8] = 'T';
+    str[9] = '0' + sec / 36000;
+    str[10] = '0' + (sec / 3600) % 10;
+    str[11] = '0' + (sec / 600) % 6;
+    str[12] = '0' + (sec / 60) % 10;
+    str[13] = '0' + (sec % 60) / 10;
+    str[14] = '0' + sec % 10;
+}
+
+
+/* Emit t as an MTP string, built straight in the packet when it fits */
+static uint16_t
+DateTime(uint8_t** buf, uint32_t* index, uint32_t* reqlen, time_t t)
+{
+    char str[DATE_LENGTH + 1];
+    uint32_t left = *reqlen;
+    uint8_t* p;
+    uint8_t i;
+
+    DateTimeFormat(str, t);
+    if (BlockBuffer(buf, index, reqlen, nullptr, 1 + ((DATE_LENGTH + 1) << 1)))
+    {
+        if ((*reqlen != left) && (*buf != nullptr))
+        {
+            p = *buf;
+            *p++ = DATE_LENGTH + 1;
+            for (i = 0; i < DATE_LENGTH; i++)
+            {
+                *p++ = str[i];
+                *p++ = 0;
+            }
+            *p++ = 0;
+            *p++ = 0;
+            *buf = p;
+        }
+        return(1 + ((DATE_LENGTH + 1) << 1));
+    }
+    str[DATE_LENGTH] = '\0';
+    return(String(buf, index, reqlen, str));
+}
+
+
+#if (MTP_READONLY != 1)
+static bool
+DateDigits(const char** str, uint8_t n, uint32_t* value)
+{
+    *value = 0;
+    while (n-- > 0)
+    {
+        if ((uint8_t)(**str - '0') > 9)
+        {
+            return(false);
+        }
+        *value = *value * 10 + (*(*str)++ - '0');
+    }
+    return(true);
+}
+
+
+/* Time of a DateTime string, 0 when it is not one. Tenths of seconds are
+ * accepted and dropped, an offset to UTC is applied. */
+static time_t
+DateTimeParse(const char* str)
+{
+    uint32_t y, m, d, hh, mm, ss, v;
+    uint32_t era, yoe, doy, doe;
+    int32_t offset = 0;
+    const char* zone;
+    time_t t;
+
+    if (!DateDigits(&str, 4, &y) || !DateDigits(&str, 2, &m) || !DateDigits(&str, 2, &d) || (*str++ != 'T') ||
+        !DateDigits(&str, 2, &hh) || !DateDigits(&str, 2, &mm) || !DateDigits(&str, 2, &ss))
+    {
+        return(0);
+    }
+    if ((m < 1) || (m > 12) || (d < 1) || (d > 31) || (hh > 23) || (mm > 59) || (ss > 60))
+    {
+        return(0);
+    }
+    if (*str == '.')
+    {
+        for (str++; (uint8_t)(*str - '0') <= 9; str++)
+        {}
+    }
+    if ((*str == '+') || (*str == '-'))
+    {
+        zone = str + 1;
+        if (!DateDigits(&zone, 2, &v))
+        {
+            return(0);
+        }
+        offset = v * 3600;
+        if (DateDigits(&zone, 2, &v))   // The minutes are optional
+        {
+            offset += v * 60;
+        }
+        if (*str == '-')
+        {
+            offset = -offset;
+        }
     }
-    return((i << 1) + 1);
+
+    // Days since 1970 of the date, years start in March to put leap days last
+    y += 3 * 400 - (m <= 2);    // Shifted by three eras to stay positive
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * ((m > 2) ? (m - 3) : (m + 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    t = (time_t)((int32_t)((era - 3) * 146097 + doe) - 719468) * SECONDS_PER_DAY;
+    return(t + hh * 3600 + mm * 60 + ss - offset);
 }
+#endif
 
 
 static uint8_t
@@ -603,39 +2536,39 @@ StringWchar(uint8_t** buf, uint32_t* index, uint32_t* reqlen, const wchar_t* str
 }
 
 
-static uint32_t PtpDeviceInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpOpenSession(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpCloseSession(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetStorageIds(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetStorageInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetObjectHandles(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpDeleteObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpSendObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpSendObjectInfoData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-//static uint32_t PtpSendObjectInfoResponse(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpSendObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpSendObjectData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpFormatStore(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-
-static uint32_t MtpGetObjectPropsSupported(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t MtpGetObjectPropDesc(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t MtpGetObjectPropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpDeviceInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpOpenSession(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpCloseSession(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetStorageIds(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetStorageInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetObjectHandles(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetObjectInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpDeleteObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpSendObjectInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpSendObjectInfoData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+//static uint32_t PtpSendObjectInfoResponse(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpSendObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpSendObjectData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpFormatStore(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+
+static uint32_t MtpGetObjectPropsSupported(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t MtpGetObjectPropDesc(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t MtpGetObjectPropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
 #if (MTP_READONLY != 1)
-static uint32_t MtpSetObjectPropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t MtpSetObjectPropValueData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t MtpSetObjectPropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t MtpSetObjectPropValueData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
 #endif
-static uint32_t MtpGetObjectPropList(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t MtpGetObjectPropList(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
 
-static uint32_t PtpGetDevicePropDesc(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpGetDevicePropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
-static uint32_t PtpSetDevicePropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetDevicePropDesc(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpGetDevicePropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+static uint32_t PtpSetDevicePropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
 
-static uint32_t PtpResponse(uint32_t id, uint8_t* pBuf, uint16_t resp);
+static uint32_t PtpResponse(PtpContext_t* ctx, uint32_t id, uint8_t* pBuf, uint16_t resp);
 
 
-typedef  uint32_t (*PtpProc_t)(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
+typedef  uint32_t (*PtpProc_t)(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen);
 
 const struct PtpOpcodeTable_s
 {
@@ -669,7 +2602,7 @@ vPtpOpcodeTable[] =
     {0x9802, MtpGetObjectPropDesc},
     {0x9803, MtpGetObjectPropValue},
 #if (MTP_READONLY != 1)
-    {0x9804, MtpSetObjectPropValue},
+    {0x9804, MtpSetObjectPropValue, MtpSetObjectPropValueData},
 #endif
     {0x9805, MtpGetObjectPropList},
 
@@ -689,8 +2622,8 @@ vPtpOpcodeTable[] =
 #define AUINT8      0x4002
 #define STR         0xFFFF
 
-typedef uint8_t (*DeviceProc_t)(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle);
-typedef uint8_t (*ObjectProc_t)(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* fileinfo);
+typedef uint16_t (*DeviceProc_t)(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle);
+typedef uint16_t (*ObjectProc_t)(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* fileinfo);
 
 #define FORMAT_UNDEFINED    0x3000
 #define FORMAT_ASSOCIATION  0x3001
@@ -700,11 +2633,15 @@ typedef uint8_t (*ObjectProc_t)(uint8_t** buf, uint32_t* index, uint32_t* reqlen
 #define FORMAT_HTML         0x3005
 #define FORMAT_AUDIO_WAV    0x3008
 #define FORMAT_AUDIO_MP3    0x3009
+#define FORMAT_VIDEO_AVI    0x300A
 #define FORMAT_UNKNOWNIMAGE 0x3800
 #define FORMAT_IMAGE_JPG    0x3801
 #define FORMAT_IMAGE_BMP    0x3804
 #define FORMAT_IMAGE_GIF    0x3807
 #define FORMAT_IMAGE_PNG    0x380B
+#define FORMAT_AUDIO_WMA    0xB901
+#define FORMAT_VIDEO_MP4    0xB982
+#define FORMAT_XMLDOCUMENT  0xBA82
 
 const struct MtpObjectFormat_s
 {
@@ -725,15 +2662,25 @@ vMtpObjectFormats[] =
     {FORMAT_IMAGE_BMP, "BMP"},
     {FORMAT_IMAGE_PNG, "PNG"},
     {FORMAT_IMAGE_JPG, "JPG"},
+    {FORMAT_IMAGE_JPG, "JPEG"},
     {FORMAT_IMAGE_GIF, "GIF"},
     {FORMAT_UNKNOWNIMAGE, "ICO"},
+    {FORMAT_TEXTFILE, "CSV"},
+    {FORMAT_XMLDOCUMENT, "XML"},
+    {FORMAT_AUDIO_WAV, "WAV"},
+    {FORMAT_AUDIO_MP3, "MP3"},
+    {FORMAT_AUDIO_WMA, "WMA"},
+    {FORMAT_VIDEO_AVI, "AVI"},
+    {FORMAT_VIDEO_MP4, "MP4"},
+    {FORMAT_UNDEFINED, "ZIP"},  // No MTP format of its own, listed so it is not guessed at
+    MTP_USER_FORMATS
     {FORMAT_UNDEFINED, "\n\n\n\n"}, // Fake extension, so nothing will match
     {FORMAT_ASSOCIATION, "\n\n\n\n"}, // Fake extension, so nothing will match
     {0, ""}
 };
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_StorageId(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint32_t storage = 0;
@@ -749,39 +2696,141 @@ MtpObjProp_StorageId(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t
 }
 
 
-static uint8_t
-MtpObjProp_ObjectFormat(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
+/* Index from a file name extension to its row in vMtpObjectFormats. The
+ * extension is folded to upper case and packed into a 32-bit key, so looking
+ * up a name costs one hash and usually one compare. A slot holds the row plus
+ * one, 0 marks a free slot; built on first use like the code indexes. */
+#define FORMAT_INDEX_SIZE       64      // Power of 2, larger than the format table
+#define FORMAT_INDEX_HASH(k)    (((k) * 0x9E3779B1) >> (32 - 6))   // Top 6 bits for the 64 slots
+
+// All rows are indexed and probing stops at a free slot, MTP_USER_FORMATS must leave one
+_Static_assert(sizeof(vMtpObjectFormats) / sizeof(vMtpObjectFormats[0]) <= FORMAT_INDEX_SIZE, "FORMAT_INDEX_SIZE too small for vMtpObjectFormats");
+
+static uint8_t vFormatIndex[FORMAT_INDEX_SIZE];
+static uint32_t vFormatKeys[FORMAT_INDEX_SIZE];
+static bool vFormatIndexBuilt = false;
+
+
+/* Key of an extension of len characters, 0 when it cannot be in the table */
+static uint32_t
+ExtensionKey(const char* ext, uint32_t len)
 {
-    uint16_t format = FORMAT_UNDEFINED;
-    uint32_t i;
+    uint32_t key = 0;
+    uint8_t c;
 
-    if ((info != nullptr) && (info->name[0] != '\0') && (handle != 0) && (handle != UINT32_MAX))
+    if ((len == 0) || (len >= sizeof(vMtpObjectFormats[0].extension)))
+    {
+        return(0);
+    }
+    while (len-- > 0)
     {
-        char* ext;
+        c = *ext++;
+        if ((c >= 'a') && (c <= 'z'))
+        {
+            c -= 'a' - 'A';
+        }
+        key = (key << 8) | c;
+    }
+    return(key);
+}
 
-        if (info->attrib & ATR_DIR)
+
+/* Format of a file by its name extension, FORMAT_UNDEFINED when not listed */
+static uint16_t
+ExtensionFormat(const char* name)
+{
+    uint32_t i, x, len, key;
+
+    if (!vFormatIndexBuilt)
+    {
+        memset(vFormatIndex, 0, sizeof(vFormatIndex));
+        for (i = 0; vMtpObjectFormats[i].format != 0; i++)
         {
-            format = FORMAT_ASSOCIATION;
+            key = ExtensionKey(vMtpObjectFormats[i].extension, strlen(vMtpObjectFormats[i].extension));
+            for (x = FORMAT_INDEX_HASH(key); vFormatIndex[x] != 0; x = (x + 1) & (FORMAT_INDEX_SIZE - 1))
+            {
+                if (vFormatKeys[x] == key)
+                {
+                    break;  // The first row of an extension wins
+                }
+            }
+            if (vFormatIndex[x] == 0)
+            {
+                vFormatIndex[x] = i + 1;
+                vFormatKeys[x] = key;
+            }
         }
-        else if (ext = strrchr(info->name, '.'), ext != nullptr)
+        vFormatIndexBuilt = true;
+    }
+
+    // Only the last few characters can hold a listed extension
+    len = strlen(name);
+    for (i = 1; (i <= len) && (i <= sizeof(vMtpObjectFormats[0].extension)); i++)
+    {
+        if (name[len - i] == '.')
         {
-            ext++;
-            for (i = 0; vMtpObjectFormats[i].format != 0; i++)
+            if (key = ExtensionKey(&name[len - i + 1], i - 1), key == 0)
+            {
+                break;
+            }
+            for (x = FORMAT_INDEX_HASH(key); vFormatIndex[x] != 0; x = (x + 1) & (FORMAT_INDEX_SIZE - 1))
             {
-                if (strcasecmp(ext, vMtpObjectFormats[i].extension) == 0)
+                if (vFormatKeys[x] == key)
                 {
-                    format = vMtpObjectFormats[i].format;
-                    break;
+                    return(vMtpObjectFormats[vFormatIndex[x] - 1].format);
                 }
             }
+            break;
+        }
+    }
+    return(FORMAT_UNDEFINED);
+}
+
+
+/* Format code of an object, derived from its file name extension */
+static uint16_t
+ObjectFormat(uint32_t handle, VfsInfo_t* info)
+{
+    uint16_t format = FORMAT_UNDEFINED;
+
+    if ((info != nullptr) && (info->name[0] != '\0') && (handle != 0) && (handle != UINT32_MAX))
+    {
+        if (info->attrib & ATR_DIR)
+        {
+            format = FORMAT_ASSOCIATION;
+        }
+        else
+        {
+            format = ExtensionFormat(info->name);
         }
     }
+    return(format);
+}
+
+
+/* Whether a directory entry is of the given format */
+static bool
+FormatMatch(uint16_t format, VfsInfo_t* info)
+{
+    if (info->attrib & ATR_DIR)
+    {
+        return(format == FORMAT_ASSOCIATION);
+    }
+    return(ExtensionFormat(info->name) == format);
+}
+
+
+static uint16_t
+MtpObjProp_ObjectFormat(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
+{
+    uint16_t format = ObjectFormat(handle, info);
+
     MTP_DBG_LVL3("%s(%lX): %X", __FUNCTION__, handle, format);
     return(Uint16(buf, index, reqlen, format));
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ProtectionStatus(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint16_t protect = 0;
@@ -795,7 +2844,7 @@ MtpObjProp_ProtectionStatus(uint8_t** buf, uint32_t* index, uint32_t* reqlen, ui
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ObjectSize(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint64_t size = 0;
@@ -809,7 +2858,7 @@ MtpObjProp_ObjectSize(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_AssociationType(uint8_t* *buf, uint32_t *index, uint32_t *reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint16_t assoc = 0;
@@ -823,22 +2872,29 @@ MtpObjProp_AssociationType(uint8_t* *buf, uint32_t *index, uint32_t *reqlen, uin
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ParentObject(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint32_t parent = 0;
 
     (void)info;
 
-    // TODO retrieve parent object of directories
-    if ((handle & INODE_FOLDER_MASK) == INODE_FOLDER_MASK)
-    {
-        parent = UINT32_MAX;
-    }
-    else
+    if ((handle != 0) && (handle != UINT32_MAX))
     {
-        //parent = handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK);
-        parent = vCurrentParent;
+        // A file carries the handle of its folder, a folder has its parent in the folder index
+        parent = handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK);
+        if ((handle & INODE_ITEM_MASK) == 0)
+        {
+        #if VFS_NODIRS != 1
+            parent = FolderIndexParent(handle);
+        #else
+            parent = 0;
+        #endif
+        }
+        if ((parent & INODE_FOLDER_MASK) == INODE_FOLDER_MASK)
+        {
+            parent = 0;     // Objects in the root have no parent object
+        }
     }
 
     MTP_DBG_LVL3("%s(%lX): %lX", __FUNCTION__, handle, parent);
@@ -846,21 +2902,22 @@ MtpObjProp_ParentObject(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_PersistentUniqueObjectIdentifier(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     (void)info;
 
-    if ((handle != 0) && (handle != UINT32_MAX))
+    if ((handle == 0) || (handle == UINT32_MAX))
     {
-        Uint64(buf, index, reqlen, handle);
-        Uint64(buf, index, reqlen, 0);
+        handle = 0;     // Default value
     }
+    Uint64(buf, index, reqlen, handle);
+    Uint64(buf, index, reqlen, 0);
     return(16);
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ObjectFileName(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     char* pfile = nullptr;
@@ -874,39 +2931,35 @@ MtpObjProp_ObjectFileName(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ObjectTimeCreated(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
-    char str[16] = "20010101T000000";
+    time_t t = DATE_DEFAULT;
 
     if ((info != nullptr) && (info->name[0] != '\0') && (handle != 0) && (handle != UINT32_MAX))
     {
-        struct tm* t = gmtime(&info->created);
-
-        sniprintf(str, sizeof(str), "%04d%02d%02dT%02d%02d%02d",  t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec);
+        t = info->created;
     }
-    MTP_DBG_LVL3("%s(%lu): %s", __FUNCTION__, handle, str);
-    return(String(buf, index, reqlen, str));
+    MTP_DBG_LVL3("%s(%lu): %ld", __FUNCTION__, handle, (long)t);
+    return(DateTime(buf, index, reqlen, t));
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_ObjectTimeModified(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
-    char str[16] = "20010101T000000";
+    time_t t = DATE_DEFAULT;
 
     if ((info != nullptr) && (info->name[0] != '\0') && (handle != 0) && (handle != UINT32_MAX))
     {
-        struct tm* t = gmtime(&info->modified);
-
-        sniprintf(str, sizeof(str), "%04d%02d%02dT%02d%02d%02d",  t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec);
+        t = info->modified;
     }
-    MTP_DBG_LVL3("%s(%lu): %s", __FUNCTION__, handle, str);
-    return(String(buf, index, reqlen, str));
+    MTP_DBG_LVL3("%s(%lu): %ld", __FUNCTION__, handle, (long)t);
+    return(DateTime(buf, index, reqlen, t));
 }
 
 
-static uint8_t
+static uint16_t
 MtpObjProp_UseCount(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t handle, VfsInfo_t* info)
 {
     uint32_t count = 1;
@@ -917,27 +2970,32 @@ MtpObjProp_UseCount(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t h
 }
 
 
+/* Property groups, selectable in GetObjectPropList with ObjectPropCode 0 */
+#define PROPGROUP_LIST      1   // Needed to show an object in a folder view
+#define PROPGROUP_DETAIL    2   // Dates and identifiers, fetched on demand
+
 const struct MtpObjectPropsSupported_s
 {
     uint16_t prop;
     uint16_t type;
     ObjectProc_t proc;
+    uint32_t group;
 }
 vMtpObjectPropsSupported[] =
 {
-    {0xDC01, UINT32, MtpObjProp_StorageId}, // StorageID
-    {0xDC02, UINT16, MtpObjProp_ObjectFormat}, // Object Format
-    {0xDC03, UINT16, MtpObjProp_ProtectionStatus}, // ProtectionStatus
-    {0xDC04, UINT64, MtpObjProp_ObjectSize}, // ObjectSize
-    {0xDC05, UINT16, MtpObjProp_AssociationType}, // Association Type
-    {0xDC07, STR, MtpObjProp_ObjectFileName}, // ObjectFileName
-    {0xDC08, STR, MtpObjProp_ObjectTimeCreated}, // Date Created
-    {0xDC09, STR, MtpObjProp_ObjectTimeModified}, // Date Modified
-    {0xDC0B, UINT32, MtpObjProp_ParentObject}, // Parent Object
-    {0xDC41, UINT128, MtpObjProp_PersistentUniqueObjectIdentifier}, // Without this property, Windows is unable to delete files!
-    {0xDC44, STR, MtpObjProp_ObjectFileName}, // Name
-    //{0xDC91, UINT32, MtpObjProp_UseCount},
-    {0, 0, nullptr}
+    {0xDC01, UINT32, MtpObjProp_StorageId, PROPGROUP_LIST}, // StorageID
+    {0xDC02, UINT16, MtpObjProp_ObjectFormat, PROPGROUP_LIST}, // Object Format
+    {0xDC03, UINT16, MtpObjProp_ProtectionStatus, PROPGROUP_LIST}, // ProtectionStatus
+    {0xDC04, UINT64, MtpObjProp_ObjectSize, PROPGROUP_LIST}, // ObjectSize
+    {0xDC05, UINT16, MtpObjProp_AssociationType, PROPGROUP_LIST}, // Association Type
+    {0xDC07, STR, MtpObjProp_ObjectFileName, PROPGROUP_LIST}, // ObjectFileName
+    {0xDC08, STR, MtpObjProp_ObjectTimeCreated, PROPGROUP_DETAIL}, // Date Created
+    {0xDC09, STR, MtpObjProp_ObjectTimeModified, PROPGROUP_DETAIL}, // Date Modified
+    {0xDC0B, UINT32, MtpObjProp_ParentObject, PROPGROUP_LIST}, // Parent Object
+    {0xDC41, UINT128, MtpObjProp_PersistentUniqueObjectIdentifier, PROPGROUP_DETAIL}, // Without this property, Windows is unable to delete files!
+    {0xDC44, STR, MtpObjProp_ObjectFileName, PROPGROUP_LIST}, // Name
+    //{0xDC91, UINT32, MtpObjProp_UseCount, PROPGROUP_DETAIL},
+    {0, 0, nullptr, 0}
 };
 
 
@@ -947,7 +3005,7 @@ vMtpObjectPropsSupported[] =
 #define PROP_MAX        3
 #define PROP_STEP       4
 
-static uint8_t
+static uint16_t
 MtpDeviceProp_BatteryLevel(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t value)
 {
     uint16_t level = 0;
@@ -956,51 +3014,51 @@ MtpDeviceProp_BatteryLevel(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uin
 }
 
 
-static uint8_t
+static uint16_t
 MtpDeviceProp_FriendlyName(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t value)
 {
     return(String(buf, index, reqlen, MTP_FRIENDLYNAME));
 }
 
 
-static uint8_t
+static uint16_t
 MtpDeviceProp_DeviceIcon(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t value)
 {
     uint32_t len = 0;
 
-    if (vfs_file_open(&vSendObjectHandle, "DevIcon.fil", VFS_RDONLY) == 0)
+    if (vfs_file_open(&vIconFile, "DevIcon.fil", VFS_RDONLY) == 0)
     {
-        len = vfs_file_size(&vSendObjectHandle);
+        len = vfs_file_size(&vIconFile);
         if (index == 0)
         {
             len += Uint32(buf, index, reqlen, len);
         }
-        vfs_file_seek(&vSendObjectHandle, *index, SEEK_SET);
+        vfs_file_seek(&vIconFile, *index, SEEK_SET);
 
         if ((buf != nullptr) && (*buf != nullptr))
         {
             size_t rb;
 
-            if (rb = vfs_file_read(&vSendObjectHandle, *buf, *reqlen), rb >= 0)
+            if (rb = vfs_file_read(&vIconFile, *buf, *reqlen), rb >= 0)
             {
                 *index += rb;
                 *reqlen -= rb;
             }
         }
-        vfs_file_close(&vSendObjectHandle);
+        vfs_file_close(&vIconFile);
     }
     return(len);
 }
 
 
-static uint8_t
+static uint16_t
 MtpDeviceProp_PerceivedDeviceType(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t value)
 {
     return(Uint32(buf, index, reqlen, 0x00000004));
 }
 
 
-static uint8_t
+static uint16_t
 MtpDeviceProp_PlaybackObject(uint8_t** buf, uint32_t* index, uint32_t* reqlen, uint32_t value)
 {
     return(Uint32(buf, index, reqlen, 0x00000000));
@@ -1062,250 +3120,623 @@ vMtpDeviceEventsSupported[] =
 #endif
 
 
-static uint8_t vPtpBuffer[PTP_BUF_SIZE];
-static uint32_t vPtpSession = 0;
+#define CODE_INDEX_SIZE     64      // Slots of a code index (power of 2, larger than the table it indexes)
+#define CODE_INDEX_HASH(c)  (((c) ^ ((c) >> 6)) & (CODE_INDEX_SIZE - 1))
+#define TABLE_CODE(table, stride, i)    (*(const uint16_t*)((const uint8_t*)(table) + (i) * (stride)))
+
+/* Index from an operation or property code to its position in the tables
+ * above, so that a request does not walk the table to find its code. A slot
+ * holds the position plus one, 0 marks a free slot. The tables remain the only
+ * list of what is supported; the indexes are built from them on first use. */
+typedef uint8_t CodeIndex_t[CODE_INDEX_SIZE];
 
-static uint16_t vResponseCode = 0;
-static uint8_t vResponseParamCount = 0;
-static uint32_t vParam[5];
-static uint32_t vResponseParam[5] = {0};
+// Probing stops at a free slot, a table must leave one (its terminator takes the place)
+_Static_assert(sizeof(vPtpOpcodeTable) / sizeof(vPtpOpcodeTable[0]) <= CODE_INDEX_SIZE, "CODE_INDEX_SIZE too small for vPtpOpcodeTable");
+_Static_assert(sizeof(vMtpObjectPropsSupported) / sizeof(vMtpObjectPropsSupported[0]) <= CODE_INDEX_SIZE, "CODE_INDEX_SIZE too small for vMtpObjectPropsSupported");
+_Static_assert(sizeof(vMtpDevicePropsSupported) / sizeof(vMtpDevicePropsSupported[0]) <= CODE_INDEX_SIZE, "CODE_INDEX_SIZE too small for vMtpDevicePropsSupported");
+
+static CodeIndex_t vOpcodeIndex;
+static CodeIndex_t vObjectPropIndex;
+static CodeIndex_t vDevicePropIndex;
+static bool vCodeIndexBuilt = false;
 
 
 static void
-ParamParse(uint8_t* buf, int num)
+CodeIndexBuild(CodeIndex_t index, const void* table, size_t stride)
 {
-    int i;
+    uint32_t i, x;
 
-    for (i = 0; i < num; i++)
+    memset(index, 0, sizeof(CodeIndex_t));
+    for (i = 0; TABLE_CODE(table, stride, i) != 0; i++)
+    {
+        for (x = CODE_INDEX_HASH(TABLE_CODE(table, stride, i)); index[x] != 0; x = (x + 1) & (CODE_INDEX_SIZE - 1))
+        {
+        }
+        index[x] = i + 1;
+    }
+}
+
+
+/* Position of a code in its table, -1 when the code is not supported */
+static int32_t
+CodeIndexFind(const CodeIndex_t index, const void* table, size_t stride, uint32_t code)
+{
+    uint32_t x;
+
+    if (!vCodeIndexBuilt)
     {
-        vParam[i] = GetUint32(&buf[12 + i * 4]);
+        CodeIndexBuild(vOpcodeIndex, vPtpOpcodeTable, sizeof(vPtpOpcodeTable[0]));
+        CodeIndexBuild(vObjectPropIndex, vMtpObjectPropsSupported, sizeof(vMtpObjectPropsSupported[0]));
+        CodeIndexBuild(vDevicePropIndex, vMtpDevicePropsSupported, sizeof(vMtpDevicePropsSupported[0]));
+        vCodeIndexBuilt = true;
     }
+    for (x = CODE_INDEX_HASH(code); index[x] != 0; x = (x + 1) & (CODE_INDEX_SIZE - 1))
+    {
+        if (TABLE_CODE(table, stride, index[x] - 1) == code)
+        {
+            return(index[x] - 1);
+        }
+    }
+    return(-1);
+}
+
+#define OpcodeFind(code)        CodeIndexFind(vOpcodeIndex, vPtpOpcodeTable, sizeof(vPtpOpcodeTable[0]), code)
+#define ObjectPropFind(code)    CodeIndexFind(vObjectPropIndex, vMtpObjectPropsSupported, sizeof(vMtpObjectPropsSupported[0]), code)
+#define DevicePropFind(code)    CodeIndexFind(vDevicePropIndex, vMtpDevicePropsSupported, sizeof(vMtpDevicePropsSupported[0]), code)
+
+
+/* Resume point of the procedure generating the current data phase. Instead of
+   regenerating the dataset from byte 0 for every packet, a procedure records a
+   mark at each field group or array element it passes. The next packet resumes
+   at the last mark that lies within the previous packet, so the cost of a packet
+   no longer depends on its offset in the dataset. */
+typedef struct PtpCursor_s
+{
+    uint32_t step;      // Field group to resume at
+    uint32_t item;      // Element within that field group
+    uint32_t offset;    // Dataset offset of step/item
+    uint32_t end;       // Dataset offset where the current packet ends
+}
+PtpCursor_t;
+
+
+/* Enumeration of objects through the directory cursor, for the listings of
+ * GetObjectHandles and GetObjectPropList. It covers one folder, the roots of
+ * all storages one after the other, or for a store-wide listing every folder
+ * below them. Subfolders are walked depth first without recursion and
+ * without a stack, so there is no limit to the depth: when a subfolder is done
+ * its parent comes from the folder index, and is reopened and read up to the
+ * subfolder to continue after it. */
+typedef struct Walk_s
+{
+    uint32_t first;         // Folder the walk starts with, 0 for an empty walk
+    uint32_t storage;       // Storage being walked
+    uint32_t folder;        // Folder being listed
+    uint32_t count;         // Objects returned so far
+    uint32_t descend;       // Folder returned last, entered by the next step
+    uint32_t depth;         // Levels entered below the first folder
+    uint16_t format;        // Objects of other formats are skipped, 0 for any format
+    bool stores;            // Continue with the root of the next storage
+    bool recursive;         // Enter the subfolders
+    bool failed;            // A subfolder could not be entered or left, objects are missing
+} Walk_t;
+
+
+/* State of the running transaction, from its command block to its response.
+ * It is cleared as a whole when the next command arrives or the transaction
+ * is cancelled, so no operation can see what the previous one left behind. */
+typedef struct PtpTransaction_s
+{
+    volatile uint32_t id;       // TransactionID
+    const struct PtpOpcodeTable_s* opcode;
+    PtpProc_t proc;             // Generates the data phase to the host and the response
+    PtpProc_t data;             // Consumes the data phase from the host
+    uint32_t dataIndex;         // Bytes of the data phase consumed so far
+
+    uint32_t param[5];
+    uint16_t responseCode;
+    uint8_t responseParamCount;
+    uint32_t responseParam[5];
+
+    volatile uint32_t length;   // Length of the data phase to the host
+    volatile uint32_t index;    // Bytes of it sent so far
+
+    PtpCursor_t cursor;
+    DirCursor_t dir;
+    Walk_t walk;
+#if (MTP_DATASET_POOL > 0)
+    const struct Dataset_s* dataset;    // Prebuilt dataset being sent
+    bool building;              // The dataset is being generated into the pool
+#endif
+
+    // Kept by an operation between the packets of its data phase
+    union
+    {
+        uint32_t objects;       // GetObjectHandles
+        struct
+        {
+            uint32_t quadruples;    // Counted by the first call for depth 1
+            uint32_t objects;
+        } list;                 // GetObjectPropList
+    #if (MTP_READONLY != 1)
+        struct
+        {
+            uint32_t expect;
+            uint32_t received;
+            uint32_t size;
+            uint16_t format;
+            uint16_t nameLen, createdLen, modifiedLen, varIdx;
+            char timeStr[24];
+            Utf16Stream_t name, time;
+            time_t created;
+            time_t modified;
+        } info;                 // SendObjectInfo
+        struct
+        {
+            uint32_t expect;
+            uint32_t received;
+        } object;               // SendObject
+        struct
+        {
+            uint32_t expect;
+            uint16_t nameLen;
+            char name[sizeof(((VfsInfo_t*)0)->name)];
+            Utf16Stream_t stream;
+            uint16_t response;
+        } prop;                 // SetObjectPropValue
+    #endif
+    } op;
+} PtpTransaction_t;
+
+
+/* One protocol engine, for one class driver instance. The storage caches are
+ * shared by all engines, so they have to run from the same execution context. */
+struct PtpContext_s
+{
+    uint32_t session;
+    uint8_t buffer[PTP_BUF_SIZE];
+    VfsFile_t file;             // Object read by GetObject or written by SendObject
+#if (MTP_READONLY != 1)
+    uint32_t sendParent;        // Folder and handle announced by SendObjectInfo
+    uint32_t sendId;
+#endif
+    uint8_t status[4];          // Reply of the GetDeviceStatus request
+    USBD_HandleTypeDef* device; // USB core the engine runs on, for the events
+    volatile bool cancelled;    // SendObject was cancelled, GetDeviceStatus reports it from the interrupt without touching file
+    PtpTransaction_t t;
+};
+
+static PtpContext_t vPtpContext[MTP_INSTANCES];
+
+
+/* Record a resume point, and leave the procedure once the packet is complete */
+#define PTP_CURSOR_MARK(s, i, len)      do { if (!PtpCursorMark(ctx, (s), (i), (len))) { return(len); } } while (0)
+
+
+static void
+PtpCursorReset(PtpContext_t* ctx, uint32_t end)
+{
+    ctx->t.cursor.step = 0;
+    ctx->t.cursor.item = 0;
+    ctx->t.cursor.offset = 0;
+    ctx->t.cursor.end = end;
 }
 
 
 static uint32_t
-PtpDeviceInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpCursorResume(PtpContext_t* ctx, uint32_t* index)
 {
-    static uint32_t len = 0;
+    // Only the part of the packet past the last mark needs to be skipped
+    *index -= ctx->t.cursor.offset;
+    return(ctx->t.cursor.offset);
+}
 
-    uint32_t i;
 
-    if (reqlen == 0)
+static bool
+PtpCursorMark(PtpContext_t* ctx, uint32_t step, uint32_t item, uint32_t len)
+{
+    if (len <= ctx->t.cursor.end)
     {
-        len = 0;
-        MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
+        ctx->t.cursor.step = step;
+        ctx->t.cursor.item = item;
+        ctx->t.cursor.offset = len;
+    }
+    return(len < ctx->t.cursor.end);
+}
+
+
+static void
+ParamParse(PtpContext_t* ctx, uint8_t* buf, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i++)
+    {
+        ctx->t.param[i] = GetUint32(&buf[12 + i * 4]);
     }
+}
+
 
-    len += Uint32(&buf, &index, &reqlen, len);    // Start with zero length
-    len += Uint16(&buf, &index, &reqlen, 2);    // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x1001);    // Code
-    len += Uint32(&buf, &index, &reqlen, id);    // TransactionID
+#if (MTP_DATASET_POOL > 0)
+#define DATASET_SLOTS   16
+#define DATASET_MIN     12      // Container header, the smallest dataset
+
+/* Datasets that never change while the device runs: DeviceInfo,
+ * ObjectPropsSupported and the ObjectPropDesc of each property. They are
+ * generated once, at their first request, into a pool; later requests copy
+ * them out packet by packet and only patch in the TransactionID. */
+typedef struct Dataset_s
+{
+    uint16_t code;          // Operation
+    uint16_t offset;        // Start in vDatasetPool
+    uint32_t param;         // First parameter the dataset depends on
+    uint32_t length;
+} Dataset_t;
 
-    len += Uint16(&buf, &index, &reqlen, PTPVERSION);
+_Static_assert(MTP_DATASET_POOL <= 65535, "MTP_DATASET_POOL too large for the 16 bit dataset offset");
 
-    len += Uint32(&buf, &index, &reqlen, 0x00000006);	// VendorExtensionID = MTP
-    len += Uint16(&buf, &index, &reqlen, MTPVERSION);	// VendorExtensionVersion
+static Dataset_t vDataset[DATASET_SLOTS];
+static uint32_t vDatasetCount = 0;
+static uint32_t vDatasetUsed = 0;
+static uint8_t vDatasetPool[MTP_DATASET_POOL];
 
-    len += String(&buf, &index, &reqlen, nullptr);	// VendorExtensionDesc
 
-    len += Uint16(&buf, &index, &reqlen, FUNCTIONALMODE);
+/* Serve a request from its prebuilt dataset, generating it with proc first
+ * when needed. Returns false when proc must generate the packet itself. */
+static bool
+DatasetCopy(PtpContext_t* ctx, PtpProc_t proc, uint16_t code, uint32_t param, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen, uint32_t* len)
+{
+    uint32_t i, n, room;
+    uint8_t* p;
 
-    len += Uint32(&buf, &index, &reqlen, (sizeof(vPtpOpcodeTable) / sizeof(vPtpOpcodeTable[0])) - 1);	// OperationsSupported
-    for (i = 0; vPtpOpcodeTable[i].opcode != 0; i++)
+    if (ctx->t.building)
+    {
+        return(false);
+    }
+    if (reqlen == 0)
     {
-        len += Uint16(&buf, &index, &reqlen, vPtpOpcodeTable[i].opcode);
+        ctx->t.dataset = nullptr;
+        for (i = 0; i < vDatasetCount; i++)
+        {
+            if ((vDataset[i].code == code) && (vDataset[i].param == param))
+            {
+                ctx->t.dataset = &vDataset[i];
+                break;
+            }
+        }
+        // Proc takes a request length of 0 for the measure call, a full pool must not get there
+        if ((ctx->t.dataset == nullptr) && (vDatasetCount < DATASET_SLOTS) && (sizeof(vDatasetPool) - vDatasetUsed >= DATASET_MIN))
+        {
+            // Generate the whole dataset into the free part of the pool
+            ctx->t.building = true;
+            n = (proc)(ctx, id, &vDatasetPool[vDatasetUsed], 0, sizeof(vDatasetPool) - vDatasetUsed);
+            ctx->t.building = false;
+            PtpCursorReset(ctx, UINT32_MAX);
+            if (n <= sizeof(vDatasetPool) - vDatasetUsed)
+            {
+                vDataset[vDatasetCount].code = code;
+                vDataset[vDatasetCount].offset = vDatasetUsed;
+                vDataset[vDatasetCount].param = param;
+                vDataset[vDatasetCount].length = n;
+                p = &vDatasetPool[vDatasetUsed];
+                i = 0;
+                room = sizeof(uint32_t);
+                Uint32(&p, &i, &room, n);   // Length, not known yet while generating
+                ctx->t.dataset = &vDataset[vDatasetCount++];
+                vDatasetUsed += n;
+            }
+        }
+        if (ctx->t.dataset == nullptr)
+        {
+            return(false);
+        }
+        *len = ctx->t.dataset->length;
+        return(true);
     }
 
-#ifdef MTP_EVENTS
-    len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpDeviceEventsSupported) / sizeof(vMtpDeviceEventsSupported[0])) - 1);	// EventsSupported
-    for (i = 0; vMtpDeviceEventsSupported[i].prop != 0; i++)
+    if (ctx->t.dataset == nullptr)
+    {
+        return(false);
+    }
+    n = ctx->t.dataset->length - index;
+    if (n > reqlen)
+    {
+        n = reqlen;
+    }
+    memcpy(buf, &vDatasetPool[ctx->t.dataset->offset + index], n);
+    for (i = index; (i < 12) && (i < index + n); i++)
     {
-        len += Uint16(&buf, &index, &reqlen, vMtpDeviceEventsSupported[i].prop);
+        if (i >= 8)
+        {
+            buf[i - index] = (id >> ((i - 8) * 8)) & 0xFF;   // TransactionID
+        }
     }
+    *len = ctx->t.dataset->length;
+    return(true);
+}
 #else
-    len += Uint32(&buf, &index, &reqlen, 0);	// EventsSupported
+#define DatasetCopy(ctx, proc, code, param, id, buf, index, reqlen, len)     false
 #endif
 
-    len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpDevicePropsSupported) / sizeof(vMtpDevicePropsSupported[0])) - 1);	// DevicePropertiesSupported
-    for (i = 0; vMtpDevicePropsSupported[i].prop != 0; i++)
-    {
-        len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].prop);
-    }
 
-    len += Uint32(&buf, &index, &reqlen, 0);	// CaptureFormats
+static uint32_t
+PtpDeviceInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+{
+    uint32_t len;
+    uint32_t i;
 
-    len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpObjectFormats) / sizeof(vMtpObjectFormats[0])) - 1);	// ImageFormats
-    for (i = 0; vMtpObjectFormats[i].format != 0; i++)
+    if (reqlen == 0)
+    {
+        MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
+    }
+    if (DatasetCopy(ctx, PtpDeviceInfo, 0x1001, 0, id, buf, index, reqlen, &len))
     {
-        len += Uint16(&buf, &index, &reqlen, vMtpObjectFormats[i].format);
+        ctx->t.responseCode = OK;
+        return(len);
     }
+    len = PtpCursorResume(ctx, &index);
 
-    len += String(&buf, &index, &reqlen, MTP_MANUFACTURER);	// Manufacturer
-    len += String(&buf, &index, &reqlen, MTP_FRIENDLYNAME);	// Model
+    switch (ctx->t.cursor.step)
+    {
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);    // Length
+            len += Uint16(&buf, &index, &reqlen, 2);    // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x1001);    // Code
+            len += Uint32(&buf, &index, &reqlen, id);    // TransactionID
 
-    char versionbuf[16];
-#ifdef _VERSION_H
-    sniprintf(versionbuf, sizeof(versionbuf), "%u.%u.%u.%u", VER_H, VER_MH, VER_ML, VER_L);
-#else
-    extern uint8_t USBD_DeviceDesc[];
-    sniprintf(versionbuf, sizeof(versionbuf), "%u.%u", USBD_DeviceDesc[13], USBD_DeviceDesc[12]);
-#endif
-    len += String(&buf, &index, &reqlen, versionbuf);	// DeviceVersion
-    len += String(&buf, &index, &reqlen, MTP_SERIAL);	// SerialNumber
+            len += Uint16(&buf, &index, &reqlen, PTPVERSION);
+
+            len += Uint32(&buf, &index, &reqlen, 0x00000006);	// VendorExtensionID = MTP
+            len += Uint16(&buf, &index, &reqlen, MTPVERSION);	// VendorExtensionVersion
+
+            len += String(&buf, &index, &reqlen, nullptr);	// VendorExtensionDesc
+
+            len += Uint16(&buf, &index, &reqlen, FUNCTIONALMODE);
+
+            len += Uint32(&buf, &index, &reqlen, (sizeof(vPtpOpcodeTable) / sizeof(vPtpOpcodeTable[0])) - 1);	// OperationsSupported
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            for (i = ctx->t.cursor.item; vPtpOpcodeTable[i].opcode != 0; i++)
+            {
+                PTP_CURSOR_MARK(1, i, len);
+                len += Uint16(&buf, &index, &reqlen, vPtpOpcodeTable[i].opcode);
+            }
+
+        #ifdef MTP_EVENTS
+            len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpDeviceEventsSupported) / sizeof(vMtpDeviceEventsSupported[0])) - 1);	// EventsSupported
+        #else
+            len += Uint32(&buf, &index, &reqlen, 0);	// EventsSupported
+        #endif
+            PTP_CURSOR_MARK(2, 0, len);
+            // fall through
+
+        case 2:
+        #ifdef MTP_EVENTS
+            for (i = ctx->t.cursor.item; vMtpDeviceEventsSupported[i].prop != 0; i++)
+            {
+                PTP_CURSOR_MARK(2, i, len);
+                len += Uint16(&buf, &index, &reqlen, vMtpDeviceEventsSupported[i].prop);
+            }
+        #endif
+
+            len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpDevicePropsSupported) / sizeof(vMtpDevicePropsSupported[0])) - 1);	// DevicePropertiesSupported
+            PTP_CURSOR_MARK(3, 0, len);
+            // fall through
+
+        case 3:
+            for (i = ctx->t.cursor.item; vMtpDevicePropsSupported[i].prop != 0; i++)
+            {
+                PTP_CURSOR_MARK(3, i, len);
+                len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].prop);
+            }
+
+            len += Uint32(&buf, &index, &reqlen, 0);	// CaptureFormats
+
+            len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpObjectFormats) / sizeof(vMtpObjectFormats[0])) - 1);	// ImageFormats
+            PTP_CURSOR_MARK(4, 0, len);
+            // fall through
+
+        case 4:
+            for (i = ctx->t.cursor.item; vMtpObjectFormats[i].format != 0; i++)
+            {
+                PTP_CURSOR_MARK(4, i, len);
+                len += Uint16(&buf, &index, &reqlen, vMtpObjectFormats[i].format);
+            }
+            PTP_CURSOR_MARK(5, 0, len);
+            // fall through
+
+        case 5:
+            len += String(&buf, &index, &reqlen, MTP_MANUFACTURER);	// Manufacturer
+            len += String(&buf, &index, &reqlen, MTP_FRIENDLYNAME);	// Model
+            PTP_CURSOR_MARK(6, 0, len);
+            // fall through
 
-    vResponseCode = OK;
+        case 6:
+        {
+            char versionbuf[16];
+        #ifdef _VERSION_H
+            sniprintf(versionbuf, sizeof(versionbuf), "%u.%u.%u.%u", VER_H, VER_MH, VER_ML, VER_L);
+        #else
+            extern uint8_t USBD_DeviceDesc[];
+            sniprintf(versionbuf, sizeof(versionbuf), "%u.%u", USBD_DeviceDesc[13], USBD_DeviceDesc[12]);
+        #endif
+            len += String(&buf, &index, &reqlen, versionbuf);	// DeviceVersion
+            len += String(&buf, &index, &reqlen, MTP_SERIAL);	// SerialNumber
+        }
+    }
+
+    ctx->t.responseCode = OK;
     return(len);
 }
 
 
+/* The folder and handle indexes, aliases and lookups are shared by the engines,
+ * only the first session to open and the last to close start them over */
+static bool
+PtpOtherSession(PtpContext_t* ctx)
+{
+    uint32_t i;
+
+    for (i = 0; i < MTP_INSTANCES; i++)
+    {
+        if ((&vPtpContext[i] != ctx) && (vPtpContext[i].session != 0))
+        {
+            return(true);
+        }
+    }
+    return(false);
+}
+
+
 static uint32_t
-PtpOpenSession(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpOpenSession(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
 
-        if (vPtpSession == vParam[0])
+        if (ctx->session == ctx->t.param[0])
         {
-            return(PtpResponse(id, vPtpBuffer, PtpErr_SessionAlreadyOpen));
+            return(PtpResponse(ctx, id, ctx->buffer, PtpErr_SessionAlreadyOpen));
         }
-        else if (vPtpSession != 0)
+        else if (ctx->session != 0)
         {
-            return(PtpResponse(id, vPtpBuffer, PtpErr_DeviceBusy));
+            return(PtpResponse(ctx, id, ctx->buffer, PtpErr_DeviceBusy));
         }
         else
         {
-		#if VFS_NODIRS != 1
-            char tmp[13];
-            int i;
-
-            for (i = 0; vfs_volume(i) != nullptr; i++)
+            if (!PtpOtherSession(ctx))
             {
-            	VfsInfo_t info;
+			#if VFS_NODIRS != 1
+                int i;
 
-            	if (vfs_stat(vfs_volume(i), &info) == 0)
-            	{
-            		if (!(info.attrib & ATR_FLAT_FILESYSTEM))
-					{
-						siprintf(tmp, "%s%s", vfs_volume(i), MTP_FOLDER_CACHE_FILE);
-						if (vfs_file_open(&vSendObjectHandle, tmp, VFS_RDWR | VFS_TRUNC) == 0)
+                for (i = 0; vfs_volume(i) != nullptr; i++)
+                {
+                	VfsInfo_t info;
+
+                	if (vfs_stat(vfs_volume(i), &info) == 0)
+                	{
+                		if (!(info.attrib & ATR_FLAT_FILESYSTEM) && !FolderIndexLoad(i))
 						{
-							vfs_file_close(&vSendObjectHandle);
+							FolderIndexReset(i);
 						}
-					}
-            	}
-            }
-		#endif
+                	}
+                }
+			#endif
 
-            vPtpSession = vParam[0];
-            MTP_SESSION_OPEN_HOOK(vParam[0]);
+                HandleIndexClear();
+                RenameAliasClear();
+            }
+            ctx->session = ctx->t.param[0];
+            MTP_SESSION_OPEN_HOOK(ctx->t.param[0]);
         }
     }
-    return(PtpResponse(id, vPtpBuffer, OK));
+    return(PtpResponse(ctx, id, ctx->buffer, OK));
 }
 
 
 static uint32_t
-PtpCloseSession(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpCloseSession(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     if (reqlen == 0)
     {
         MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
-        vPtpSession = 0;
+        ctx->session = 0;
+        DirCursorClose(&ctx->t.dir);
 
-	#if VFS_NODIRS != 1
-        if (vFolderCacheDirty != 0)
+        if (!PtpOtherSession(ctx))
         {
-            int i;
-            char path[13];
+		#if VFS_NODIRS != 1
+            vFolderIndexValid = 0;
+		#endif
 
-            // Delete cache files
-            for (i = 0; i < (1 << INODE_STORAGE_BITS); i++)
-            {
-                if (vFolderCacheDirty & (1 << i))
-                {
-                    siprintf(path, "%s%s", vfs_volume(i), MTP_FOLDER_CACHE_FILE);
-                    vfs_remove(path);
-                }
-            }
+            // Free a bunch of allocated memory
+            HandleIndexClear();
+            RenameAliasClear();
+            GetFileById(nullptr, 0, false, nullptr);
         }
-	#endif
-
-        // Free a bunch of allocated memory
-        GetFileById(nullptr, 0, false, nullptr);
         MTP_SESSION_CLOSE_HOOK();
     }
-    return(PtpResponse(id, vPtpBuffer, OK));
+    return(PtpResponse(ctx, id, ctx->buffer, OK));
 }
 
 
 static uint32_t
-PtpGetStorageIds(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetStorageIds(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-
+    uint32_t len;
     uint32_t i;
     uint32_t vCnt = 0;
 
     if (reqlen == 0)
     {
-        len = 0;
         MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
     }
+    len = PtpCursorResume(ctx, &index);
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x1004);  // Code
-    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
-
-    for (i = 0; vfs_volume(i) != nullptr; i++)
+    switch (ctx->t.cursor.step)
     {
-        if (vfs_fs_size(vfs_volume(i)) >= 0)
-        {
-            vCnt++;
-        }
-    }
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
+            len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x1004);  // Code
+            len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
-    len += Uint32(&buf, &index, &reqlen, vCnt);  // Number of StorageID elements in StorageID
-    for (i = 0; vfs_volume(i) != nullptr; i++)
-    {
-        if (vfs_fs_size(vfs_volume(i)) >= 0)
-        {
-            len += Uint32(&buf, &index, &reqlen, STORAGE_ID(i));  // StorageID on device
-        }
+            for (i = 0; vfs_volume(i) != nullptr; i++)
+            {
+                if (vfs_fs_size(vfs_volume(i)) >= 0)
+                {
+                    vCnt++;
+                }
+            }
+
+            len += Uint32(&buf, &index, &reqlen, vCnt);  // Number of StorageID elements in StorageID
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            for (i = ctx->t.cursor.item; vfs_volume(i) != nullptr; i++)
+            {
+                PTP_CURSOR_MARK(1, i, len);
+                if (vfs_fs_size(vfs_volume(i)) >= 0)
+                {
+                    len += Uint32(&buf, &index, &reqlen, STORAGE_ID(i));  // StorageID on device
+                }
+            }
     }
     return(len);
 }
 
 
 static uint32_t
-PtpGetStorageInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetStorageInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-
+    uint32_t len;
     char* drive;
     VfsInfo_t info;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);    // StorageID
-        len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);    // StorageID
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
     }
+    len = PtpCursorResume(ctx, &index);
 
-    if (drive = vfs_volume(DRIVE_NUM(vParam[0])), drive == nullptr)
+    if (drive = vfs_volume(DRIVE_NUM(ctx->t.param[0])), drive == nullptr)
     {
-        return(PtpResponse(id, nullptr, PtpErr_InvalidStorageId));
+        return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidStorageId));
     }
     if (vfs_fs_size(drive) < 0)
     {
-        return(PtpResponse(id, nullptr, PtpErr_StoreNotAvailable));
+        return(PtpResponse(ctx, id, nullptr, PtpErr_StoreNotAvailable));
     }
     vfs_stat(drive, &info);
     uint64_t sz = info.blocks * (uint64_t)info.blocksize;
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
+    len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
     len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
     len += Uint16(&buf, &index, &reqlen, 0x1005);  // Code
     len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
@@ -1320,324 +3751,371 @@ PtpGetStorageInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
     len += String(&buf, &index, &reqlen, info.name);	// StorageDescription
     len += String(&buf, &index, &reqlen, drive);	// Volume Identifier
 
-    vResponseCode = OK;
+    ctx->t.responseCode = OK;
     return(len);
 }
 
 
-static uint32_t
-PtpGetObjectHandles(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+/* List 'folder', from the entry after subfolder 'done' when that is not 0 */
+static int
+WalkOpen(PtpContext_t* ctx, uint32_t folder, uint32_t done)
 {
-    static uint32_t len = 0;
-
+    char* path;
     int err;
-    VfsDir_t scanhandle;
-    VfsInfo_t info = {0};
-#if 0
-    char pathbuf[MAX_PATH];
+#if VFS_NODIRS != 1
+    bool found;
 #endif
-    char* path;
-    uint32_t vFileCount = 0;
-    char tmp[MAX_PATH];
-    char* p;
 
-    if (reqlen == 0)
+    ctx->t.walk.folder = folder;
+    if (!GetFileById(nullptr, folder, true, &path))
     {
-        ParamParse(buf, 3);    // StorageID, [ObjectFormatCode], [Association]
-        len = 0;
-        MTP_DBG_LVL0("%s[%u] %lX,%lX,%lX", __FUNCTION__, __LINE__, vParam[0], vParam[1], vParam[2]);
+        DirCursorClose(&ctx->t.dir);
+        return(ENOENT);
     }
-
-    if (vParam[1] != 0)
+    if (err = DirCursorOpen(&ctx->t.dir, path, INODE_STORAGE(folder)), (err != 0) || (done == 0))
+    {
+        return(err);
+    }
+#if VFS_NODIRS != 1
+    // Skip the entries returned before the subfolder was entered. They are only
+    // compared by name, registering them again costs an index search each.
+    if (found = FolderIndexOpen(INODE_STORAGE(done), VFS_RDONLY), found)
     {
-        return(PtpResponse(id, nullptr, PtpErr_SpecificationByFormatUnsupported));
+        found = FolderIndexRead(INODE_FOLDER(done));
+        vfs_file_close(&vFolderFile);
     }
-    else if ((vParam[2] != 0) && (vParam[2] != UINT32_MAX))
+    while (found && (vfs_dir_read(&ctx->t.dir.dir, &ctx->t.dir.info) == 0))
     {
-        // Get the folder name whose listing is requested
-        if (!GetFileById(nullptr, vParam[2], true, &path))
-		//XXX if (!GetFileById(nullptr, vParam[2], false, &path))
+        if ((ctx->t.dir.info.attrib & ATR_DIR) && (strcmp(ctx->t.dir.info.name, vFolderRecord.name) == 0))
         {
-            return(PtpResponse(id, nullptr, PtpErr_InvalidParentObject));
+            ctx->t.dir.handle = done;
+            return(0);
         }
-        MTP_DBG_LVL1("%lX %s", vParam[2], path);
     }
-    else if (!GetFileById(nullptr, DRIVE_NUM(vParam[0]) << (32 - INODE_STORAGE_BITS) | INODE_FOLDER_MASK, true, &path))
+#endif
+    // The subfolder is gone, the rest of the folder cannot be found again
+    ctx->t.walk.failed = true;
+    DirCursorClose(&ctx->t.dir);
+    return(ENOENT);
+}
+
+
+/* Start the walk over from its first folder. While counting, the file names
+ * are not hashed and the handles of files are not available. */
+static int
+WalkRewind(PtpContext_t* ctx, bool counting)
+{
+    ctx->t.walk.storage = INODE_STORAGE(ctx->t.walk.first);
+    ctx->t.walk.count = 0;
+    ctx->t.walk.descend = 0;
+    ctx->t.walk.depth = 0;
+    ctx->t.walk.failed = false;
+    ctx->t.dir.counting = counting;
+    if (ctx->t.walk.first == 0)
     {
-        return(PtpResponse(id, nullptr, PtpErr_InvalidStorageId));
+        DirCursorClose(&ctx->t.dir);
+        return(0);
     }
+    return(WalkOpen(ctx, ctx->t.walk.first, 0));
+}
+
+
+static int
+WalkStart(PtpContext_t* ctx, uint32_t folder, bool stores, bool recursive, uint16_t format, bool counting)
+{
+    ctx->t.walk.first = folder;
+    ctx->t.walk.stores = stores;
+    ctx->t.walk.recursive = recursive;
+    ctx->t.walk.format = format;
+    return(WalkRewind(ctx, counting));
+}
 
-    char* path2 = strchr(path, ':') + 1;
 
-    // Check if index is already past the header fields, then skip the counting step
-    if (index >= 16)
+static void
+WalkEnter(PtpContext_t* ctx, uint32_t folder)
+{
+#if VFS_NODIRS != 1
+    if (folder != 0)
     {
-        len += 16;
-        index -= 16;
+        ctx->t.walk.depth++;
+        WalkOpen(ctx, folder, 0);
     }
     else
     {
-	#if VFS_NODIRS != 1
-        siprintf(tmp, "%s%s", vfs_volume(DRIVE_NUM(vParam[0])), MTP_FOLDER_CACHE_FILE);
-        if (err = vfs_file_open(&vSendObjectHandle, tmp, VFS_RDWR | VFS_CREAT), err != 0)
-        {
-            MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), tmp);
-        }
-        if (vfs_stat(tmp, &info) == 0)
-        {
-            if (!(info.attrib & ATR_HID))
-            {
-                info.attrib |= ATR_HID;
-                vfs_touch(tmp, &info);
-            }
-        }
-	#endif
+        // Not in the folder index, its objects cannot be given handles
+        ctx->t.walk.failed = true;
+    }
+#else
+    (void)folder;
+#endif
+}
+
+
+/* Advance to the next object, found in the directory cursor of the transaction */
+static bool
+WalkNext(PtpContext_t* ctx)
+{
+#if VFS_NODIRS != 1
+    uint32_t parent;
+#endif
 
-        if (err = vfs_dir_open(&scanhandle, (char*)path), err == 0)
+    if (ctx->t.walk.descend != 0)
+    {
+        WalkEnter(ctx, ctx->t.walk.descend);
+        ctx->t.walk.descend = 0;
+    }
+    for (;;)
+    {
+        while (DirCursorNext(&ctx->t.dir))
         {
-            while (vfs_dir_read(&scanhandle, &info) == 0)
+            if (ctx->t.walk.recursive && (ctx->t.dir.info.attrib & ATR_DIR))
             {
-                if (info.name[0] == '.')
-                {
-                    // Skip self and parent directory entries
-                    if ((info.name[1] == '\0') || ((info.name[1] == '.') && (info.name[2] == '\0')))
-                    {
-                        continue;
-                    }
-                }
-                if (info.attrib & ATR_HID)
+                if ((ctx->t.walk.format != 0) && !FormatMatch(ctx->t.walk.format, &ctx->t.dir.info))
                 {
+                    WalkEnter(ctx, ctx->t.dir.handle);
                     continue;
                 }
-                // Check if folder entries in the cache file, otherwise add it
-                if (info.attrib & ATR_DIR)
-                {
-				#if VFS_NODIRS != 1
-                    while (p = vfs_gets(tmp, sizeof(tmp), &vSendObjectHandle), p != nullptr)
-                    {
-                        if (strncmp(p, path2, strlen(path2)) == 0)
-                        {
-                            p += strlen(path2);
-                            if (*p == '/')
-                            {
-                                p++;
-                            }
-                            if (strncmp(p, info.name, strlen(info.name)) == 0)
-                            {
-                                p += strlen(info.name);
-                                if (strncmp(p, "\n", 2) == 0)
-                                {
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    if (p == nullptr)
-                    {
-                        vfs_puts(path2, &vSendObjectHandle);
-                        if (path[strlen(path) - 1] != '/')
-                        {
-                            vfs_puts("/", &vSendObjectHandle);
-                        }
-                        vfs_puts(info.name, &vSendObjectHandle);
-                        vfs_puts("\n", &vSendObjectHandle);
-                    }
-				#endif
-                }
-                vFileCount++;
+                ctx->t.walk.descend = ctx->t.dir.handle;
             }
-            vfs_dir_close(&scanhandle);
-		#if VFS_NODIRS != 1
-            vfs_file_close(&vSendObjectHandle);
-		#endif
-
-            len += Uint32(&buf, &index, &reqlen, len);     // Length
-            len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-            len += Uint16(&buf, &index, &reqlen, 0x1007);  // Code
-            len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
+            else if ((ctx->t.walk.format != 0) && !FormatMatch(ctx->t.walk.format, &ctx->t.dir.info))
+            {
+                continue;
+            }
+            ctx->t.walk.count++;
+            return(true);
+        }
 
-            len += Uint32(&buf, &index, &reqlen, vFileCount);  // Number of elements
+        // Folder done, continue with the folder above or the next storage
+        if (ctx->t.walk.depth > 0)
+        {
+            ctx->t.walk.depth--;
+        #if VFS_NODIRS != 1
+            if (parent = FolderIndexParent(ctx->t.walk.folder), parent == 0)
+            {
+                MTP_DBG_LVL0("%s[%u] %lX has no parent", __FUNCTION__, __LINE__, (unsigned long)ctx->t.walk.folder);
+                ctx->t.walk.failed = true;
+                DirCursorClose(&ctx->t.dir);
+                return(false);
+            }
+            WalkOpen(ctx, parent, ctx->t.walk.folder);
+        #endif
         }
-        else if ((err == ENOTDIR) || (err == ENODEV))
+        else if (ctx->t.walk.stores && (vfs_volume(ctx->t.walk.storage + 1) != nullptr))
         {
-            return(PtpResponse(id, nullptr, PtpErr_StoreNotAvailable));
+            ctx->t.walk.storage++;
+            WalkOpen(ctx, (ctx->t.walk.storage << (32 - INODE_STORAGE_BITS)) | INODE_FOLDER_MASK, 0);
         }
         else
         {
-            return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+            DirCursorClose(&ctx->t.dir);
+            return(false);
         }
     }
+}
 
-    if (vfs_dir_open(&scanhandle, (char*)path) == 0)
-    {
-        uint32_t x = 0;
 
-	#if VFS_NODIRS != 1
-        siprintf(tmp, "%s%s", vfs_volume(DRIVE_NUM(vParam[0])), MTP_FOLDER_CACHE_FILE);
-        vfs_file_open(&vSendObjectHandle, tmp, VFS_RDONLY);
-	#endif
+static uint32_t
+PtpGetObjectHandles(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+{
+    uint32_t len;
+    uint32_t i;
+    int err;
+    uint32_t folder;
+    bool stores = false;
+    bool measure = (reqlen == 0);   // reqlen counts down while a data packet is filled
 
-        while (vfs_dir_read(&scanhandle, &info) == 0)
+    if (reqlen == 0)
+    {
+        ParamParse(ctx, buf, 3);    // StorageID, [ObjectFormatCode], [Association]
+        MTP_DBG_LVL0("%s[%u] %lX,%lX,%lX", __FUNCTION__, __LINE__, (unsigned long)ctx->t.param[0],
+                (unsigned long)ctx->t.param[1], (unsigned long)ctx->t.param[2]);
+
+        if ((ctx->t.param[2] != 0) && (ctx->t.param[2] != UINT32_MAX))
         {
-            if (info.name[0] == '.')
+            // The folder whose listing is requested
+            if (!GetFileById(nullptr, ctx->t.param[2], true, nullptr))
             {
-                // Skip self and parent directory entries
-                if ((info.name[1] == '\0') || ((info.name[1] == '.') && (info.name[2] == '\0')))
-                {
-                    continue;
-                }
+                return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidParentObject));
             }
-            if (info.attrib & ATR_HID)
+            folder = ctx->t.param[2];
+        }
+        else if (ctx->t.param[0] == UINT32_MAX)
+        {
+            // All storages, one after the other
+            folder = INODE_FOLDER_MASK;
+            stores = true;
+        }
+        else if (folder = DRIVE_NUM(ctx->t.param[0]) << (32 - INODE_STORAGE_BITS) | INODE_FOLDER_MASK, !GetFileById(nullptr, folder, true, nullptr))
+        {
+            return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidStorageId));
+        }
+
+        // Count the objects (and register new folders) only once, before the data phase starts.
+        // Association 0 lists all objects on the storage, 0xFFFFFFFF only those in the root.
+        err = WalkStart(ctx, folder, stores, ctx->t.param[2] == 0, ctx->t.param[1], true);
+        if (((err == ENOTDIR) || (err == ENODEV)) && !stores)
+        {
+            return(PtpResponse(ctx, id, nullptr, PtpErr_StoreNotAvailable));
+        }
+        else if ((err != 0) && !stores)
+        {
+            return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
+        }
+        for (ctx->t.op.objects = 0; WalkNext(ctx); ctx->t.op.objects++)
+        {
+        }
+        if (ctx->t.walk.failed)
+        {
+            // Rather than a listing that silently misses objects
+            return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
+        }
+    }
+    // Data packets continue from the directory cursor, the walk was set up in the first call
+
+    len = PtpCursorResume(ctx, &index);
+
+    switch (ctx->t.cursor.step)
+    {
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);     // Length
+            len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x1007);  // Code
+            len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
+
+            len += Uint32(&buf, &index, &reqlen, ctx->t.op.objects);  // Number of elements
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            if (measure)
             {
-                continue;
+                // Each handle takes 4 bytes; restart the walk for the data packets that follow
+                len += ctx->t.op.objects * sizeof(uint32_t);
+                WalkRewind(ctx, false);
+                break;
             }
-
-//XXX            if ((index < 4) && (info.attrib & ATR_DIR))
-            if (info.attrib & ATR_DIR)
+            for (i = ctx->t.cursor.item; i < ctx->t.op.objects; i++)
             {
-			#if VFS_NODIRS != 1
-                // Fetch corresponding entry from cache file
-                while (p = vfs_gets(tmp, sizeof(tmp), &vSendObjectHandle), p != nullptr)
+                PTP_CURSOR_MARK(1, i, len);
+                // Object i may already have been read for the tail of the previous packet
+                if ((i >= ctx->t.walk.count) && !WalkNext(ctx))
                 {
-                    x++;
-                    if (strncmp(p, path2, strlen(path2)) == 0)
-                    {
-                        p += strlen(path2);
-                        if (*p == '/')
-                        {
-                            p++;
-                        }
-                        if (strncmp(p, info.name, strlen(info.name)) == 0)
-                        {
-                            p += strlen(info.name);
-                            if (strncmp(p, "\n", 2) == 0)
-                            {
-                                break;
-                            }
-                        }
-                    }
+                    ctx->t.dir.handle = 0;  // Storage shrunk since it was counted
+                    ctx->t.walk.count = i + 1;
                 }
-			#endif
-                info.inode = (x << INODE_ITEM_BITS) | (DRIVE_NUM(vParam[0]) << (32 - INODE_STORAGE_BITS));
-            }
-            else
-            {
-                // Determine the hash-based handle
-                info.inode = HandleFilenameBits(info.name) | vCurrentParent;
+                len += Uint32(&buf, &index, &reqlen, ctx->t.dir.handle);  // Object Handle
             }
-
-            if (reqlen == 0)
-            {
-				MTP_DBG_LVL0("List: %lX - %s", info.inode, info.name);
-            }
-            len += Uint32(&buf, &index, &reqlen, info.inode);  // Object Handle
-        }
-	#if VFS_NODIRS != 1
-        vfs_file_close(&vSendObjectHandle);
-	#endif
-        vfs_dir_close(&scanhandle);
+            DirCursorClose(&ctx->t.dir);
     }
     return(len);
 }
 
 
 static uint32_t
-PtpGetObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetObjectInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-
+    uint32_t len;
     VfsInfo_t* info = nullptr;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);   // ObjectHandle
-        len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);   // ObjectHandle
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
     }
 
-    if (!GetFileById(&info, vParam[0], false, nullptr))
+    if (!GetFileById(&info, ctx->t.param[0], false, nullptr))
     {
-        return(PtpResponse(id, nullptr, PtpErr_AccessDenied));
+        return(PtpResponse(ctx, id, nullptr, PtpErr_AccessDenied));
     }
+    len = PtpCursorResume(ctx, &index);
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x1008);  // Code
-    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
-
-    len += MtpObjProp_StorageId(&buf, &index, &reqlen, vParam[0], info);  // Storage ID
-    len += MtpObjProp_ObjectFormat(&buf, &index, &reqlen, vParam[0], info);  // Object Format
-    len += MtpObjProp_ProtectionStatus(&buf, &index, &reqlen, vParam[0], info);  // ProtectionStatus (0=RW, 1=RO)
-    MtpObjProp_ObjectSize(&buf, &index, &reqlen, vParam[0], info);  // Object Compressed Size
-    len += 4; //  ObjectSize gives 64 bit number, but we only need 32
-    len += Uint16(&buf, &index, &reqlen, 0);  // * Thumb Format
-    len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Compressed Size
-    len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Pix Width
-    len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Pix Height
-    len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Width
-    len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Height
-    len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Depth
-    len += MtpObjProp_ParentObject(&buf, &index, &reqlen, vParam[0], info);  // Parent Object
-    len += Uint16(&buf, &index, &reqlen, info->attrib & ATR_DIR ? 1 : 0);  // Association Code
-    len += Uint32(&buf, &index, &reqlen, 0);  // Association Desc
-    len += Uint32(&buf, &index, &reqlen, 0);  // * Sequence Number
-    len += MtpObjProp_ObjectFileName(&buf, &index, &reqlen, vParam[0], info);	// FileName
-    len += MtpObjProp_ObjectTimeCreated(&buf, &index, &reqlen, vParam[0], info);	// Date Created
-    len += MtpObjProp_ObjectTimeModified(&buf, &index, &reqlen, vParam[0], info);	// Date Modified
-    len += String(&buf, &index, &reqlen, nullptr);	// Keywords
+    switch (ctx->t.cursor.step)
+    {
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
+            len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x1008);  // Code
+            len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
+            len += MtpObjProp_StorageId(&buf, &index, &reqlen, ctx->t.param[0], info);  // Storage ID
+            len += MtpObjProp_ObjectFormat(&buf, &index, &reqlen, ctx->t.param[0], info);  // Object Format
+            len += MtpObjProp_ProtectionStatus(&buf, &index, &reqlen, ctx->t.param[0], info);  // ProtectionStatus (0=RW, 1=RO)
+            len += Uint32(&buf, &index, &reqlen, (info->size > UINT32_MAX) ? UINT32_MAX : (uint32_t)info->size);  // Object Compressed Size
+            len += Uint16(&buf, &index, &reqlen, 0);  // * Thumb Format
+            len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Compressed Size
+            len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Pix Width
+            len += Uint32(&buf, &index, &reqlen, 0);  // * Thumb Pix Height
+            len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Width
+            len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Height
+            len += Uint32(&buf, &index, &reqlen, 0);  // Image Pix Depth
+            len += MtpObjProp_ParentObject(&buf, &index, &reqlen, ctx->t.param[0], info);  // Parent Object
+            len += Uint16(&buf, &index, &reqlen, info->attrib & ATR_DIR ? 1 : 0);  // Association Code
+            len += Uint32(&buf, &index, &reqlen, 0);  // Association Desc
+            len += Uint32(&buf, &index, &reqlen, 0);  // * Sequence Number
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            len += MtpObjProp_ObjectFileName(&buf, &index, &reqlen, ctx->t.param[0], info);	// FileName
+            PTP_CURSOR_MARK(2, 0, len);
+            // fall through
+
+        case 2:
+            len += MtpObjProp_ObjectTimeCreated(&buf, &index, &reqlen, ctx->t.param[0], info);	// Date Created
+            len += MtpObjProp_ObjectTimeModified(&buf, &index, &reqlen, ctx->t.param[0], info);	// Date Modified
+            len += String(&buf, &index, &reqlen, nullptr);	// Keywords
+    }
     return(len);
 }
 
 
 static uint32_t
-PtpGetObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-
+    uint32_t len;
     char* path;
     VfsInfo_t* info;
 
+    len = PtpCursorResume(ctx, &index);
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);    // ObjectHandle
-        len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);    // ObjectHandle
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
 
-        if (GetFileById(&info, vParam[0], false, &path))
+        if (GetFileById(&info, ctx->t.param[0], false, &path))
         {
-            len += info->size;
-
-            if (vfs_file_open(&vSendObjectHandle, path, VFS_RDONLY) != 0)
+            if (vfs_file_open(&ctx->file, path, VFS_RDONLY) != 0)
             {
-                return(PtpResponse(id, nullptr, PtpErr_AccessDenied));
+                return(PtpResponse(ctx, id, nullptr, PtpErr_AccessDenied));
             }
+            // The size of the open file, the firmware may have changed it since the listing
+            len += vfs_file_size(&ctx->file);
             MTP_DBG_LVL0("%s[%u] %s", __FUNCTION__, __LINE__, path);
         }
         else
         {
-            return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
         }
     }
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
+    len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
     len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
     len += Uint16(&buf, &index, &reqlen, 0x1009);  // Code
     len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
     if (reqlen > 0)
     {
-        if (vSendObjectHandle.filesys != nullptr)
+        if (ctx->file.filesys != nullptr)
         {
             uint32_t vBytesRead = 0;
 
-            if (vBytesRead = vfs_file_read(&vSendObjectHandle, buf, reqlen), vBytesRead >= 0)
+            if (vBytesRead = vfs_file_read(&ctx->file, buf, reqlen), vBytesRead >= 0)
             {
                 buf += vBytesRead;
                 reqlen -= vBytesRead;
             }
-            if (vfs_file_eof(&vSendObjectHandle))
+            if (vfs_file_eof(&ctx->file))
             {
-                vfs_file_close(&vSendObjectHandle);
+                vfs_file_close(&ctx->file);
             }
         }
     }
@@ -1647,7 +4125,7 @@ PtpGetObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
 #if (MTP_READONLY != 1)
 static uint32_t
-PtpDeleteObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpDeleteObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     char* path;
     int err;
@@ -1655,10 +4133,10 @@ PtpDeleteObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);    // ObjectHandle
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);    // ObjectHandle
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
 
-        if (GetFileById(&info, vParam[0], false, &path))
+        if (GetFileById(&info, ctx->t.param[0], false, &path))
         {
             // Delete directory contents
             if (info->attrib & ATR_DIR)
@@ -1683,46 +4161,63 @@ PtpDeleteObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
                         }
                         strcat(path, "/");
                         strcat(path, info->name);
+                    #if VFS_NODIRS != 1
+                        if ((vfs_remove(path) == 0) && (info->attrib & ATR_DIR))
+                        {
+                            uint32_t folder = FolderIndexFind(ctx->t.param[0], info->name);
+
+                            // A folder never listed is not in the index, leave the file alone
+                            if (folder != 0)
+                            {
+                                FolderIndexRemove(folder);
+                            }
+                        }
+                    #else
                         vfs_remove(path);
+                    #endif
                         path[x] = '\0';
                     }
                     vfs_dir_close(&dir);
                 }
-                // Signal that the folder cache should be erased/rebuild when session closes
-                vFolderCacheDirty |= 1 << INODE_STORAGE(vParam[0]);
+                HandleIndexClear();
             }
+            HandleIndexRemove(ctx->t.param[0]);
+            RenameAliasRemove(ctx->t.param[0]);
+            LookupCacheClear();
             err = -vfs_remove(path);
             MTP_DBG_LVL0("%s[%u] %s %s", __FUNCTION__, __LINE__, strerror(err), path);
             switch (err)
             {
                 case 0:
-                    return(PtpResponse(id, nullptr, OK));
+                #if VFS_NODIRS != 1
+                    if ((ctx->t.param[0] & INODE_ITEM_MASK) == 0)
+                    {
+                        FolderIndexRemove(ctx->t.param[0]);
+                    }
+                #endif
+                    GetFileById(nullptr, 0, false, nullptr);   // Drop the cached lookup of the deleted object
+                    return(PtpResponse(ctx, id, nullptr, OK));
 
                 case EINVAL:
-                    return(PtpResponse(id, nullptr, PtpErr_InvalidObjectHandle));
+                    return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidObjectHandle));
 
                 case EROFS:
-                    return(PtpResponse(id, nullptr, PtpErr_ObjectWriteProtected));
+                    return(PtpResponse(ctx, id, nullptr, PtpErr_ObjectWriteProtected));
 
                 case ENOSPC:
                 case ENOTDIR:
-                    return(PtpResponse(id, nullptr, PtpErr_AccessDenied));
+                    return(PtpResponse(ctx, id, nullptr, PtpErr_AccessDenied));
 
                 default:
-                    return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+                    return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
             }
         }
     }
-    return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+    return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
 }
 #endif
 
 
-#if (MTP_READONLY != 1)
-static uint32_t vSendObjectParent;
-static uint32_t vSendObjectId;
-#endif
-
 // See MTPforUSB-IFv1.1 page 50
 #define OBJECTINFO_DATAOFFSET       12
 #define OBJECTINFO_FORMATOFFSET     (OBJECTINFO_DATAOFFSET + 4)
@@ -1732,7 +4227,7 @@ static uint32_t vSendObjectId;
 
 #if (MTP_READONLY != 1)
 static uint32_t
-PtpSendObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpSendObjectInfo(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     uint32_t len = 0;
 
@@ -1742,32 +4237,32 @@ PtpSendObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 2);   // Storage ID, Parent Handle
-        MTP_DBG_LVL1("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, vParam[0], vParam[1]);
+        ParamParse(ctx, buf, 2);   // Storage ID, Parent Handle
+        MTP_DBG_LVL1("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1]);
 
-        vSendObjectParent = vParam[1];
-        if ((vSendObjectParent == 0) || (vSendObjectParent == UINT32_MAX))
+        ctx->sendParent = ctx->t.param[1];
+        if ((ctx->sendParent == 0) || (ctx->sendParent == UINT32_MAX))
         {
-            if (vfs_volume(DRIVE_NUM(vParam[0])) == nullptr)
+            if (vfs_volume(DRIVE_NUM(ctx->t.param[0])) == nullptr)
             {
-                return(PtpResponse(id, nullptr, PtpErr_InvalidStorageId));
+                return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidStorageId));
             }
-            vSendObjectParent = (DRIVE_NUM(vParam[0]) << (32 - INODE_STORAGE_BITS)) | INODE_FOLDER_MASK;
+            ctx->sendParent = (DRIVE_NUM(ctx->t.param[0]) << (32 - INODE_STORAGE_BITS)) | INODE_FOLDER_MASK;
         }
-		//XXX if (!GetFileById(nullptr, vSendObjectParent, true, &path))
-		if (!GetFileById(nullptr, vSendObjectParent, false, &path))
+		//XXX if (!GetFileById(nullptr, ctx->sendParent, true, &path))
+		if (!GetFileById(nullptr, ctx->sendParent, false, &path))
         {
-            return(PtpResponse(id, nullptr, PtpErr_InvalidParentObject));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidParentObject));
         }
 
         if (err = -vfs_stat(path, &info), err == 0)
         {
-            PtpSendObjectInfoData(0, nullptr, 0, 0); // init
+            PtpSendObjectInfoData(ctx, 0, nullptr, 0, 0); // init
             len = 0;
         }
         else if (err == ENOTDIR)
         {
-            return(PtpResponse(id, nullptr, PtpErr_StoreNotAvailable));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_StoreNotAvailable));
         }
     }
     return(len);
@@ -1775,276 +4270,214 @@ PtpSendObjectInfo(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 #endif
 
 
-#if (MTP_READONLY != 1)
-static time_t
-PtpParseDateString(uint8_t* buf)
-{
-    struct tm vTm = {0};
-    char dup[5];
-
-    // First convert fields to struct tm
-    memset(dup, 0, sizeof(dup));
-    memcpy(dup, buf + 0, 4);
-    vTm.tm_year = atol(dup) - 1900;
-
-    memset(dup, 0, sizeof(dup));
-    memcpy(dup, buf + 4, 2);
-    vTm.tm_mon = atol(dup) - 1;
-
-    memcpy(dup, buf + 6, 2);
-    vTm.tm_mday = atol(dup);
-
-    memcpy(dup, buf + 9, 2);
-    vTm.tm_hour = atol(dup);
-
-    memcpy(dup, buf + 11, 2);
-    vTm.tm_min = atol(dup);
-
-    memcpy(dup, buf + 13, 2);
-    vTm.tm_sec = atol(dup);
-
-    return(mktime(&vTm));
-}
-#endif
-
-
 #if (MTP_READONLY != 1)
 static uint32_t
-PtpSendObjectInfoData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpSendObjectInfoData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t vExpectLen = 0;
-    static uint32_t vReceivedLen = 0;
-    static uint32_t vFileSize = 0;
-    static uint16_t vFormat = 0;
-    static uint16_t vNameLen = 0, vCreatedLen = 0, vModifiedLen = 0, vVarIdx = 0;
-    static uint8_t vTimeStr[24];
-    static time_t  vCreated;
-    static time_t  vModified;
-
     VfsInfo_t info;
-    uint32_t i;
+    uint32_t i, n;
     char* p;
 
     if (buf == nullptr)
     {
-        vExpectLen = 0;
+        ctx->t.op.info.expect = 0;
         return(0);
     }
 
-    if (vExpectLen == 0)
+    if (ctx->t.op.info.expect == 0)
     {
-        vExpectLen = GetUint32(&buf[0]);
-        vReceivedLen = 0;
-        MTP_DBG_LVL1("%s[%u] %lu", __FUNCTION__, __LINE__, vExpectLen);
-        memset(vPtpBuffer, 0, sizeof(vPtpBuffer));  // Needed because of or'ing of filename later on
+        ctx->t.op.info.expect = GetUint32(&buf[0]);
+        ctx->t.op.info.received = 0;
+        MTP_DBG_LVL1("%s[%u] %lu", __FUNCTION__, __LINE__, ctx->t.op.info.expect);
+        ctx->buffer[0] = '\0';
 
-        if (GetFileById(nullptr, vSendObjectParent, false, &p))
+        if (GetFileById(nullptr, ctx->sendParent, false, &p))
         {
-            strcat((char*)vPtpBuffer, p);
-            if (p = strrchr((char*)vPtpBuffer, '/'), (p != nullptr) && (p[1] != '\0'))
+            strcat((char*)ctx->buffer, p);
+            if (p = strrchr((char*)ctx->buffer, '/'), (p != nullptr) && (p[1] != '\0'))
             {
-                strcat((char*)vPtpBuffer, "/");
+                strcat((char*)ctx->buffer, "/");
             }
         }
-        vCreated = 0;
-        vModified = 0;
+        ctx->t.op.info.created = 0;
+        ctx->t.op.info.modified = 0;
     }
 
     for (i = 0; i < reqlen; i++)
     {
-        switch (vReceivedLen + i)
+        switch (ctx->t.op.info.received + i)
         {
-            case OBJECTINFO_FORMATOFFSET + 0: vFormat = buf[i]; break;
-            case OBJECTINFO_FORMATOFFSET + 1: vFormat |= buf[i] << 8; break;
+            case OBJECTINFO_FORMATOFFSET + 0: ctx->t.op.info.format = buf[i]; break;
+            case OBJECTINFO_FORMATOFFSET + 1: ctx->t.op.info.format |= buf[i] << 8; break;
 
-            case OBJECTINFO_FILESIZEOFFSET + 0: vFileSize = buf[i]; break;
-            case OBJECTINFO_FILESIZEOFFSET + 1: vFileSize |= buf[i] << 8; break;
-            case OBJECTINFO_FILESIZEOFFSET + 2: vFileSize |= buf[i] << 16; break;
-            case OBJECTINFO_FILESIZEOFFSET + 3: vFileSize |= buf[i] << 24; break;
+            case OBJECTINFO_FILESIZEOFFSET + 0: ctx->t.op.info.size = buf[i]; break;
+            case OBJECTINFO_FILESIZEOFFSET + 1: ctx->t.op.info.size |= buf[i] << 8; break;
+            case OBJECTINFO_FILESIZEOFFSET + 2: ctx->t.op.info.size |= buf[i] << 16; break;
+            case OBJECTINFO_FILESIZEOFFSET + 3: ctx->t.op.info.size |= buf[i] << 24; break;
 
-            case OBJECTINFO_FILENAMEOFFSET: vNameLen = buf[i] << 1; vVarIdx = 0; break;
+            case OBJECTINFO_FILENAMEOFFSET:
+                ctx->t.op.info.nameLen = buf[i] << 1;
+                if (p = strrchr((char*)ctx->buffer, '/'), p == nullptr)
+                {
+                    return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
+                }
+                Utf16StreamStart(&ctx->t.op.info.name, p + 1, sizeof(ctx->buffer) - (p + 1 - (char*)ctx->buffer));
+                break;
         }
-        if ((vReceivedLen + i) > OBJECTINFO_FILENAMEOFFSET)
+        if ((ctx->t.op.info.received + i) > OBJECTINFO_FILENAMEOFFSET)
         {
-            if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen))
+            if ((ctx->t.op.info.received + i) <= (OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen))
             {
-                if (p = strrchr((char*)vPtpBuffer, '/'), p != nullptr)
+                // Convert the part of the name in this packet at once
+                if (n = OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen + 1 - (ctx->t.op.info.received + i), n > reqlen - i)
                 {
-                    p[1 + (vVarIdx++ >> 1)] |= buf[i];
-                }
-                else
-                {
-                    return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+                    n = reqlen - i;
                 }
+                Utf16StreamPut(&ctx->t.op.info.name, &buf[i], n);
+                i += n - 1;
             }
-            else if ((vReceivedLen + i) == (OBJECTINFO_FILENAMEOFFSET + vNameLen + 1))
+            else if ((ctx->t.op.info.received + i) == (OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen + 1))
             {
-                vCreatedLen = buf[i] << 1;
-                vVarIdx = 0;
-                memset(vTimeStr, 0, sizeof(vTimeStr));
+                ctx->t.op.info.createdLen = buf[i] << 1;
+                ctx->t.op.info.varIdx = 0;
+                Utf16StreamStart(&ctx->t.op.info.time, ctx->t.op.info.timeStr, sizeof(ctx->t.op.info.timeStr));
             }
-            else if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + 1))
+            else if ((ctx->t.op.info.received + i) <= (OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen + ctx->t.op.info.createdLen + 1))
             {
-                vTimeStr[vVarIdx++ >> 1] |= buf[i];
-                if (vVarIdx == vCreatedLen)
+                Utf16StreamPut(&ctx->t.op.info.time, &buf[i], 1);
+                if (++ctx->t.op.info.varIdx == ctx->t.op.info.createdLen)
                 {
-                    vCreated = PtpParseDateString(vTimeStr);
+                    ctx->t.op.info.created = DateTimeParse(ctx->t.op.info.timeStr);
                 }
             }
-            else if ((vReceivedLen + i) == (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + 2))
+            else if ((ctx->t.op.info.received + i) == (OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen + ctx->t.op.info.createdLen + 2))
             {
-                vModifiedLen = buf[i] << 1;
-                vVarIdx = 0;
-                memset(vTimeStr, 0, sizeof(vTimeStr));
+                ctx->t.op.info.modifiedLen = buf[i] << 1;
+                ctx->t.op.info.varIdx = 0;
+                Utf16StreamStart(&ctx->t.op.info.time, ctx->t.op.info.timeStr, sizeof(ctx->t.op.info.timeStr));
             }
-            else if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + vModifiedLen + 2))
+            else if ((ctx->t.op.info.received + i) <= (OBJECTINFO_FILENAMEOFFSET + ctx->t.op.info.nameLen + ctx->t.op.info.createdLen + ctx->t.op.info.modifiedLen + 2))
             {
-                vTimeStr[vVarIdx++ >> 1] |= buf[i];
-                if (vVarIdx == vModifiedLen)
+                Utf16StreamPut(&ctx->t.op.info.time, &buf[i], 1);
+                if (++ctx->t.op.info.varIdx == ctx->t.op.info.modifiedLen)
                 {
-                    vModified = PtpParseDateString(vTimeStr);
+                    ctx->t.op.info.modified = DateTimeParse(ctx->t.op.info.timeStr);
                 }
             }
         }
     }
 
-    vReceivedLen += reqlen;
-    if (vReceivedLen >= vExpectLen)
+    ctx->t.op.info.received += reqlen;
+    if (ctx->t.op.info.received >= ctx->t.op.info.expect)
     {
         uint32_t fr = 0;
 
-        vResponseCode = 0;
-        MTP_DBG_LVL2("%s[%u] %s %luB", __FUNCTION__, __LINE__, (char*)vPtpBuffer, vFileSize);
+        ctx->t.responseCode = 0;
+        MTP_DBG_LVL2("%s[%u] %s %luB", __FUNCTION__, __LINE__, (char*)ctx->buffer, ctx->t.op.info.size);
 
-        if (vfs_fs_size((char*)vPtpBuffer) < 0)
+        if (vfs_fs_size((char*)ctx->buffer) < 0)
         {
-            vResponseCode = PtpErr_StoreNotAvailable;
+            ctx->t.responseCode = PtpErr_StoreNotAvailable;
         }
-        else if (vfs_stat((char*)vPtpBuffer, &info) == 0)
+        else if (vfs_stat((char*)ctx->buffer, &info) == 0)
         {
             if (!(info.attrib & ATR_IWRITE))
             {
-                vResponseCode = PtpErr_ObjectWriteProtected;
+                ctx->t.responseCode = PtpErr_ObjectWriteProtected;
             }
             //XXX else if (info.attrib & (ATR_HID | ATR_SYS | ATR_DIR))
 			else if (info.attrib & (ATR_HID | ATR_SYS))
             {
-                vResponseCode = PtpErr_AccessDenied;
+                ctx->t.responseCode = PtpErr_AccessDenied;
             }
-            else if (info.size > vFileSize)
+            else if (info.size > ctx->t.op.info.size)
             {
-                if (vfs_file_open(&vSendObjectHandle, (char*)vPtpBuffer, VFS_WRONLY | VFS_TRUNC) == 0)
+                if (vfs_file_open(&ctx->file, (char*)ctx->buffer, VFS_WRONLY | VFS_TRUNC) == 0)
                 {
-                    if (vfs_file_seek(&vSendObjectHandle, vFileSize, SEEK_SET) != 0)
+                    if (vfs_file_seek(&ctx->file, ctx->t.op.info.size, SEEK_SET) != 0)
                     {
-                        vResponseCode = PtpErr_ObjectTooLarge;
+                        ctx->t.responseCode = PtpErr_ObjectTooLarge;
                     }
 
-                    vfs_file_close(&vSendObjectHandle);
+                    vfs_file_close(&ctx->file);
                 }
                 else
                 {
-                    vResponseCode = PtpErr_GeneralError;
+                    ctx->t.responseCode = PtpErr_GeneralError;
                 }
             }
-            else if (vFileSize >= vfs_fs_free((char*)vPtpBuffer) - info.size)
+            else if (ctx->t.op.info.size >= vfs_fs_free((char*)ctx->buffer) - info.size)
             {
-                vResponseCode = PtpErr_ObjectTooLarge;
+                ctx->t.responseCode = PtpErr_ObjectTooLarge;
             }
         }
-        else if (vFormat == FORMAT_ASSOCIATION)
+        else if (ctx->t.op.info.format == FORMAT_ASSOCIATION)
         {
             int err;
 
 		#if VFS_NODIRS != 1
-            vResponseCode = PtpErr_GeneralError;
-            if (err = vfs_mkdir((char*)vPtpBuffer), err == 0)
+            ctx->t.responseCode = PtpErr_GeneralError;
+            if (err = vfs_mkdir((char*)ctx->buffer), err == 0)
             {
-                char tmp[13];
-
-                // Add folder entry to cache file
-                siprintf(tmp, "%s%s", vfs_volume(DRIVE_NUM(vParam[0])), MTP_FOLDER_CACHE_FILE);
-                if (err = vfs_file_open(&vSendObjectHandle, tmp, VFS_RDWR | VFS_CREAT), err != 0)
+                // Add folder entry to the folder index, or find the one of a previous folder with the same name
+                p = strrchr((char*)ctx->buffer, '/') + 1;
+                if (ctx->sendId = FolderIndexRegister(ctx->sendParent & (INODE_STORAGE_MASK | INODE_FOLDER_MASK), p), ctx->sendId != 0)
                 {
-                    MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), tmp);
-                }
-                else
-                {
-                    i = 0;
-                	// Search for either match of previous folder with same name, or determine the next id
-                    while (p = vfs_gets(info.name, sizeof(info.name), &vSendObjectHandle), p != nullptr)
-                    {
-                        p = strchr((char*)vPtpBuffer, ':') + 1;
-                        i++;
-                        if (strncmp(info.name, p, strlen(p)) == 0)
-                        {
-                            if (strncmp(info.name + strlen(p), "\n", 2) == 0)
-                            {
-                                break;
-                            }
-                        }
-                    }
-                    if (p == nullptr)
-                    {
-                        i++;
-                        p = strchr((char*)vPtpBuffer, ':') + 1;
-                        vfs_puts(p, &vSendObjectHandle);
-                        vfs_puts("\n", &vSendObjectHandle);
-                    }
-                    vSendObjectId = (i << INODE_ITEM_BITS) | (vCurrentParent & INODE_STORAGE_MASK);
-                    vfs_file_close(&vSendObjectHandle);
-                    vResponseCode = OK;
+                    ctx->t.responseCode = OK;
                 }
             }
             else
             {
-                MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), (char*)vPtpBuffer);
+                MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), (char*)ctx->buffer);
             }
 		#else
-            vResponseCode = PtpErr_AccessDenied;
+            ctx->t.responseCode = PtpErr_AccessDenied;
 		#endif
         }
-        else if (vFileSize >= vfs_fs_free((char*)vPtpBuffer))
+        else if (ctx->t.op.info.size >= vfs_fs_free((char*)ctx->buffer))
         {
-            vResponseCode = PtpErr_ObjectTooLarge;
+            ctx->t.responseCode = PtpErr_ObjectTooLarge;
         }
 
-        if (vResponseCode == 0) // Not yet assigned
+        if (ctx->t.responseCode == 0) // Not yet assigned
         {
             // Create File
-            vResponseCode = PtpErr_GeneralError;
-            if (vfs_file_open(&vSendObjectHandle, (char*)vPtpBuffer, VFS_RDWR | VFS_TRUNC) == 0)
+            ctx->t.responseCode = PtpErr_GeneralError;
+            if (vfs_file_open(&ctx->file, (char*)ctx->buffer, VFS_RDWR | VFS_TRUNC) == 0)
             {
-                vfs_file_sync(&vSendObjectHandle);
+                vfs_file_sync(&ctx->file);
                 // Generate handle
-                vSendObjectId = HandleFilenameBits(strrchr((char*)vPtpBuffer, '/') + 1) | vCurrentParent;
-                vResponseCode = OK;
+                ctx->sendId = HandleFilenameBits(strrchr((char*)ctx->buffer, '/') + 1) | (ctx->sendParent & (INODE_STORAGE_MASK | INODE_FOLDER_MASK));
+                ctx->sendId = RenameAliasHandle(ctx->sendParent & (INODE_STORAGE_MASK | INODE_FOLDER_MASK), strrchr((char*)ctx->buffer, '/') + 1, ctx->sendId);
+                HandleIndexRemove(ctx->sendId);
+                LookupCacheClear();
+                ctx->t.responseCode = OK;
             }
         }
 
-        if (vResponseCode == OK) // Result from successful vfs_file_open or vfs_mkdir
+        if (ctx->t.responseCode == OK) // Result from successful vfs_file_open or vfs_mkdir
         {
-            if (vfs_stat((char*)vPtpBuffer, &info) == 0)
+            if (vfs_stat((char*)ctx->buffer, &info) == 0)
             {
                 // Apply timestamp
-                info.created = vCreated;
-                info.modified = vModified;
-                vfs_touch((char*)vPtpBuffer, &info);
-                MTP_DBG_LVL2("%s[%u] assigned handle %lX to %s", __FUNCTION__, __LINE__, vSendObjectId, (char*)vPtpBuffer);
+                info.created = ctx->t.op.info.created;
+                info.modified = ctx->t.op.info.modified;
+                vfs_touch((char*)ctx->buffer, &info);
+                MTP_DBG_LVL2("%s[%u] assigned handle %lX to %s", __FUNCTION__, __LINE__, ctx->sendId, (char*)ctx->buffer);
             }
 
-            vResponseParam[2] = vSendObjectId;
-            vResponseParam[1] = UINT32_MAX;
-            if ((vSendObjectParent & INODE_FOLDER_MASK) != INODE_FOLDER_MASK)
+            ctx->t.responseParam[2] = ctx->sendId;
+            ctx->t.responseParam[1] = UINT32_MAX;
+            if ((ctx->sendParent & INODE_FOLDER_MASK) != INODE_FOLDER_MASK)
             {
-                vResponseParam[1] = vSendObjectParent;
+                ctx->t.responseParam[1] = ctx->sendParent;
             }
-            vResponseParam[0] = STORAGE_ID(INODE_STORAGE(vSendObjectId));
-            vResponseParamCount = 3;
+            ctx->t.responseParam[0] = STORAGE_ID(INODE_STORAGE(ctx->sendId));
+            ctx->t.responseParamCount = 3;
         }
 
-        MTP_DBG_LVL0("%s[%u] %lX %s rsp 0x%x", __FUNCTION__, __LINE__, vSendObjectId, (char*)vPtpBuffer, vResponseCode);
-        return(PtpResponse(id, nullptr, vResponseCode));
+        MTP_DBG_LVL0("%s[%u] %lX %s rsp 0x%x", __FUNCTION__, __LINE__, (unsigned long)ctx->sendId, (char*)ctx->buffer, ctx->t.responseCode);
+        return(PtpResponse(ctx, id, nullptr, ctx->t.responseCode));
     }
     return(0);
 }
@@ -2053,11 +4486,11 @@ PtpSendObjectInfoData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen
 
 #if (MTP_READONLY != 1)
 static uint32_t
-PtpSendObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpSendObject(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     if (reqlen == 0)
     {
-        PtpSendObjectData(0, nullptr, 0, 0); // init
+        PtpSendObjectData(ctx, 0, nullptr, 0, 0); // init
         MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
     }
     return(0);
@@ -2067,70 +4500,69 @@ PtpSendObject(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
 #if (MTP_READONLY != 1)
 static uint32_t
-PtpSendObjectData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpSendObjectData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t vExpectLen = 0;
-    static uint32_t vReceivedLen = 0;
-
     int err;
 
-    if (vSendObjectHandle.filesys == nullptr)
+    if (ctx->file.filesys == nullptr)
     {
-        return(PtpResponse(id, nullptr, PtpErr_NoValidObjectInfo));
+        return(PtpResponse(ctx, id, nullptr, PtpErr_NoValidObjectInfo));
     }
 
     if (buf == nullptr)
     {
-        vExpectLen = 0;
+        ctx->t.op.object.expect = 0;
         return(0);
     }
-    if (vExpectLen == 0)
+    if (ctx->t.op.object.expect == 0)
     {
-        vExpectLen = GetUint32(&buf[0]) - 12;
-        vReceivedLen = 0;
+        ctx->t.op.object.expect = GetUint32(&buf[0]) - 12;
+        ctx->t.op.object.received = 0;
         buf += 12;
         reqlen -= 12;
-        MTP_DBG_LVL1("%s[%u] %lu", __FUNCTION__, __LINE__, vExpectLen + 12);
+        MTP_DBG_LVL1("%s[%u] %lu", __FUNCTION__, __LINE__, ctx->t.op.object.expect + 12);
     }
 
-    if (vSendObjectId != 0)
+    if (ctx->sendId != 0)
     {
-        if (err = vfs_file_write(&vSendObjectHandle, buf, reqlen), err < 0)
+        if (err = vfs_file_write(&ctx->file, buf, reqlen), err < 0)
         {
             MTP_DBG_LVL0("%s[%u] vfs_file_write error %s", __FUNCTION__, __LINE__, strerror(-err));
-            return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
         }
     }
-    vReceivedLen += reqlen;
-    MTP_DBG_LVL3("%s[%u] got %lu bytes of %lu", __FUNCTION__, __LINE__, vReceivedLen, vExpectLen);
-    if (vReceivedLen >= vExpectLen)
+    ctx->t.op.object.received += reqlen;
+    MTP_DBG_LVL3("%s[%u] got %lu bytes of %lu", __FUNCTION__, __LINE__, ctx->t.op.object.received, ctx->t.op.object.expect);
+    if (ctx->t.op.object.received >= ctx->t.op.object.expect)
     {
-        if (vSendObjectId == 0) // Created folder
+        if (ctx->sendId == 0) // Created folder
         {
-            vResponseCode = OK;
+            ctx->t.responseCode = OK;
         }
         else
         {
-            if (err = vfs_file_close(&vSendObjectHandle), err < 0)
+            if (err = vfs_file_close(&ctx->file), err < 0)
             {
                 MTP_DBG_LVL0("%s[%u] vfs_file_close error %s", __FUNCTION__, __LINE__, strerror(-err));
-                vResponseCode = PtpErr_GeneralError;
+                ctx->t.responseCode = PtpErr_GeneralError;
             }
             else
             {
-                MTP_DBG_LVL1("%s[%u] saved %luB", __FUNCTION__, __LINE__, vReceivedLen);
-                vResponseCode = OK;
+                MTP_DBG_LVL1("%s[%u] saved %luB", __FUNCTION__, __LINE__, ctx->t.op.object.received);
+                ctx->t.responseCode = OK;
+                HandleIndexRemove(ctx->sendId);   // Size changed
+                LookupCacheClear();
 
         #ifdef MTP_SEND_OBJECT_HOOK
                 // Rebuild the name of the file that we just received
                 char* path = nullptr;
 
-                GetFileById(nullptr, vSendObjectId, false, &path);
-                MTP_SEND_OBJECT_HOOK(&vSendObjectHandle, path);
+                GetFileById(nullptr, ctx->sendId, false, &path);
+                MTP_SEND_OBJECT_HOOK(&ctx->file, path);
         #endif
             }
         }
-        return(PtpResponse(id, nullptr, vResponseCode));
+        return(PtpResponse(ctx, id, nullptr, ctx->t.responseCode));
     }
     return(0);
 }
@@ -2138,509 +4570,511 @@ PtpSendObjectData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
 
 static uint32_t
-PtpFormatStore(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpFormatStore(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
     char* drive;
     int ret;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);   // Storage ID
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);   // Storage ID
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
 
-        if (drive = vfs_volume(DRIVE_NUM(vParam[0])), drive == nullptr)
+        if (drive = vfs_volume(DRIVE_NUM(ctx->t.param[0])), drive == nullptr)
         {
-            return(PtpResponse(id, nullptr, PtpErr_InvalidStorageId));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidStorageId));
         }
 
         // format drive
+        HandleIndexClear();
+        RenameAliasClear();
+        LookupCacheClear();
         ret = -vfs_format(drive);
         MTP_DBG_LVL0("%s[%u] %s, result=%u", __FUNCTION__, __LINE__, drive, ret);
+    #if VFS_NODIRS != 1
+        // The folder index went with the rest of the volume
+        FolderIndexReset(DRIVE_NUM(ctx->t.param[0]));
+    #endif
         if (ret != 0)
         {
-            return(PtpResponse(id, nullptr, PtpErr_GeneralError));
+            return(PtpResponse(ctx, id, nullptr, PtpErr_GeneralError));
         }
     }
-    return(PtpResponse(id, nullptr, OK));
+    return(PtpResponse(ctx, id, nullptr, OK));
 }
 
 
 static uint32_t
-MtpGetObjectPropsSupported(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+MtpGetObjectPropsSupported(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-
+    uint32_t len;
     uint32_t i;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1); // ?
-        len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1); // ?
+        MTP_DBG_LVL1("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
+    }
+    // The same properties are supported for every object format
+    if (DatasetCopy(ctx, MtpGetObjectPropsSupported, 0x9801, 0, id, buf, index, reqlen, &len))
+    {
+        return(len);
+    }
+    len = PtpCursorResume(ctx, &index);
+
+    switch (ctx->t.cursor.step)
+    {
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
+            len += Uint16(&buf, &index, &reqlen, 2);    // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x9801);    // Code
+            len += Uint32(&buf, &index, &reqlen, id);    // TransactionID
+
+            len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpObjectPropsSupported) / sizeof(vMtpObjectPropsSupported[0])) - 1);
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            for (i = ctx->t.cursor.item; vMtpObjectPropsSupported[i].prop != 0; i++)
+            {
+                PTP_CURSOR_MARK(1, i, len);
+                len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
+            }
+    }
+    return(len);
+}
+
+
+static uint32_t
+MtpGetObjectPropDesc(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+{
+    uint32_t len;
+    int32_t i;
+
+    if (reqlen == 0)
+    {
+        ParamParse(ctx, buf, 2);   // Property, ObjectType
+        MTP_DBG_LVL1("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1]);
     }
+    // Only supported properties get a dataset, whatever the object format
+    if ((ObjectPropFind(ctx->t.param[0]) >= 0) && DatasetCopy(ctx, MtpGetObjectPropDesc, 0x9802, ctx->t.param[0], id, buf, index, reqlen, &len))
+    {
+        return(len);
+    }
+    len = PtpCursorResume(ctx, &index);
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);    // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x9801);    // Code
-    len += Uint32(&buf, &index, &reqlen, id);    // TransactionID
+    len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
+    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
+    len += Uint16(&buf, &index, &reqlen, 0x9802);  // Code
+    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
-    len += Uint32(&buf, &index, &reqlen, (sizeof(vMtpObjectPropsSupported) / sizeof(vMtpObjectPropsSupported[0])) - 1);
-    for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
+    if (i = ObjectPropFind(ctx->t.param[0]), (i >= 0) && (vMtpObjectPropsSupported[i].proc != nullptr))
     {
         len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
+        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
+    #if (MTP_READONLY != 1)
+        len += Uint8(&buf, &index, &reqlen, (ctx->t.param[0] == 0xDC07) ? 1 : 0);   // Get/Set for the file name, Get for the rest
+    #else
+        len += Uint8(&buf, &index, &reqlen, 0);   // Get (read-only)
+    #endif
+        len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, 0, nullptr);   // Default Value
+        len += Uint32(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].group);   // Group Code
+        len += Uint8(&buf, &index, &reqlen, FORM_NONE);   // Form Flag
     }
     return(len);
 }
 
 
 static uint32_t
-MtpGetObjectPropDesc(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+MtpGetObjectPropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-    uint32_t i;
+    VfsInfo_t* info;
+    uint32_t len;
+    int32_t i;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 2);   // Property, ObjectType
-        len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, vParam[0], vParam[1]);
+        ParamParse(ctx, buf, 2);   // ObjectHandle, Property
+        MTP_DBG_LVL2("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1]);
+    }
+    if (!GetFileById(&info, ctx->t.param[0], false, nullptr))
+    {
+        return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidObjectHandle));
+    }
+    if (i = ObjectPropFind(ctx->t.param[1]), (i < 0) || (vMtpObjectPropsSupported[i].proc == nullptr))
+    {
+        return(PtpResponse(ctx, id, nullptr, PtpErr_ObjectPropNotSupported));
     }
+    len = PtpCursorResume(ctx, &index);
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
+    len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
     len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x9802);  // Code
+    len += Uint16(&buf, &index, &reqlen, 0x9803);  // Code
     len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
-    for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
+    // The dataset is the bare value, unlike an element of an ObjectPropList
+    len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, ctx->t.param[0], info);
+    return(len);
+}
+
+
+#if (MTP_READONLY != 1)
+#define SETPROP_DATAOFFSET      12      // Start of the property value in the data block
+
+/* Give an object a new name in its folder. A folder keeps its handle through
+ * the folder index, a file keeps the handle it had for the rest of the session
+ * through the handle index */
+static uint16_t
+MtpRenameObject(uint32_t handle, const char* name)
+{
+    char newpath[MAX_PATH + 1];
+    VfsInfo_t* info;
+    char* newname;
+    char* path;
+    char* p;
+    bool folder;
+    int err;
+
+    if ((name[0] == '\0') || (strchr(name, '/') != nullptr) || (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
+    {
+        return(PtpErr_InvalidObjectPropValue);
+    }
+    if (!GetFileById(&info, handle, false, &path) || (p = strrchr(path, '/'), p == nullptr) || (p[1] == '\0'))
+    {
+        return(PtpErr_InvalidObjectHandle);
+    }
+    if ((size_t)(p + 1 - path) + strlen(name) > MAX_PATH)
+    {
+        return(PtpErr_InvalidObjectPropValue);
+    }
+    memcpy(newpath, path, p + 1 - path);
+    newname = &newpath[p + 1 - path];
+    strcpy(newname, name);
+    folder = (info->attrib & ATR_DIR) != 0;
+
+    err = -vfs_rename(path, newpath);
+    MTP_DBG_LVL0("%s[%u] %s %s -> %s", __FUNCTION__, __LINE__, strerror(err), path, name);
+    switch (err)
+    {
+        case 0:
+            break;
+
+        case EROFS:
+            return(PtpErr_ObjectWriteProtected);
+
+        case EEXIST:
+        case EACCES:
+            return(PtpErr_AccessDenied);
+
+        default:
+            return(PtpErr_GeneralError);
+    }
+
+    if (folder)
+    {
+    #if VFS_NODIRS != 1
+        FolderIndexRename(handle, name);
+    #endif
+    }
+    else
     {
-        if ((vMtpObjectPropsSupported[i].prop == vParam[0]) && (vMtpObjectPropsSupported[i].proc != nullptr))
+        // The new name gives another handle, the host keeps using the old one
+        HandleIndexRemove(handle);
+        RenameAliasRemove(handle);
+        if (((HandleFilenameBits(newname) | (handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK))) != handle) && !RenameAliasAdd(handle, newname, p + 1))
         {
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
-            len += Uint8(&buf, &index, &reqlen, 0);   // Get (read-only)
-            len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, 0, nullptr);   // Default Value
-            len += Uint32(&buf, &index, &reqlen, 0);   // Group Code
-            len += Uint8(&buf, &index, &reqlen, FORM_NONE);   // Form Flag
-            break;
+        #ifdef MTP_EVENTS
+            PtpEvent(PTP_EVENT_OBJECT_REMOVED, handle);
+            PtpEvent(PTP_EVENT_OBJECT_ADDED, HandleFilenameBits(newname) | (handle & (INODE_STORAGE_MASK | INODE_FOLDER_MASK)));
+        #endif
         }
     }
-    return(len);
+    GetFileById(nullptr, 0, false, nullptr);   // Drop the cached lookup of the old name, 'p' points into it
+    return(OK);
 }
 
 
 static uint32_t
-MtpGetObjectPropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+MtpSetObjectPropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-    uint32_t i;
+    VfsInfo_t* info;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 2);   // ObjectHandle, Property
-        len = 0;
-        MTP_DBG_LVL2("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, vParam[0], vParam[1]);
-    }
-
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x9803);  // Code
-    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
+        ParamParse(ctx, buf, 2);   // ObjectHandle, Property
+        MTP_DBG_LVL1("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1]);
 
-    for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
-    {
-        if ((vMtpObjectPropsSupported[i].prop == vParam[1]) && (vMtpObjectPropsSupported[i].proc != nullptr))
+        // The host sends the data phase anyway, the response follows after it
+        ctx->t.op.prop.response = OK;
+        if (ctx->t.param[1] != 0xDC07)	// Only ObjectFileName can be changed
         {
-            len += Uint32(&buf, &index, &reqlen, vParam[0]);  // Handle
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
-            len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, vParam[0], nullptr);
-            break;
+            ctx->t.op.prop.response = PtpErr_AccessDenied;
+        }
+        else if (!GetFileById(&info, ctx->t.param[0], false, nullptr))
+        {
+            ctx->t.op.prop.response = PtpErr_InvalidObjectHandle;
         }
     }
-    return(len);
+    return(0);
 }
 
 
-#if (MTP_READONLY != 1)
 static uint32_t
-MtpSetObjectPropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+MtpSetObjectPropValueData(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    if (reqlen == 0)
-    {
-        MtpSetObjectPropValueData(0, nullptr, 0, 0); // init
-        MTP_DBG_LVL1("%s[%u]", __FUNCTION__, __LINE__);
-    }
-    return(0);
-
-    static uint32_t len = 0;
     uint32_t i;
+    uint32_t n;
 
-    if (reqlen == 0)
+    if (index == 0)
     {
-        ParamParse(buf, 2);   // ObjectHandle, Property
-        len = 0;
-        MTP_DBG_LVL2("%s[%u] %lX,%lX", __FUNCTION__, __LINE__, vParam[0], vParam[1]);
+        ctx->t.op.prop.expect = GetUint32(&buf[0]);
+        ctx->t.op.prop.nameLen = 0;
+        Utf16StreamStart(&ctx->t.op.prop.stream, ctx->t.op.prop.name, sizeof(ctx->t.op.prop.name));
     }
 
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x9804);  // Code
-    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
+    for (i = 0; i < reqlen; i++)
+    {
+        if ((index + i) == SETPROP_DATAOFFSET)
+        {
+            ctx->t.op.prop.nameLen = buf[i] << 1;
+        }
+        else if (((index + i) > SETPROP_DATAOFFSET) && ((index + i) <= (SETPROP_DATAOFFSET + ctx->t.op.prop.nameLen)))
+        {
+            // Convert the part of the name in this packet at once
+            if (n = SETPROP_DATAOFFSET + ctx->t.op.prop.nameLen + 1 - (index + i), n > reqlen - i)
+            {
+                n = reqlen - i;
+            }
+            Utf16StreamPut(&ctx->t.op.prop.stream, &buf[i], n);
+            i += n - 1;
+        }
+    }
 
-    if (vParam[1] == 0xDC07)	// ObjectFileName
+    if (index + reqlen < ctx->t.op.prop.expect)
     {
-        len += Uint32(&buf, &index, &reqlen, vParam[0]);  // Handle
-        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
-        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
- //       len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, vParam[0], nullptr);
+        return(0);
     }
-    else
+    if (ctx->t.op.prop.response == OK)
     {
-        return(PtpResponse(id, nullptr, PtpErr_AccessDenied));
+        ctx->t.op.prop.response = MtpRenameObject(ctx->t.param[0], ctx->t.op.prop.name);
     }
-    return(len);
+    return(PtpResponse(ctx, id, nullptr, ctx->t.op.prop.response));
 }
 #endif
 
 
-#if (MTP_READONLY != 1)
-static uint32_t
-MtpSetObjectPropValueData(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+/* Whether GetObjectPropList returns property p: selected by its code, by its
+ * group when the code is 0, or all of them for 0xFFFFFFFF */
+static bool
+PropListSelected(PtpContext_t* ctx, uint32_t p)
 {
-    static uint32_t vExpectLen = 0;
-    static uint32_t vReceivedLen = 0;
-    static uint32_t vFileSize = 0;
-    static uint16_t vFormat = 0;
-    static uint16_t vNameLen = 0, vCreatedLen = 0, vModifiedLen = 0, vVarIdx = 0;
-    static uint8_t vTimeStr[24];
-    static time_t  vCreated;
-    static time_t  vModified;
+    if (vMtpObjectPropsSupported[p].proc == nullptr)
+    {
+        return(false);
+    }
+    if (ctx->t.param[2] == 0)
+    {
+        return(vMtpObjectPropsSupported[p].group == ctx->t.param[3]);
+    }
+    return((vMtpObjectPropsSupported[p].prop == ctx->t.param[2]) || (ctx->t.param[2] == UINT32_MAX));
+}
 
-    VfsInfo_t info;
-    uint32_t i;
-    char* p;
 
-    if (buf == nullptr)
+/* Walk the objects listed by GetObjectPropList with depth 1: the children of
+ * a folder, or the root folders of all storages for handle 0 and 0xFFFFFFFF */
+static bool
+PropListStart(PtpContext_t* ctx, uint32_t handle)
+{
+    if ((handle == 0) || (handle == UINT32_MAX))
     {
-        vExpectLen = 0;
-        return(0);
+        WalkStart(ctx, INODE_FOLDER_MASK, true, false, ctx->t.param[1], false);
+        return(true);
     }
-
-    if (vExpectLen == 0)
+    if (!GetFileById(nullptr, handle, true, nullptr))
     {
-        vExpectLen = GetUint32(&buf[0]);
-        vReceivedLen = 0;
-        MTP_DBG_LVL1("%s[%u] %lu", __FUNCTION__, __LINE__, vExpectLen);
-        memset(vPtpBuffer, 0, sizeof(vPtpBuffer));  // Needed because of or'ing of filename later on
-
-        if (GetFileById(nullptr, vSendObjectParent, false, &p))
-        {
-            strcat((char*)vPtpBuffer, p);
-            if (p = strrchr((char*)vPtpBuffer, '/'), (p != nullptr) && (p[1] != '\0'))
-            {
-                strcat((char*)vPtpBuffer, "/");
-            }
-        }
-        vCreated = 0;
-        vModified = 0;
+        return(false);
     }
+    // A file has no children
+    WalkStart(ctx, ((handle & INODE_ITEM_MASK) == 0) ? handle : 0, false, false, ctx->t.param[1], false);
+    return(true);
+}
 
-    for (i = 0; i < reqlen; i++)
-    {
-        switch (vReceivedLen + i)
-        {
-            case OBJECTINFO_FORMATOFFSET + 0: vFormat = buf[i]; break;
-            case OBJECTINFO_FORMATOFFSET + 1: vFormat |= buf[i] << 8; break;
 
-            case OBJECTINFO_FILESIZEOFFSET + 0: vFileSize = buf[i]; break;
-            case OBJECTINFO_FILESIZEOFFSET + 1: vFileSize |= buf[i] << 8; break;
-            case OBJECTINFO_FILESIZEOFFSET + 2: vFileSize |= buf[i] << 16; break;
-            case OBJECTINFO_FILESIZEOFFSET + 3: vFileSize |= buf[i] << 24; break;
+static uint32_t
+MtpGetObjectPropList(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+{
+    uint32_t len;
+    VfsInfo_t* info = nullptr;
+    uint32_t count = 0;
+    uint32_t i, p;
+    bool measure = (reqlen == 0);   // reqlen counts down while a data packet is filled
+    bool match = true;
+
+    if (reqlen == 0)
+    {
+        ParamParse(ctx, buf, 5);    // ObjectHandle, [ObjectFormatCode], ObjectPropCode, [ObjectPropGroupCode], [Depth]
+        MTP_DBG_LVL2("%s[%u] %lX,%lX,%lX,%lX,%lu", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1], ctx->t.param[2], ctx->t.param[3], ctx->t.param[4]);
 
-            case OBJECTINFO_FILENAMEOFFSET: vNameLen = buf[i] << 1; vVarIdx = 0; break;
-        }
-        if ((vReceivedLen + i) > OBJECTINFO_FILENAMEOFFSET)
+        if (ctx->t.param[2] == 0)
         {
-            if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen))
-            {
-                if (p = strrchr((char*)vPtpBuffer, '/'), p != nullptr)
-                {
-                    p[1 + (vVarIdx++ >> 1)] |= buf[i];
-                }
-                else
-                {
-                    return(PtpResponse(id, nullptr, PtpErr_GeneralError));
-                }
-            }
-            else if ((vReceivedLen + i) == (OBJECTINFO_FILENAMEOFFSET + vNameLen + 1))
-            {
-                vCreatedLen = buf[i] << 1;
-                vVarIdx = 0;
-                memset(vTimeStr, 0, sizeof(vTimeStr));
-            }
-            else if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + 1))
+            // The group code selects the properties
+            for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
             {
-                vTimeStr[vVarIdx++ >> 1] |= buf[i];
-                if (vVarIdx == vCreatedLen)
+                if (PropListSelected(ctx, i))
                 {
-                    vCreated = PtpParseDateString(vTimeStr);
+                    break;
                 }
             }
-            else if ((vReceivedLen + i) == (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + 2))
-            {
-                vModifiedLen = buf[i] << 1;
-                vVarIdx = 0;
-                memset(vTimeStr, 0, sizeof(vTimeStr));
-            }
-            else if ((vReceivedLen + i) <= (OBJECTINFO_FILENAMEOFFSET + vNameLen + vCreatedLen + vModifiedLen + 2))
+            if (vMtpObjectPropsSupported[i].prop == 0)
             {
-                vTimeStr[vVarIdx++ >> 1] |= buf[i];
-                if (vVarIdx == vModifiedLen)
-                {
-                    vModified = PtpParseDateString(vTimeStr);
-                }
+                return(PtpResponse(ctx, id, nullptr, PtpErr_GroupNotSupported));
             }
         }
+        if (ctx->t.param[4] > 1)
+        {
+            return(PtpResponse(ctx, id, nullptr, PtpErr_SpecificationByDepthUnsupported));
+        }
     }
 
-    vReceivedLen += reqlen;
-    if (vReceivedLen >= vExpectLen)
+    if (ctx->t.param[4] == 0)
     {
-        uint32_t fr = 0;
-
-        vResponseCode = 0;
-        MTP_DBG_LVL2("%s[%u] %s %luB", __FUNCTION__, __LINE__, (char*)vPtpBuffer, vFileSize);
-
-        if (vfs_fs_size((char*)vPtpBuffer) < 0)
+        if ((ctx->t.param[0] != 0) && (ctx->t.param[0] != UINT32_MAX))
         {
-            vResponseCode = PtpErr_StoreNotAvailable;
+            if (!GetFileById(&info, ctx->t.param[0], false, nullptr))
+            {
+                return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidObjectHandle));
+            }
         }
-        else if (vfs_stat((char*)vPtpBuffer, &info) == 0)
+        match = (ctx->t.param[1] == 0) || (ObjectFormat(ctx->t.param[0], info) == ctx->t.param[1]);
+    }
+    else if (reqlen == 0)
+    {
+        // Children of the object, or the roots of all storages for handle 0 and 0xFFFFFFFF
+        if (!PropListStart(ctx, ctx->t.param[0]))
         {
-            if (!(info.attrib & ATR_IWRITE))
+            return(PtpResponse(ctx, id, nullptr, PtpErr_InvalidObjectHandle));
+        }
+        ctx->t.op.list.quadruples = 0;
+    }
+    len = PtpCursorResume(ctx, &index);
+
+    switch (ctx->t.cursor.step)
+    {
+        case 0:
+            len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
+            len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
+            len += Uint16(&buf, &index, &reqlen, 0x9805);  // Code
+            len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
+
+            if (ctx->t.param[4] == 0)
             {
-                vResponseCode = PtpErr_ObjectWriteProtected;
+                for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
+                {
+                    if (match && PropListSelected(ctx, i))
+                    {
+                        count++;
+                    }
+                }
             }
-            else if (info.attrib & (ATR_HID | ATR_SYS | ATR_DIR))
+            else
             {
-                vResponseCode = PtpErr_AccessDenied;
+                count = ctx->t.op.list.quadruples;
             }
-            else if (info.size > vFileSize)
+            len += Uint32(&buf, &index, &reqlen, count);  // Number of quadruples
+            PTP_CURSOR_MARK(1, 0, len);
+            // fall through
+
+        case 1:
+            if (ctx->t.param[4] == 0)
             {
-                if (vfs_file_open(&vSendObjectHandle, (char*)vPtpBuffer, VFS_WRONLY | VFS_TRUNC) == 0)
+                for (i = ctx->t.cursor.item; vMtpObjectPropsSupported[i].prop != 0; i++)
                 {
-                    if (vfs_file_seek(&vSendObjectHandle, vFileSize, SEEK_SET) != 0)
+                    if (match && PropListSelected(ctx, i))
                     {
-                        vResponseCode = PtpErr_ObjectTooLarge;
+                        PTP_CURSOR_MARK(1, i, len);
+                        len += Uint32(&buf, &index, &reqlen, ctx->t.param[0]);  // Handle
+                        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
+                        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
+                        len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, ctx->t.param[0], info);
                     }
-
-                    vfs_file_close(&vSendObjectHandle);
-                }
-                else
-                {
-                    vResponseCode = PtpErr_GeneralError;
                 }
+                break;
             }
-            else if (vFileSize >= vfs_fs_free((char*)vPtpBuffer) - info.size)
-            {
-                vResponseCode = PtpErr_ObjectTooLarge;
-            }
-        }
-#if VFS_NODIRS != 1
-        else if (vFormat == FORMAT_ASSOCIATION)
-        {
-            int err;
+            PTP_CURSOR_MARK(2, 0, len);
+            // fall through
 
-            vResponseCode = PtpErr_GeneralError;
-            if (err = vfs_mkdir((char*)vPtpBuffer), err == 0)
+        case 2:
+            // Depth 1, the resume point is object i and property p
+            for (i = ctx->t.cursor.item >> 8, p = ctx->t.cursor.item & 0xFF; measure || (i < ctx->t.op.list.objects); i++, p = 0)
             {
-                char tmp[13];
-
-                // Add folder entry to cache file
-                siprintf(tmp, "%s%s", vfs_volume(DRIVE_NUM(vParam[0])), MTP_FOLDER_CACHE_FILE);
-                if (err = vfs_file_open(&vSendObjectHandle, tmp, VFS_RDWR | VFS_CREAT), err != 0)
+                PTP_CURSOR_MARK(2, (i << 8) | p, len);
+                // Object i may already have been read for the tail of the previous packet
+                if ((i >= ctx->t.walk.count) && !WalkNext(ctx))
                 {
-                    MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), tmp);
+                    break;
                 }
-                else
+                for (; vMtpObjectPropsSupported[p].prop != 0; p++)
                 {
-                    i = 0;
-                    while (p = vfs_gets(info.name, sizeof(info.name), &vSendObjectHandle), p != nullptr)
+                    if (PropListSelected(ctx, p))
                     {
-                        p = strchr((char*)vPtpBuffer, ':') + 1;
-                        i++;
-                        if (strncmp(info.name, p, strlen(p)) == 0)
+                        PTP_CURSOR_MARK(2, (i << 8) | p, len);
+                        len += Uint32(&buf, &index, &reqlen, ctx->t.dir.handle);  // Handle
+                        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[p].prop);
+                        len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[p].type);
+                        len += (vMtpObjectPropsSupported[p].proc)(&buf, &index, &reqlen, ctx->t.dir.handle, &ctx->t.dir.info);
+                        if (measure)
                         {
-                            if (strncmp(info.name + strlen(p), "\n", 2) == 0)
-                            {
-                                break;
-                            }
+                            ctx->t.op.list.quadruples++;
                         }
                     }
-                    if (p == nullptr)
-                    {
-                        i++;
-                        p = strchr((char*)vPtpBuffer, ':') + 1;
-                        vfs_puts(p, &vSendObjectHandle);
-                        vfs_puts("\n", &vSendObjectHandle);
-                    }
-                    vSendObjectId = (i << INODE_ITEM_BITS) | (vCurrentParent & INODE_STORAGE_MASK);
-                    vfs_file_close(&vSendObjectHandle);
-                    vResponseCode = OK;
                 }
             }
-            else
-            {
-                MTP_DBG_LVL0("%s[%u] %s (%s)...", __FUNCTION__, __LINE__, strerror(-err), (char*)vPtpBuffer);
-            }
-        }
-#endif
-        else if (vFileSize >= vfs_fs_free((char*)vPtpBuffer))
-        {
-            vResponseCode = PtpErr_ObjectTooLarge;
-        }
-
-        if (vResponseCode == 0) // Not yet assigned
-        {
-            // Create File
-            vResponseCode = PtpErr_GeneralError;
-            if (vfs_file_open(&vSendObjectHandle, (char*)vPtpBuffer, VFS_RDWR | VFS_TRUNC) == 0)
-            {
-                vfs_file_sync(&vSendObjectHandle);
-                // Generate handle
-                vSendObjectId = HandleFilenameBits(strrchr((char*)vPtpBuffer, '/') + 1) | vCurrentParent;
-                vResponseCode = OK;
-            }
-        }
-
-        if (vResponseCode == OK) // Result from successful vfs_file_open or vfs_mkdir
-        {
-            if (vfs_stat((char*)vPtpBuffer, &info) == 0)
+            if (measure)
             {
-                // Apply timestamp
-                info.created = vCreated;
-                info.modified = vModified;
-                vfs_touch((char*)vPtpBuffer, &info);
-                MTP_DBG_LVL2("%s[%u] assigned handle %lX to %s", __FUNCTION__, __LINE__, vSendObjectId, (char*)vPtpBuffer);
+                // The data packets list the objects again, open the cursor for them
+                ctx->t.op.list.objects = i;
+                WalkRewind(ctx, false);
             }
-
-            vResponseParam[2] = vSendObjectId;
-            vResponseParam[1] = UINT32_MAX;
-            if ((vSendObjectParent & INODE_FOLDER_MASK) != INODE_FOLDER_MASK)
+            else
             {
-                vResponseParam[1] = vSendObjectParent;
+                DirCursorClose(&ctx->t.dir);
             }
-            vResponseParam[0] = STORAGE_ID(INODE_STORAGE(vSendObjectId));
-            vResponseParamCount = 3;
-        }
-
-        MTP_DBG_LVL0("%s[%u] %lX %s rsp 0x%x", __FUNCTION__, __LINE__, vSendObjectId, (char*)vPtpBuffer, vResponseCode);
-        return(PtpResponse(id, nullptr, vResponseCode));
-    }
-    return(0);
-}
-#endif
-
-
-static uint32_t
-MtpGetObjectPropList(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
-{
-    static uint32_t len = 0;
-
-    VfsInfo_t* info = nullptr;
-    uint32_t count = 0;
-    uint32_t i;
-
-    if (reqlen == 0)
-    {
-        ParamParse(buf, 5);    // ObjectHandle, [ObjectFormatCode], ObjectPropCode, [ObjectPropGroupCode], [Depth]
-        len = 0;
-        MTP_DBG_LVL2("%s[%u] %lX,%lX,%lX,%lX,%lu", __FUNCTION__, __LINE__, vParam[0], vParam[1], vParam[2], vParam[3], vParam[4]);
-
-        if (vParam[1] != 0)
-        {
-            return(PtpResponse(id, nullptr, PtpErr_SpecificationByFormatUnsupported));
-        }
-        if (vParam[3] != 0)
-        {
-            return(PtpResponse(id, nullptr, PtpErr_SpecificationByGroupUnsupported));
-        }
-        if (vParam[4] != 0)
-        {
-            return(PtpResponse(id, nullptr, PtpErr_SpecificationByDepthUnsupported));
-        }
-    }
-
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
-    len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
-    len += Uint16(&buf, &index, &reqlen, 0x9805);  // Code
-    len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
-
-    if ((vParam[0] != 0) && (vParam[0] != UINT32_MAX))
-    {
-        if (!GetFileById(&info, vParam[0], false, nullptr))
-        {
-            return(PtpResponse(id, nullptr, PtpErr_InvalidObjectHandle));
-        }
-    }
-
-    for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
-    {
-        if (((vMtpObjectPropsSupported[i].prop == vParam[2]) || (vParam[2] == UINT32_MAX)) && (vMtpObjectPropsSupported[i].proc != nullptr))
-        {
-            count++;
-        }
-    }
-    len += Uint32(&buf, &index, &reqlen, count);  // Number of quadruples
-
-    for (i = 0; vMtpObjectPropsSupported[i].prop != 0; i++)
-    {
-        if (((vMtpObjectPropsSupported[i].prop == vParam[2]) || (vParam[2] == UINT32_MAX)) && (vMtpObjectPropsSupported[i].proc != nullptr))
-        {
-            len += Uint32(&buf, &index, &reqlen, vParam[0]);  // Handle
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].prop);
-            len += Uint16(&buf, &index, &reqlen, vMtpObjectPropsSupported[i].type);
-            len += (vMtpObjectPropsSupported[i].proc)(&buf, &index, &reqlen, vParam[0], info);
-        }
     }
     return(len);
 }
 
 
 static uint32_t
-PtpGetDevicePropDesc(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetDevicePropDesc(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
-    uint32_t i;
+    uint32_t len;
+    int32_t i;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 1);   // DevicePropCode
-        len = 0;
-        MTP_DBG_LVL2("%s[%u] %lX", __FUNCTION__, __LINE__, vParam[0]);
+        ParamParse(ctx, buf, 1);   // DevicePropCode
+        MTP_DBG_LVL2("%s[%u] %lX", __FUNCTION__, __LINE__, ctx->t.param[0]);
     }
-    len += Uint32(&buf, &index, &reqlen, len);  // Length
+    len = PtpCursorResume(ctx, &index);
+
+    len += Uint32(&buf, &index, &reqlen, ctx->t.length);  // Length
     len += Uint16(&buf, &index, &reqlen, 2);       // Container Type = Data Block
     len += Uint16(&buf, &index, &reqlen, 0x1014);  // Code
     len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
-    for (i = 0; vMtpDevicePropsSupported[i].prop != 0; i++)
+    if (i = DevicePropFind(ctx->t.param[0]), (i >= 0) && (vMtpDevicePropsSupported[i].proc != nullptr))
     {
-        if ((vMtpDevicePropsSupported[i].prop == vParam[0]) && (vMtpDevicePropsSupported[i].proc != nullptr))
+        len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].prop);
+        len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].type);
+        len += Uint8(&buf, &index, &reqlen, 0);   // Get (read-only)
+        len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_DEFAULT);   // Default Value
+        len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_VALUE);   // Current Value
+        len += Uint8(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].form);   // Form Flag
+        if (vMtpDevicePropsSupported[i].form == FORM_RANGE)
         {
-            len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].prop);
-            len += Uint16(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].type);
-            len += Uint8(&buf, &index, &reqlen, 0);   // Get (read-only)
-            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_DEFAULT);   // Default Value
-            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_VALUE);   // Current Value
-            len += Uint8(&buf, &index, &reqlen, vMtpDevicePropsSupported[i].form);   // Form Flag
-            if (vMtpDevicePropsSupported[i].form == FORM_RANGE)
-            {
-                len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_MIN);   // Minimum Value
-                len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_MAX);   // Maximum Value
-                len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_STEP);   // Step Value
-            }
-            break;
+            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_MIN);   // Minimum Value
+            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_MAX);   // Maximum Value
+            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_STEP);   // Step Value
         }
     }
     return(len);
@@ -2648,78 +5082,66 @@ PtpGetDevicePropDesc(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 
 
 static uint32_t
-PtpGetDevicePropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpGetDevicePropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
+    uint32_t len = 0;
 
-    uint32_t i;
+    int32_t i;
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 3);   // Property, unused, unused
+        ParamParse(ctx, buf, 3);   // Property, unused, unused
         len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX,%lu,%lu", __FUNCTION__, __LINE__, vParam[0], vParam[1], vParam[2]);
+        MTP_DBG_LVL1("%s[%u] %lX,%lu,%lu", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1], ctx->t.param[2]);
     }
 
-    for (i = 0; vMtpDevicePropsSupported[i].prop != 0; i++)
+    if (i = DevicePropFind(ctx->t.param[0]), (i >= 0) && (vMtpDevicePropsSupported[i].proc != nullptr))
     {
-        if ((vMtpDevicePropsSupported[i].prop == vParam[0]) && (vMtpDevicePropsSupported[i].proc != nullptr))
-        {
-            len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_VALUE);
-            break;
-        }
+        len += (vMtpDevicePropsSupported[i].proc)(&buf, &index, &reqlen, PROP_VALUE);
     }
-    return(PtpResponse(id, vPtpBuffer, OK));
+    return(PtpResponse(ctx, id, ctx->buffer, OK));
 }
 
 
 static uint32_t
-PtpSetDevicePropValue(uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
+PtpSetDevicePropValue(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint32_t index, uint32_t reqlen)
 {
-    static uint32_t len = 0;
+    uint32_t len = 0;
 
 #if 0
-    uint32_t i;
+    int32_t i;
 #endif
 
     if (reqlen == 0)
     {
-        ParamParse(buf, 3);   // Property, unused
+        ParamParse(ctx, buf, 3);   // Property, unused
         len = 0;
-        MTP_DBG_LVL1("%s[%u] %lX,%lu,%lu", __FUNCTION__, __LINE__, vParam[0], vParam[1], vParam[2]);
+        MTP_DBG_LVL1("%s[%u] %lX,%lu,%lu", __FUNCTION__, __LINE__, ctx->t.param[0], ctx->t.param[1], ctx->t.param[2]);
     }
 
 #if 1
-    return(PtpResponse(id, nullptr, PtpErr_AccessDenied));
+    return(PtpResponse(ctx, id, nullptr, PtpErr_AccessDenied));
 #else
-    for (i = 0; vMtpDevicePropsSupported[i].prop != 0; i++)
+    if (i = DevicePropFind(ctx->t.param[0]), i >= 0)// && (vMtpDevicePropsSupported[i].proc != nullptr))
     {
-        if ((vMtpDevicePropsSupported[i].prop == vParam[0]) )// && (vMtpDevicePropsSupported[i].proc != nullptr))
-        {
-            //len += vMtpDevicePropsSupported[i].proc(&buf, &index, &reqlen, PROP_TBD);
-            break;
-        }
+        //len += vMtpDevicePropsSupported[i].proc(&buf, &index, &reqlen, PROP_TBD);
     }
-    return(PtpResponse(id, vPtpBuffer, OK));
+    return(PtpResponse(ctx, id, ctx->buffer, OK));
 #endif
 }
 
-static volatile uint32_t vResponseLength = 0;
-static volatile uint32_t vResponseIndex = 0;
-
-
 static uint32_t
-PtpResponse(uint32_t id, uint8_t* buf, uint16_t resp)
+PtpResponse(PtpContext_t* ctx, uint32_t id, uint8_t* buf, uint16_t resp)
 {
     uint32_t index = 0;
-    uint32_t reqlen = 12 + vResponseParamCount * sizeof(uint32_t);
+    uint32_t reqlen = 12 + ctx->t.responseParamCount * sizeof(uint32_t);
     uint32_t len = 0;
     uint8_t i;
 
-    MTP_DBG_LVL3("%s[%u] id=%lu buf=%p resp=%X, code=%X, nparam=%u", __FUNCTION__, __LINE__, id, buf, resp, vResponseCode, vResponseParamCount);
+    MTP_DBG_LVL3("%s[%u] id=%lu buf=%p resp=%X, code=%X, nparam=%u", __FUNCTION__, __LINE__, id, buf, resp, ctx->t.responseCode, ctx->t.responseParamCount);
     if (resp == 0)   // Use the stored response code
     {
-        resp = vResponseCode;
+        resp = ctx->t.responseCode;
     }
     if (resp == 0)   // Still nothing, then assume OK
     {
@@ -2731,34 +5153,50 @@ PtpResponse(uint32_t id, uint8_t* buf, uint16_t resp)
     len += Uint16(&buf, &index, &reqlen, resp);    // Code
     len += Uint32(&buf, &index, &reqlen, id);      // TransactionID
 
-    for (i = 0; i < vResponseParamCount; i++)
+    for (i = 0; i < ctx->t.responseParamCount; i++)
     {
-        len += Uint32(&buf, &index, &reqlen, vResponseParam[i]);
+        len += Uint32(&buf, &index, &reqlen, ctx->t.responseParam[i]);
     }
 
-    vResponseIndex = UINT32_MAX;
+    ctx->t.index = UINT32_MAX;
     if (buf != nullptr)
     {
-        vResponseCode = 0;
-        vResponseParamCount = 0;
-        memset((uint8_t*)vResponseParam, 0, sizeof(vResponseParam));
+        ctx->t.responseCode = 0;
+        ctx->t.responseParamCount = 0;
+        memset((uint8_t*)ctx->t.responseParam, 0, sizeof(ctx->t.responseParam));
     }
     else
     {
-        vResponseCode = resp;
+        ctx->t.responseCode = resp;
     }
     return(len);
 }
 
 
-static volatile uint32_t vResponseId;
-static PtpProc_t pResponseProc;
+/* Drop the running transaction, closing the directory it may hold open */
+static void
+PtpTransactionClear(PtpContext_t* ctx)
+{
+    DirCursorClose(&ctx->t.dir);
+    memset(&ctx->t, 0, sizeof(ctx->t));
+}
+
 
-static const struct PtpOpcodeTable_s* pPtpOpcode = nullptr;
+PtpContext_t*
+PtpContext(USBD_HandleTypeDef* pdev)
+{
+    if (pdev->id >= MTP_INSTANCES)
+    {
+        MTP_DBG_LVL0("%s[%u] no engine for instance %u", __FUNCTION__, __LINE__, pdev->id);
+        return(nullptr);
+    }
+    vPtpContext[pdev->id].device = pdev;
+    return(&vPtpContext[pdev->id]);
+}
 
 
 bool
-PtpPayloadIn(uint8_t* buf, uint32_t vLength)
+PtpPayloadIn(PtpContext_t* ctx, uint8_t* buf, uint32_t vLength)
 {
     uint32_t length = GetUint32(&buf[0]);	// Offset 0, length 4 bytes -> Container Length
     uint16_t type = GetUint16(&buf[4]);	// Offset 4, length 2 bytes -> Container Type
@@ -2766,22 +5204,19 @@ PtpPayloadIn(uint8_t* buf, uint32_t vLength)
     uint32_t id = GetUint32(&buf[8]);	// Offset 8, length 4 bytes -> Transaction ID
     uint8_t* d = &buf[12];	// Offset 12, length ?? -> Payload
 
-    static uint32_t vDataIndex = 0;
-    static PtpProc_t pDataProc = nullptr;
-
-    uint32_t i;
+    int32_t i;
 
-    if ((vDataIndex > 0) && (pDataProc != nullptr))
+    if ((ctx->t.dataIndex > 0) && (ctx->t.data != nullptr))
     {
-        vResponseIndex = UINT32_MAX;
-        vResponseLength = (pDataProc)(vResponseId, buf, vDataIndex, vLength);
-        if (vResponseLength == 0)
+        ctx->t.index = UINT32_MAX;
+        ctx->t.length = (ctx->t.data)(ctx, ctx->t.id, buf, ctx->t.dataIndex, vLength);
+        if (ctx->t.length == 0)
         {
-            vDataIndex += vLength;
+            ctx->t.dataIndex += vLength;
         }
         else
         {
-            vDataIndex = 0;
+            ctx->t.dataIndex = 0;
         }
         return(true);
     }
@@ -2791,35 +5226,33 @@ PtpPayloadIn(uint8_t* buf, uint32_t vLength)
     switch (type)
     {
         case 1:	// Command Block
-            for (i = 0; vPtpOpcodeTable[i].opcode != 0; i++)
+            if (i = OpcodeFind(code), i >= 0)
             {
-                if (vPtpOpcodeTable[i].opcode == code)
-                {
-                    pPtpOpcode = &vPtpOpcodeTable[i];
-                    pResponseProc = vPtpOpcodeTable[i].proc;
-                    pDataProc = vPtpOpcodeTable[i].data;
-                    vResponseId = id;
-
-                    vResponseIndex = 0;
-                    vResponseLength = (pPtpOpcode->proc)(id, buf, vResponseIndex, 0);
-                    vDataIndex = 0;
-                    return(true);
-                }
+                PtpTransactionClear(ctx);
+                ctx->t.opcode = &vPtpOpcodeTable[i];
+                ctx->t.proc = vPtpOpcodeTable[i].proc;
+                ctx->t.data = vPtpOpcodeTable[i].data;
+                ctx->t.id = id;
+
+                PtpCursorReset(ctx, UINT32_MAX);
+                ctx->t.length = (ctx->t.opcode->proc)(ctx, id, buf, ctx->t.index, 0);
+                PtpCursorReset(ctx, 0);
+                return(true);
             }
             return(false);
 
         case 2:	// Data Block
-            if (vResponseId == id)
+            if (ctx->t.id == id)
             {
-                vResponseIndex = UINT32_MAX;
-                vResponseLength = (pDataProc)(id, buf, vDataIndex, vLength);
-                if (vResponseLength == 0)
+                ctx->t.index = UINT32_MAX;
+                ctx->t.length = (ctx->t.data)(ctx, id, buf, ctx->t.dataIndex, vLength);
+                if (ctx->t.length == 0)
                 {
-                    vDataIndex = vLength;
+                    ctx->t.dataIndex = vLength;
                 }
                 else
                 {
-                    vDataIndex = 0;
+                    ctx->t.dataIndex = 0;
                 }
                 return(true);
             }
@@ -2838,41 +5271,58 @@ PtpPayloadIn(uint8_t* buf, uint32_t vLength)
 }
 
 
-uint8_t*
-PtpPayloadOut(uint32_t vRequestLength, uint32_t *pLength)
+bool
+PtpPayloadOut(PtpContext_t* ctx, uint8_t* buf, uint32_t vBufLength, uint32_t vRequestLength, uint32_t *pLength)
 {
-    if ((vResponseIndex <= vResponseLength) && (vResponseLength != 0))
+    uint32_t chunk;
+
+    // The packet size of the bus speed in use, up to the largest one the buffer holds
+    if ((vRequestLength == 0) || (vRequestLength > vBufLength))
+    {
+        vRequestLength = vBufLength;
+    }
+    // As many whole packets as the buffer holds, the driver splits them on the bus
+    chunk = vBufLength - (vBufLength % vRequestLength);
+
+    if ((ctx->t.index <= ctx->t.length) && (ctx->t.length != 0))
     {
-        uint8_t* p = nullptr;
+        if (ctx->t.proc == nullptr)
+        {
+            return(false);
+        }
+        // retrieve next segment of data, resuming where the previous segment ended
+        ctx->t.cursor.end = ctx->t.index + chunk;
+        (ctx->t.proc)(ctx, ctx->t.id, buf, ctx->t.index, chunk);
+        *pLength = ctx->t.length - ctx->t.index;
+        if (*pLength > chunk)
+        {
+            *pLength = chunk;
+        }
+        MTP_DBG_LVL3("%s[%u] id %lu: %p idx=%ld len=%lu - sending %lu", __FUNCTION__, __LINE__, ctx->t.id, buf, ctx->t.index, ctx->t.length, *pLength);
+        ctx->t.index += *pLength;
 
-        if (pResponseProc != nullptr)
+        // A short packet ends the data phase. When it ends on a packet boundary the
+        // host still waits for one, so the next call sends a zero-length packet.
+        if (((*pLength % vRequestLength) != 0) || (*pLength == 0))
         {
-            // retrieve next segment of data
-            (pResponseProc)(vResponseId, vPtpBuffer, vResponseIndex, vRequestLength);
-            *pLength = vResponseLength - vResponseIndex;
-            if (*pLength > vRequestLength)
-            {
-                *pLength = vRequestLength;
-            }
-            p = vPtpBuffer;
-            MTP_DBG_LVL3("%s[%u] id %lu: %p idx=%ld len=%lu - sending %lu", __FUNCTION__, __LINE__, vResponseId, p, vResponseIndex, vResponseLength, *pLength);
-            vResponseIndex += vRequestLength;
+            ctx->t.index = ctx->t.length + 1;
         }
-        return(p);
+        return(true);
     }
-    else if ((pResponseProc != nullptr) && (vResponseLength != 0))
+    else if ((ctx->t.proc != nullptr) && (ctx->t.length != 0))
     {
-        *pLength = PtpResponse(vResponseId, vPtpBuffer, 0);
-        pResponseProc = nullptr;
-        MTP_DBG_LVL3("%s[%u] id %lu: %p. %ld %lu -%u", __FUNCTION__, __LINE__, vResponseId, vPtpBuffer, vResponseIndex, vResponseLength, vPtpBuffer[4]);
-        return(vPtpBuffer);
+        *pLength = PtpResponse(ctx, ctx->t.id, buf, 0);
+        ctx->t.proc = nullptr;
+        DirCursorClose(&ctx->t.dir);
+        MTP_DBG_LVL3("%s[%u] id %lu: %p. %ld %lu -%u", __FUNCTION__, __LINE__, ctx->t.id, buf, ctx->t.index, ctx->t.length, buf[4]);
+        return(true);
     }
-    return(nullptr);	// callee should stall the endpoint
+    return(false);	// callee should stall the endpoint
 }
 
 
 void
-PtpCancelRequest(uint8_t* buf)
+PtpCancelRequest(PtpContext_t* ctx, uint8_t* buf)
 {
     uint16_t code = GetUint16(&buf[0]);
     uint32_t id = GetUint32(&buf[2]);
@@ -2881,18 +5331,29 @@ PtpCancelRequest(uint8_t* buf)
     {
         return;
     }
-    MTP_DBG_LVL0("%s[%u] %lu", __FUNCTION__, __LINE__, id);
+    MTP_DBG_LVL0("%s[%u] %lu", __FUNCTION__, __LINE__, (unsigned long)id);
 
+    // GetObject reads through the same file as SendObject writes, that file is only closed
+    bool reading = (ctx->t.proc == PtpGetObject);
+
+    PtpTransactionClear(ctx);
+    if (reading)
+    {
+        vfs_file_close(&ctx->file);
+    }
 #if (MTP_READONLY != 1)
-    if (vSendObjectHandle.filesys != nullptr)
+    else if (ctx->file.filesys != nullptr)
     {
-        vfs_file_close(&vSendObjectHandle);
+        vfs_file_close(&ctx->file);
+        ctx->file.filesys = nullptr;
         // Set marker so that MtpGetDeviceStatus knows the transaction was canceled
-        vSendObjectHandle.filesys = (FileSystem_t*)0xA5;
+        ctx->cancelled = true;
 
         char* path;
-        GetFileById(nullptr, vSendObjectId, false, &path);
+        GetFileById(nullptr, ctx->sendId, false, &path);
 
+        HandleIndexRemove(ctx->sendId);
+        LookupCacheClear();
         vfs_remove(path);
     }
 #endif
@@ -2900,18 +5361,22 @@ PtpCancelRequest(uint8_t* buf)
 
 
 uint8_t*
-MtpGetDeviceStatus(uint16_t* len)
+MtpGetDeviceStatus(PtpContext_t* ctx, bool busy, uint16_t* len)
 {
-    static uint8_t buf[4];
-    uint8_t* p = buf;
+    uint8_t* p = ctx->status;
 
     uint32_t index = 0, reqlen = 4;
     uint16_t vResponse = OK;
 
+    if (busy)
+    {
+        // The class has not dropped the cancelled transaction yet, the host polls again
+        vResponse = PtpErr_DeviceBusy;
+    }
 #if (MTP_READONLY != 1)
-    if (vSendObjectHandle.filesys == (FileSystem_t*)0xA5)
+    else if (ctx->cancelled)
     {
-        vSendObjectHandle.filesys = nullptr;
+        ctx->cancelled = false;
         vResponse = PtpErr_TransactionCancelled;
     }
 #endif
@@ -2921,14 +5386,15 @@ MtpGetDeviceStatus(uint16_t* len)
     *len += Uint16(&p, &index, &reqlen, 4);       // Length of response
     *len += Uint16(&p, &index, &reqlen, vResponse);       // Status code
 
-    return(buf);
+    return(ctx->status);
 }
 
 
 void
-PtpReset(void)
+PtpReset(PtpContext_t* ctx)
 {
-    PtpCloseSession(0, nullptr, 0, 0);
+    PtpCloseSession(ctx, 0, nullptr, 0, 0);
+    PtpTransactionClear(ctx);
 }
 
 
@@ -2940,10 +5406,15 @@ PtpEvent(MtpEvent_t vEvent, uint32_t vParam)
     uint8_t* p = buf;
     uint16_t len = 0;
     uint32_t index = 0, reqlen = 24;
+    uint8_t i;
 
     // TODO Maybe needed to implement GetExtendedEventDataRequest ?
 
-    if (vPtpSession != 0)
+    // The storage is shared, every open session is interested
+    for (i = 0; (i < MTP_INSTANCES) && (vPtpContext[i].session == 0); i++)
+    {
+    }
+    if (i < MTP_INSTANCES)
     {
         len += Uint32(&p, &index, &reqlen, sizeof(buf));    // Interrupt Data Length
         len += Uint16(&p, &index, &reqlen, 0x0004);         // Container Type = Event
@@ -2954,9 +5425,13 @@ PtpEvent(MtpEvent_t vEvent, uint32_t vParam)
         //len += Uint32(&p, &index, &reqlen, 0);              // Event Parameter 2
         //len += Uint32(&p, &index, &reqlen, 0);              // Event Parameter 3
 
-    #if 1
-        USBD_MTP_SendInterruptData(buf, len);
-    #endif
+        for (; i < MTP_INSTANCES; i++)
+        {
+            if (vPtpContext[i].session != 0)
+            {
+                USBD_MTP_SendInterruptData(vPtpContext[i].device, buf, len);
+            }
+        }
     }
     return(true);
 }
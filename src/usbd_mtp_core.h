@@ -68,6 +68,24 @@ extern "C" {
 /* Define MTP_READONLY here to implement read-only MTP */
 //#define MTP_READONLY            1
 
+/* Define MTP_WORKER to run the MTP operations outside the USB interrupt. The
+ * interrupt only queues the completed transfers, USBD_MTP_Process() (or
+ * USBD_MTP_HID_Process()) runs them from the main loop or an RTOS task */
+//#define MTP_WORKER
+
+/* CRC used for the object handles, all variants give the same handles. The
+ * default uses a 64 byte table, MTP_CRC_SLICE4 is faster with 4 KiB of tables
+ * and MTP_CRC_HW uses the CRC unit of the STM32. The unit holds the state of
+ * one computation, so MTP_CRC_HW takes effect with MTP_WORKER only: the unit
+ * then belongs to the thread running the worker and interrupt handlers must
+ * not use it. Without MTP_WORKER the operations run in the USB interrupt, which
+ * would corrupt a CRC that thread code is computing, and the table is used. */
+//#define MTP_CRC_SLICE4
+//#define MTP_CRC_HW
+
+/* Define MTP_CRC_BENCHMARK to build MtpCrcBenchmark(), which compares them */
+//#define MTP_CRC_BENCHMARK
+
 
 #ifdef MTP_EVENTS
 typedef enum MtpEvent_e
@@ -96,17 +114,30 @@ MtpEvent_t;
 
 extern uint32_t MtpFileId(const uint8_t* pDrive, const VfsInfo_t* pData);
 
-extern bool PtpPayloadIn(uint8_t* buf, uint32_t vLength);
-extern uint8_t* PtpPayloadOut(uint32_t vRequestLength, uint32_t* pLength);
+/* Session and transaction state of one protocol engine, one per class driver
+ * instance. MTP_INSTANCES sets the number of engines, the class driver fails
+ * to initialise on an instance above it. The engine keeps the device it was
+ * taken for, to send its events there. */
+typedef struct PtpContext_s PtpContext_t;
+struct _USBD_HandleTypeDef;
+
+extern PtpContext_t* PtpContext(struct _USBD_HandleTypeDef* pdev);
 
-extern void PtpReset(void);
-extern void PtpCancelRequest(uint8_t* buf);
-extern uint8_t* MtpGetDeviceStatus(uint16_t* len);
+extern bool PtpPayloadIn(PtpContext_t* ctx, uint8_t* buf, uint32_t vLength);
+extern bool PtpPayloadOut(PtpContext_t* ctx, uint8_t* buf, uint32_t vBufLength, uint32_t vRequestLength, uint32_t* pLength);
+
+extern void PtpReset(PtpContext_t* ctx);
+extern void PtpCancelRequest(PtpContext_t* ctx, uint8_t* buf);
+extern uint8_t* MtpGetDeviceStatus(PtpContext_t* ctx, bool busy, uint16_t* len);
 
 #ifdef MTP_EVENTS
 bool PtpEvent(MtpEvent_t vEvent, uint32_t vParam);
 #endif
 
+#ifdef MTP_CRC_BENCHMARK
+extern bool MtpCrcBenchmark(uint32_t rounds);
+#endif
+
 
 #ifdef __cplusplus
 }
@@ -24,6 +24,12 @@ static uint8_t* USBD_MTP_HID_GetCfgDesc(uint16_t *length);
 static uint8_t  USBD_MTP_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_MTP_HID_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t  USBD_MTP_HID_EP0_RxReady(USBD_HandleTypeDef  *pdev);
+static void     USBD_MTP_HID_TxNext(USBD_HandleTypeDef *pdev);
+static void     USBD_MTP_HID_RxDone(USBD_HandleTypeDef *pdev, uint32_t len);
+#ifdef MTP_WORKER
+static void     USBD_MTP_HID_WorkQueue(USBD_MTP_HID_HandleTypeDef *hMtpHid, uint8_t epnum, uint32_t len);
+static void     USBD_MTP_HID_WorkReset(USBD_HandleTypeDef *pdev);
+#endif
 
 
 USBD_ClassTypeDef  USBD_MTP_HID =
@@ -111,14 +117,14 @@ static const uint8_t USBD_MTP_HID_CfgDesc[71] =
 	USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType */
 	MTP_EPOUT_ADDR,               /* bEndpointAddress */
 	USB_ENDPOINT_TYPE_BULK,            /* bmAttributes */
-	WBVAL(MTP_EP_SIZE),        /* wMaxPacketSize */
+	WBVAL(MTP_FS_EP_SIZE),        /* wMaxPacketSize */
 	0, /* ms */                        /* bInterval */
 	/* Endpoint, MTP Data In */
 	0x07,            /* bLength */
 	USB_DESC_TYPE_ENDPOINT,      /* bDescriptorType */
 	MTP_EPIN_ADDR,                /* bEndpointAddress */
 	USB_ENDPOINT_TYPE_BULK,            /* bmAttributes */
-	WBVAL(MTP_EP_SIZE),         /* wMaxPacketSize */
+	WBVAL(MTP_FS_EP_SIZE),         /* wMaxPacketSize */
 	0, /* ms */                        /* bInterval */
 	/* Endpoint, MTP Interrupt Out */
 	0x07,            /* bLength */
@@ -142,17 +148,38 @@ USBD_MTP_HID_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
     uint8_t ret = 0;
     USBD_MTP_HID_HandleTypeDef     *hMtpHid;
+    PtpContext_t *ptp;
+
+    // No protocol engine for this USB core, MTP_INSTANCES is too low
+    if(ptp = PtpContext(pdev), ptp == NULL)
+    {
+        return USBD_FAIL;
+    }
 
     /* Open EP IN & out */
     USBD_LL_OpenEP(pdev, HID_EPIN_ADDR, USBD_EP_TYPE_INTR, HID_EPIN_SIZE);
     USBD_LL_OpenEP(pdev, HID_EPOUT_ADDR, USBD_EP_TYPE_INTR, HID_EPOUT_SIZE);
 
     /* Open MTP Endpoints */
-    USBD_LL_OpenEP(pdev, MTP_EPIN_ADDR, USBD_EP_TYPE_BULK, MTP_EP_SIZE);
+    USBD_LL_OpenEP(pdev, MTP_EPIN_ADDR, USBD_EP_TYPE_BULK, MTP_FS_EP_SIZE);
     USBD_LL_OpenEP(pdev, MTP_EP2IN_ADDR, USBD_EP_TYPE_INTR, MTP_EP2_SIZE);
-    USBD_LL_OpenEP(pdev, MTP_EPOUT_ADDR, USBD_EP_TYPE_BULK, MTP_EP_SIZE);
+    USBD_LL_OpenEP(pdev, MTP_EPOUT_ADDR, USBD_EP_TYPE_BULK, MTP_FS_EP_SIZE);
 
+#ifdef MTP_WORKER
+    // The handle of the previous configuration is kept, the worker may still use it
+    if(pdev->pClassData == NULL)
+    {
+        if(pdev->pClassData = USBD_malloc(sizeof (USBD_MTP_HID_HandleTypeDef)), pdev->pClassData != NULL)
+        {
+            hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
+            hMtpHid->Work.head = 0;
+            hMtpHid->Work.tail = 0;
+            hMtpHid->Work.cancel = 0;
+        }
+    }
+#else
     pdev->pClassData = USBD_malloc(sizeof (USBD_MTP_HID_HandleTypeDef));
+#endif
 
     if(pdev->pClassData == NULL)
     {
@@ -162,12 +189,20 @@ USBD_MTP_HID_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     {
         hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
 
+        hMtpHid->Ptp = ptp;
         hMtpHid->state = MTP_HID_IDLE;
         //((USBD_MTP_HID_ItfTypeDef *)pdev->pUserData[0])->Init();
 
         /* Prepare Out endpoints to receive 1st packet */
         USBD_LL_PrepareReceive(pdev, HID_EPOUT_ADDR, hMtpHid->Report_buf, HID_EPOUT_SIZE);
-        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtpHid->MtpDataBuf, MTP_EP_SIZE);
+#ifdef MTP_WORKER
+        // The worker resets the engine and prepares the MTP Out endpoint
+        hMtpHid->Work.active = 1;
+        hMtpHid->Work.reset = 1;
+        MTP_WORKER_SIGNAL();
+#else
+        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtpHid->MtpDataBuf, MTP_FS_EP_SIZE);
+#endif
     }
     return ret;
 }
@@ -195,11 +230,19 @@ USBD_MTP_HID_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* FRee allocated memory */
     if(pdev->pClassData != NULL)
     {
-        PtpReset();
+#ifdef MTP_WORKER
+        // Freeing here pulls the handle from under a running worker, it resets
+        // the engine instead and the next Init takes the handle over
+        ((USBD_MTP_HID_HandleTypeDef*)pdev->pClassData)->Work.active = 0;
+        ((USBD_MTP_HID_HandleTypeDef*)pdev->pClassData)->Work.reset = 1;
+        MTP_WORKER_SIGNAL();
+#else
+        PtpReset(((USBD_MTP_HID_HandleTypeDef*)pdev->pClassData)->Ptp);
 
         //((USBD_MTP_HID_ItfTypeDef *)pdev->pUserData[0])->DeInit();
         USBD_free(pdev->pClassData);
         pdev->pClassData = NULL;
+#endif
     }
     return USBD_OK;
 }
@@ -260,7 +303,12 @@ USBD_MTP_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
                     break;
 
                 case 0x67:
-                    pbuf = MtpGetDeviceStatus(&len);
+#ifdef MTP_WORKER
+                    // Device_Busy until the worker has dropped a cancelled transaction
+                    pbuf = MtpGetDeviceStatus(hMtpHid->Ptp, hMtpHid->Work.cancel, &len);
+#else
+                    pbuf = MtpGetDeviceStatus(hMtpHid->Ptp, false, &len);
+#endif
                     USBD_CtlSendData(pdev, (uint8_t*)pbuf, len);
                     break;
 
@@ -364,8 +412,6 @@ USBD_MTP_HID_GetCfgDesc(uint16_t *length)
 static uint8_t
 USBD_MTP_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-    uint32_t len = 0;
-
     epnum |= 0x80;
     if(epnum == HID_EPIN_ADDR)
     {
@@ -375,18 +421,11 @@ USBD_MTP_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
     else if(epnum == MTP_EPIN_ADDR)
     {
-        uint8_t *pTx;
-
-        pTx = PtpPayloadOut(MTP_EP_SIZE, &len);
-        if(pTx != NULL)
-        {
-            USBD_LL_Transmit(pdev, MTP_EPIN_ADDR, pTx, len);
-        }
-        else
-        {
-        //    printf("EPIN STALL\n");
-        //    USBD_LL_StallEP(pdev, MTP_EPIN_ADDR);
-        }
+#ifdef MTP_WORKER
+        USBD_MTP_HID_WorkQueue((USBD_MTP_HID_HandleTypeDef *)pdev->pClassData, MTP_EPIN_ADDR, 0);
+#else
+        USBD_MTP_HID_TxNext(pdev);
+#endif
     }
     else if(epnum == MTP_EP2IN_ADDR)
     {
@@ -395,6 +434,31 @@ USBD_MTP_HID_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 }
 
 
+/**
+  * @brief  USBD_MTP_HID_TxNext
+  *         Fill the transmit buffer with the next chunk and send it
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void
+USBD_MTP_HID_TxNext(USBD_HandleTypeDef *pdev)
+{
+    uint32_t len = 0;
+    USBD_MTP_HID_HandleTypeDef *hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
+    uint8_t *pTx = hMtpHid->MtpTxBuf;
+
+    if(PtpPayloadOut(hMtpHid->Ptp, pTx, MTP_TX_BUF_SIZE, MTP_FS_EP_SIZE, &len))
+    {
+        USBD_LL_Transmit(pdev, MTP_EPIN_ADDR, pTx, len);
+    }
+    else
+    {
+    //    printf("EPIN STALL\n");
+    //    USBD_LL_StallEP(pdev, MTP_EPIN_ADDR);
+    }
+}
+
+
 /**
   * @brief  USBD_MTP_DataOut
   *         handle data OUT Stage
@@ -415,20 +479,143 @@ USBD_MTP_HID_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
     }
     else if(epnum == MTP_EPOUT_ADDR)
     {
-        if(PtpPayloadIn(hMtpHid->MtpDataBuf, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR)))
+#ifdef MTP_WORKER
+        USBD_MTP_HID_WorkQueue(hMtpHid, MTP_EPOUT_ADDR, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR));
+#else
+        USBD_MTP_HID_RxDone(pdev, USBD_LL_GetRxDataSize(pdev, MTP_EPOUT_ADDR));
+#endif
+    }
+    return USBD_OK;
+}
+
+
+/**
+  * @brief  USBD_MTP_HID_RxDone
+  *         Pass a received packet to the core and re-arm the endpoint
+  * @param  pdev: device instance
+  * @param  len: bytes received
+  * @retval None
+  */
+static void
+USBD_MTP_HID_RxDone(USBD_HandleTypeDef *pdev, uint32_t len)
+{
+    USBD_MTP_HID_HandleTypeDef *hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
+
+    if(PtpPayloadIn(hMtpHid->Ptp, hMtpHid->MtpDataBuf, len))
+    {
+        // Start sending the response
+        USBD_MTP_HID_TxNext(pdev);
+    }
+    else
+    {
+        printf("ENDP2 stall\n");
+        USBD_LL_StallEP(pdev, MTP_EPOUT_ADDR);
+    }
+    USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtpHid->MtpDataBuf, MTP_FS_EP_SIZE);
+}
+
+
+#ifdef MTP_WORKER
+/**
+  * @brief  USBD_MTP_HID_WorkQueue
+  *         Queue a completion for USBD_MTP_HID_Process, called from the interrupt
+  * @param  hMtpHid: MTP handle
+  * @param  epnum: endpoint of the completed transfer, 0 for a cancel request
+  * @param  len: bytes received
+  * @retval None
+  */
+static void
+USBD_MTP_HID_WorkQueue(USBD_MTP_HID_HandleTypeDef *hMtpHid, uint8_t epnum, uint32_t len)
+{
+    uint8_t slot = hMtpHid->Work.head & (MTP_WORK_QUEUE - 1);
+
+    if(epnum == 0)
+    {
+        // The waiting request reads the command buffer once it runs, a repeat adds nothing
+        if(hMtpHid->Work.cancel)
         {
-            // Start sending the response
-            USBD_MTP_HID_DataIn(pdev, MTP_EPIN_ADDR);
+            return;
         }
-        else
+        hMtpHid->Work.cancel = 1;
+    }
+    // Never full, see USBD_MTP_WorkQueueTypeDef; a lost completion leaves its endpoint unarmed
+    hMtpHid->Work.epnum[slot] = epnum;
+    hMtpHid->Work.length[slot] = len;
+    hMtpHid->Work.head++;       // Publish the entry once it is complete
+    MTP_WORKER_SIGNAL();
+}
+
+
+/**
+  * @brief  USBD_MTP_HID_WorkReset
+  *         Reset the engine after Init or DeInit, which run in the interrupt,
+  *         and drop the completions of the previous configuration
+  * @param  pdev: device instance
+  * @retval None
+  */
+static void
+USBD_MTP_HID_WorkReset(USBD_HandleTypeDef *pdev)
+{
+    USBD_MTP_HID_HandleTypeDef *hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
+
+    hMtpHid->Work.reset = 0;
+    hMtpHid->Work.tail = hMtpHid->Work.head;
+    hMtpHid->Work.cancel = 0;
+    PtpReset(hMtpHid->Ptp);
+
+    // Another Init or DeInit in the meantime sets reset again and runs this once more
+    if(hMtpHid->Work.active)
+    {
+        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtpHid->MtpDataBuf, MTP_FS_EP_SIZE);
+    }
+}
+
+
+/**
+  * @brief  USBD_MTP_HID_Process
+  *         Run the transfers queued by the interrupt through the core. Call
+  *         from the main loop, or from the task woken by MTP_WORKER_SIGNAL
+  * @param  pdev: device instance
+  * @retval None
+  */
+void
+USBD_MTP_HID_Process(USBD_HandleTypeDef *pdev)
+{
+    USBD_MTP_HID_HandleTypeDef *hMtpHid = (USBD_MTP_HID_HandleTypeDef*)pdev->pClassData;
+
+    if(hMtpHid == NULL)
+    {
+        return;
+    }
+    while(hMtpHid->Work.reset || (hMtpHid->Work.tail != hMtpHid->Work.head))
+    {
+        uint8_t slot = hMtpHid->Work.tail & (MTP_WORK_QUEUE - 1);
+
+        if(hMtpHid->Work.reset)
         {
-            printf("ENDP2 stall\n");
-            USBD_LL_StallEP(pdev, MTP_EPOUT_ADDR);
+            USBD_MTP_HID_WorkReset(pdev);
+            continue;
         }
-        USBD_LL_PrepareReceive(pdev, MTP_EPOUT_ADDR, hMtpHid->MtpDataBuf, MTP_EP_SIZE);
+        switch(hMtpHid->Work.epnum[slot])
+        {
+            case MTP_EPOUT_ADDR:
+                USBD_MTP_HID_RxDone(pdev, hMtpHid->Work.length[slot]);
+                break;
+
+            case MTP_EPIN_ADDR:
+                USBD_MTP_HID_TxNext(pdev);
+                break;
+
+            default:
+                hMtpHid->Work.cancel = 0;
+                PtpCancelRequest(hMtpHid->Ptp, hMtpHid->MtpCmdBuf);
+                USBD_LL_FlushEP(pdev, MTP_EPIN_ADDR);
+                break;
+        }
+        hMtpHid->Work.tail++;       // Hand the entry back to the interrupt
     }
-    return USBD_OK;
 }
+#endif
 
 
 /**
@@ -453,7 +640,13 @@ USBD_MTP_HID_EP0_RxReady(USBD_HandleTypeDef *pdev)
                     break;
 
                 case 0x64:
-                    PtpCancelRequest(hMtpHid->MtpCmdBuf);
+#ifdef MTP_WORKER
+                    USBD_MTP_HID_WorkQueue(hMtpHid, 0, 0);
+#else
+                    PtpCancelRequest(hMtpHid->Ptp, hMtpHid->MtpCmdBuf);
+                    // Drop the chunk on the wire, the host stopped reading it
+                    USBD_LL_FlushEP(pdev, MTP_EPIN_ADDR);
+#endif
                     break;
             }
     }
@@ -68,15 +68,21 @@ USBD_MTP_HID_ItfTypeDef;
 
 typedef struct
 {
-	uint8_t     MtpCmdBuf[10];
-	uint8_t     MtpDataBuf[MTP_EP_SIZE];
+    /* The buffers come first, to stay word aligned for the DMA of the OTG core */
+	uint8_t     MtpTxBuf[MTP_TX_BUF_SIZE];      // IN transfer, filled when the previous one completes
+	uint8_t     MtpDataBuf[MTP_FS_EP_SIZE];     // Full speed only
 
+	uint8_t     MtpCmdBuf[10];
+    PtpContext_t *Ptp;                          // Protocol engine of this instance
     uint8_t     Report_buf[USB_MAX_EP0_SIZE];
     uint32_t    Protocol;
     uint32_t    IdleState;
     uint32_t    AltSetting;
     uint32_t    IsReportAvailable;
     MTP_HID_StateTypeDef     state;
+#ifdef MTP_WORKER
+    USBD_MTP_WorkQueueTypeDef Work;
+#endif
 }
 USBD_MTP_HID_HandleTypeDef;
 
@@ -87,7 +93,10 @@ extern USBD_ClassTypeDef  USBD_MTP_HID;
 
 uint8_t USBD_MTP_HID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
 uint8_t USBD_MTP_HID_RegisterInterface(USBD_HandleTypeDef *pdev, USBD_MTP_HID_ItfTypeDef *fops);
-uint8_t USBD_MTP_SendInterruptData(uint8_t* buf, uint32_t len);
+#ifdef MTP_WORKER
+void    USBD_MTP_HID_Process(USBD_HandleTypeDef *pdev);
+#endif
+uint8_t USBD_MTP_SendInterruptData(USBD_HandleTypeDef *pdev, uint8_t* buf, uint32_t len);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,14 @@
+/* Stand-in for the ST header of the same name, see usbd_def.h */
+
+#ifndef __USB_DEVICE_H
+#define __USB_DEVICE_H
+
+#include "usbd_def.h"
+
+/* Application side of usbd_mtp_hid.c */
+extern uint8_t vHidBuf_TX[64];
+
+uint16_t HidDispatch(uint8_t get, uint32_t report, uint8_t* buf);
+void     SystemReset(void);
+
+#endif
@@ -0,0 +1,8 @@
+/* Stand-in for the ST header of the same name, see usbd_def.h */
+
+#ifndef __USBD_CONF_H
+#define __USBD_CONF_H
+
+#include "usbd_def.h"
+
+#endif
@@ -0,0 +1,10 @@
+/* Stand-in for the ST header of the same name, see usbd_def.h */
+
+#ifndef __USBD_CTLREQ_H
+#define __USBD_CTLREQ_H
+
+#include "usbd_def.h"
+
+void USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len);
+
+#endif
@@ -0,0 +1,119 @@
+/* Stand-in for the parts of the ST USB device library used by the class
+ * driver, enough to build it on the host */
+
+#ifndef __USBD_DEF_H
+#define __USBD_DEF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+
+#define __ALIGN_BEGIN
+#define __ALIGN_END
+
+#define LOBYTE(x)                       ((uint8_t)((x) & 0x00FFU))
+#define HIBYTE(x)                       ((uint8_t)(((x) & 0xFF00U) >> 8U))
+#ifndef MIN
+#define MIN(a, b)                       (((a) < (b)) ? (a) : (b))
+#endif
+
+#define USBD_OK                         0
+#define USBD_BUSY                       1
+#define USBD_FAIL                       3
+
+#define USB_MAX_EP0_SIZE                64
+#define USB_LEN_DEV_QUALIFIER_DESC      10
+#define USB_DESC_TYPE_CONFIGURATION     2
+#define USB_DESC_TYPE_INTERFACE         4
+#define USB_DESC_TYPE_ENDPOINT          5
+#define USB_DESC_TYPE_DEVICE_QUALIFIER  6
+#define USB_DESC_TYPE_OTHER_SPEED_CONFIGURATION 7
+#define USBD_IDX_CONFIG_STR             5
+#define USBD_EP_TYPE_BULK               2
+#define USBD_EP_TYPE_INTR               3
+
+#define USB_REQ_TYPE_MASK               0x60
+#define USB_REQ_TYPE_STANDARD           0x00
+#define USB_REQ_TYPE_CLASS              0x20
+#define USB_REQ_GET_DESCRIPTOR          0x06
+#define USB_REQ_GET_INTERFACE           0x0A
+#define USB_REQ_SET_INTERFACE           0x0B
+
+#define USBD_STATE_CONFIGURED           3
+#define USBD_MAX_STR_DESC_SIZ           512
+
+#define TRUE                            1
+#define FALSE                           0
+
+typedef enum
+{
+    USBD_SPEED_HIGH = 0,
+    USBD_SPEED_FULL = 1,
+    USBD_SPEED_LOW = 2,
+}
+USBD_SpeedTypeDef;
+
+typedef struct
+{
+    uint8_t  bmRequest;
+    uint8_t  bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+}
+USBD_SetupReqTypedef;
+
+struct _USBD_HandleTypeDef;
+
+typedef struct
+{
+    uint8_t  (*Init)(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+    uint8_t  (*DeInit)(struct _USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+    uint8_t  (*Setup)(struct _USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+    uint8_t  (*EP0_TxSent)(struct _USBD_HandleTypeDef *pdev);
+    uint8_t  (*EP0_RxReady)(struct _USBD_HandleTypeDef *pdev);
+    uint8_t  (*DataIn)(struct _USBD_HandleTypeDef *pdev, uint8_t epnum);
+    uint8_t  (*DataOut)(struct _USBD_HandleTypeDef *pdev, uint8_t epnum);
+    uint8_t  (*SOF)(struct _USBD_HandleTypeDef *pdev);
+    uint8_t  (*IsoINIncomplete)(struct _USBD_HandleTypeDef *pdev, uint8_t epnum);
+    uint8_t  (*IsoOUTIncomplete)(struct _USBD_HandleTypeDef *pdev, uint8_t epnum);
+    uint8_t* (*GetHSConfigDescriptor)(uint16_t *length);
+    uint8_t* (*GetFSConfigDescriptor)(uint16_t *length);
+    uint8_t* (*GetOtherSpeedConfigDescriptor)(uint16_t *length);
+    uint8_t* (*GetDeviceQualifierDescriptor)(uint16_t *length);
+}
+USBD_ClassTypeDef;
+
+typedef struct _USBD_HandleTypeDef
+{
+    uint8_t              id;
+    uint32_t             dev_state;
+    USBD_SpeedTypeDef    dev_speed;
+    void                *pClassData;
+    void                *pUserData[4];
+    uint8_t              classId;
+    USBD_SetupReqTypedef request;
+}
+USBD_HandleTypeDef;
+
+
+uint8_t  USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps);
+uint8_t  USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+uint8_t  USBD_LL_FlushEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+uint8_t  USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+uint8_t  USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size);
+uint8_t  USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size);
+uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr);
+
+uint8_t  USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len);
+uint8_t  USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len);
+void     USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+
+void*    USBD_malloc(size_t size);
+void     USBD_free(void *p);
+void     NVIC_SystemReset(void);
+
+extern uint8_t USBD_DeviceDesc[];
+
+#endif  /* __USBD_DEF_H */
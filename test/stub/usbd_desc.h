@@ -0,0 +1,12 @@
+/* Stand-in for the ST header of the same name, see usbd_def.h */
+
+#ifndef __USBD_DESC_H
+#define __USBD_DESC_H
+
+#include "usbd_def.h"
+
+extern uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
+
+uint8_t* USBD_GetDeviceQualifierDesc(uint16_t *length);
+
+#endif
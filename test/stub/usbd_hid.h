@@ -0,0 +1,17 @@
+/* Stand-in for the ST header of the same name, with the HID descriptors the
+ * application exports for usbd_mtp_hid.c, see usbd_def.h */
+
+#ifndef __USBD_HID_H
+#define __USBD_HID_H
+
+#include "usbd_def.h"
+
+#define USB_DEVICE_CLASS_HUMAN_INTERFACE    0x03
+#define HID_SUBCLASS_NONE                   0x00
+#define HID_PROTOCOL_NONE                   0x00
+#define USB_DEVICE_CLASS_IMAGE              0x06
+
+extern uint8_t HID_ReportDesc[33];
+extern uint8_t USBD_HID_Desc[9];
+
+#endif
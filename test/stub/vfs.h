@@ -0,0 +1,100 @@
+/* Stand-in for the file system layer, implemented on a host directory by
+ * vfs_host.c */
+
+#ifndef __VFS_H
+#define __VFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <strings.h>
+
+
+#define iprintf                 printf
+#define siprintf                sprintf
+#define sniprintf               snprintf
+
+#define MAX_PATH                260
+
+#define INODE_STORAGE_BITS      4
+#define INODE_FOLDER_BITS       10
+#define INODE_ITEM_BITS         (32 - INODE_STORAGE_BITS - INODE_FOLDER_BITS)
+#define INODE_ITEM_MASK         ((1UL << INODE_ITEM_BITS) - 1)
+#define INODE_FOLDER_MASK       (((1UL << INODE_FOLDER_BITS) - 1) << INODE_ITEM_BITS)
+#define INODE_STORAGE_MASK      (((1UL << INODE_STORAGE_BITS) - 1) << (32 - INODE_STORAGE_BITS))
+#define INODE_STORAGE(h)        (((uint32_t)(h)) >> (32 - INODE_STORAGE_BITS))
+#define INODE_FOLDER(h)         ((((uint32_t)(h)) & INODE_FOLDER_MASK) >> INODE_ITEM_BITS)
+
+#define ATR_HID                 0x02
+#define ATR_SYS                 0x04
+#define ATR_DIR                 0x10
+#define ATR_IWRITE              0x100
+#define ATR_FLAT_FILESYSTEM     0x1000
+#define ATR_REMOVABLE_DISK      0x2000
+
+#define VFS_RDONLY              1
+#define VFS_WRONLY              2
+#define VFS_RDWR                3
+#define VFS_CREAT               0x10
+#define VFS_TRUNC               0x20
+
+typedef struct FileSystem_s
+{
+    int dummy;
+}
+FileSystem_t;
+
+typedef struct
+{
+    FILE* fp;
+    FileSystem_t* filesys;
+}
+VfsFile_t;
+
+typedef struct
+{
+    void* d;
+}
+VfsDir_t;
+
+typedef struct
+{
+    char name[256];
+    uint32_t attrib;
+    uint64_t size;
+    time_t created;
+    time_t modified;
+    uint32_t blocks;
+    uint32_t blocksize;
+}
+VfsInfo_t;
+
+extern const char* vVfsRoot;    // Host directory holding volume 0
+extern uint32_t vVfsIndexOpens[2];  // Opens of the folder index file, read-only and writable
+
+char* vfs_volume(int i);
+int vfs_stat(const char* path, VfsInfo_t* info);
+int vfs_touch(const char* path, VfsInfo_t* info);
+int vfs_file_open(VfsFile_t* f, const char* path, int mode);
+int vfs_file_close(VfsFile_t* f);
+int vfs_file_read(VfsFile_t* f, void* buf, size_t len);
+int vfs_file_write(VfsFile_t* f, const void* buf, size_t len);
+int vfs_file_seek(VfsFile_t* f, long off, int whence);
+long vfs_file_size(VfsFile_t* f);
+int vfs_file_eof(VfsFile_t* f);
+int vfs_file_sync(VfsFile_t* f);
+int vfs_dir_open(VfsDir_t* d, const char* path);
+int vfs_dir_read(VfsDir_t* d, VfsInfo_t* info);
+int vfs_dir_close(VfsDir_t* d);
+int vfs_remove(const char* path);
+int vfs_rename(const char* from, const char* to);
+int vfs_mkdir(const char* path);
+int vfs_format(const char* drive);
+int64_t vfs_fs_size(const char* path);
+int64_t vfs_fs_free(const char* path);
+
+#endif  /* __VFS_H */
@@ -0,0 +1,1282 @@
+/*  __      __ _   _  _  _____  ____   ____  ____  ____   ___   ___  ___
+    \ \_/\_/ /| |_| || ||_   _|| ___| | __ \| __ \| ___| / _ \ |   \/   |
+     \      / |  _  || |  | |  | __|  | __ <|    /| __| |  _  || |\  /| |
+      \_/\_/  |_| |_||_|  |_|  |____| |____/|_|\_\|____||_| |_||_| \/ |_|
+*/
+/*! \copyright Copyright (c) 2014-2024, White Bream, https://whitebream.nl
+*************************************************************************//*!
+ Host test of the bulk transfers of usbd_mtp.c and the protocol engine. The
+ low-level driver is replaced by stubs that hold the transfer armed on each
+ endpoint, the simulated host takes those apart into packets of the bulk
+ size, the way the host controller sees them.
+****************************************************************************/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "usbd_mtp.h"
+#include "usbd_mtp_hid.h"
+
+
+#ifdef TEST_HID
+#define TEST_CLASS              USBD_MTP_HID    // Class driver under test, full speed only
+#define TEST_HANDLE             USBD_MTP_HID_HandleTypeDef
+#define TEST_PROCESS            USBD_MTP_HID_Process
+#else
+#define TEST_CLASS              USBD_MTP
+#define TEST_HANDLE             USBD_MTP_HandleTypeDef
+#define TEST_PROCESS            USBD_MTP_Process
+#endif
+#ifdef USE_USB_HS
+#define TEST_EP_SIZE            MTP_HS_EP_SIZE
+#else
+#define TEST_EP_SIZE            MTP_FS_EP_SIZE
+#endif
+#ifdef MTP_INSTANCES
+#define TEST_INSTANCES          MTP_INSTANCES   // USB cores, each with its own device and endpoints
+#else
+#define TEST_INSTANCES          1
+#endif
+#define TEST_STORAGE            0x00010001
+#define TEST_FOLDER_FILES       600     // Enough handles and names to fill several IN transfers
+
+#define CHECK(x)                do { if (!(x)) { printf("  %s:%u: %s\n", __FILE__, __LINE__, #x); vFailed++; } } while (0)
+
+
+/* State of the endpoints, as the low-level driver would hold it */
+static struct
+{
+    uint8_t* txBuf;             // IN transfer armed by USBD_LL_Transmit
+    uint32_t txLength;
+    bool     txArmed;
+    uint32_t txOverlap;         // Transmit while the previous transfer was still armed
+    uint32_t flushes;
+    uint8_t* rxBuf;             // OUT transfer armed by USBD_LL_PrepareReceive
+    uint32_t rxLength;
+    uint32_t rxFill;
+    bool     rxArmed;
+    bool     stalled;
+    uint8_t* ctlRxBuf;          // Data stage of a control request
+    uint8_t  ctlTx[64];
+    uint16_t ctlTxLength;
+}
+vUsbs[TEST_INSTANCES];
+
+static USBD_HandleTypeDef vDevs[TEST_INSTANCES];
+static uint32_t vHost;          // Device the host side talks to
+#define vUsb                    vUsbs[vHost]
+#define vDev                    vDevs[vHost]
+static uint32_t vFailed;
+static uint32_t vTransaction = 1;
+
+/* Result of the last transaction */
+static uint8_t  vData[1 << 20];
+static uint32_t vDataLength;
+static uint16_t vResponse;
+static uint32_t vParam[3];
+static uint32_t vZlp;
+
+
+uint8_t USBD_DeviceDesc[18] = {18, 1, 0x00, 0x02, 0, 0, 0, 64, 0x83, 0x04, 0x50, 0x57, 0x00, 0x02, 1, 2, 3, 1};
+#ifdef TEST_HID
+uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
+uint8_t HID_ReportDesc[33];
+uint8_t USBD_HID_Desc[9];
+uint8_t vHidBuf_TX[64];
+
+
+uint16_t
+HidDispatch(uint8_t get, uint32_t report, uint8_t* buf)
+{
+    return(0);
+}
+
+
+void
+SystemReset(void)
+{
+}
+
+
+void
+USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len)
+{
+    *len = 0;
+}
+
+
+uint8_t*
+USBD_GetDeviceQualifierDesc(uint16_t *length)
+{
+    *length = 0;
+    return(USBD_StrDesc);
+}
+#endif
+
+
+uint8_t
+USBD_LL_OpenEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t ep_type, uint16_t ep_mps)
+{
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    if (ep_addr == MTP_EPIN_ADDR)
+    {
+        vUsbs[pdev->id].txArmed = false;
+    }
+    else if (ep_addr == MTP_EPOUT_ADDR)
+    {
+        vUsbs[pdev->id].rxArmed = false;
+    }
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_LL_FlushEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    if (ep_addr == MTP_EPIN_ADDR)
+    {
+        vUsbs[pdev->id].txArmed = false;
+        vUsbs[pdev->id].flushes++;
+    }
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    vUsbs[pdev->id].stalled = true;
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size)
+{
+    if (ep_addr == MTP_EPIN_ADDR)
+    {
+        vUsbs[pdev->id].txOverlap += vUsbs[pdev->id].txArmed;
+        vUsbs[pdev->id].txBuf = pbuf;
+        vUsbs[pdev->id].txLength = size;
+        vUsbs[pdev->id].txArmed = true;
+    }
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t size)
+{
+    if (ep_addr == MTP_EPOUT_ADDR)
+    {
+        vUsbs[pdev->id].rxBuf = pbuf;
+        vUsbs[pdev->id].rxLength = size;
+        vUsbs[pdev->id].rxFill = 0;
+        vUsbs[pdev->id].rxArmed = true;
+    }
+    return(USBD_OK);
+}
+
+
+uint32_t
+USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+    return(vUsbs[pdev->id].rxFill);
+}
+
+
+uint8_t
+USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+    vUsbs[pdev->id].ctlTxLength = (len < sizeof(vUsbs[pdev->id].ctlTx)) ? len : sizeof(vUsbs[pdev->id].ctlTx);
+    memcpy(vUsbs[pdev->id].ctlTx, pbuf, vUsbs[pdev->id].ctlTxLength);
+    return(USBD_OK);
+}
+
+
+uint8_t
+USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint16_t len)
+{
+    vUsbs[pdev->id].ctlRxBuf = pbuf;
+    return(USBD_OK);
+}
+
+
+void
+USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+}
+
+
+void*
+USBD_malloc(size_t size)
+{
+    return(malloc(size));
+}
+
+
+void
+USBD_free(void *p)
+{
+    free(p);
+}
+
+
+void
+NVIC_SystemReset(void)
+{
+}
+
+
+/* Run the work queued by the interrupt, as the main loop or task would */
+static void
+Worker(void)
+{
+#ifdef MTP_WORKER
+    TEST_PROCESS(&vDev);
+#endif
+}
+
+
+static uint32_t
+Get32(const uint8_t* p)
+{
+    return(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+
+static void
+Put32(uint8_t* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+/* One bulk OUT packet from the host, completing the transfer when short or
+ * when the armed buffer is full */
+static bool
+HostPacketOut(const uint8_t* buf, uint32_t len)
+{
+    if (!vUsb.rxArmed)
+    {
+        Worker();
+    }
+    if (!vUsb.rxArmed || (vUsb.rxFill + len > vUsb.rxLength))
+    {
+        printf("  OUT endpoint not armed\n");
+        return(false);
+    }
+    memcpy(vUsb.rxBuf + vUsb.rxFill, buf, len);
+    vUsb.rxFill += len;
+    if ((len < TEST_EP_SIZE) || (vUsb.rxFill == vUsb.rxLength))
+    {
+        vUsb.rxArmed = false;
+        vUsb.stalled = false;
+        TEST_CLASS.DataOut(&vDev, MTP_EPOUT_ADDR);
+        Worker();
+        return(!vUsb.stalled);
+    }
+    return(true);
+}
+
+
+/* A container from the host, ended by a short or zero-length packet. Only
+ * the first len bytes are sent when len is below the container length. */
+static bool
+HostContainerOut(const uint8_t* buf, uint32_t length, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i += TEST_EP_SIZE)
+    {
+        if (!HostPacketOut(buf + i, (len - i < TEST_EP_SIZE) ? len - i : TEST_EP_SIZE))
+        {
+            return(false);
+        }
+    }
+    if ((len == length) && ((length % TEST_EP_SIZE) == 0))
+    {
+        return(HostPacketOut(buf, 0));
+    }
+    return(true);
+}
+
+
+static bool
+HostCommand(uint16_t code, uint32_t n, ...)
+{
+    uint8_t buf[32];
+    uint32_t len = 12 + 4 * n;
+    uint32_t i;
+    va_list ap;
+
+    Put32(&buf[0], len);
+    buf[4] = 1;
+    buf[5] = 0;
+    buf[6] = code;
+    buf[7] = code >> 8;
+    Put32(&buf[8], vTransaction++);
+    va_start(ap, n);
+    for (i = 0; i < n; i++)
+    {
+        Put32(&buf[12 + 4 * i], va_arg(ap, uint32_t));
+    }
+    va_end(ap);
+    return(HostContainerOut(buf, len, len));
+}
+
+
+/* Data phase of the last command, len bytes of the payload of length bytes */
+static bool
+HostDataOut(uint16_t code, const uint8_t* payload, uint32_t length, uint32_t len)
+{
+    static uint8_t buf[1 << 16];
+
+    Put32(&buf[0], 12 + length);
+    buf[4] = 2;
+    buf[5] = 0;
+    buf[6] = code;
+    buf[7] = code >> 8;
+    Put32(&buf[8], vTransaction - 1);
+    memcpy(&buf[12], payload, len);
+    return(HostContainerOut(buf, 12 + length, 12 + len));
+}
+
+
+/* The IN transfer armed on the endpoint, copied out, -1 when none */
+static int32_t
+HostTransferIn(uint8_t* buf)
+{
+    uint32_t len;
+
+    if (!vUsb.txArmed)
+    {
+        Worker();
+    }
+    if (!vUsb.txArmed)
+    {
+        return(-1);
+    }
+    len = vUsb.txLength;
+    if (len > MTP_TX_BUF_SIZE)
+    {
+        printf("  IN transfer of %u bytes\n", len);
+        vFailed++;
+        return(-1);
+    }
+    memcpy(buf, vUsb.txBuf, len);
+    vUsb.txArmed = false;
+    TEST_CLASS.DataIn(&vDev, MTP_EPIN_ADDR & 0x7F);
+    return(len);
+}
+
+
+/* Read the optional data phase and the response. A container ends with a
+ * short packet, or with a zero-length packet when it fills whole packets,
+ * and a transfer never runs past the container it belongs to. */
+static bool
+HostResponse(void)
+{
+    static uint8_t buf[MTP_TX_BUF_SIZE];
+    uint8_t* p = vData;
+    uint32_t got = 0, length = 0;
+    int32_t len;
+
+    vDataLength = 0;
+    vResponse = 0;
+    memset(vParam, 0, sizeof(vParam));
+    for (;;)
+    {
+        if (len = HostTransferIn(buf), len < 0)
+        {
+            printf("  no IN transfer armed\n");
+            return(false);
+        }
+        if (length == 0)
+        {
+            if (len < 12)
+            {
+                printf("  container header split over transfers\n");
+                return(false);
+            }
+            length = Get32(buf);
+            got = 0;
+            p = (buf[4] == 2) ? vData : vData + sizeof(vData) / 2;
+        }
+        memcpy(p + got, buf, len);
+        got += len;
+        if (got > length)
+        {
+            printf("  transfer runs past the container\n");
+            return(false);
+        }
+        if (((len % TEST_EP_SIZE) != 0) || (len == 0))
+        {
+            if (got != length)
+            {
+                printf("  short packet at %u of %u bytes\n", got, length);
+                return(false);
+            }
+            vZlp += (len == 0);
+            if (p == vData)
+            {
+                vDataLength = length;
+                length = 0;
+                continue;
+            }
+            vResponse = p[6] | (p[7] << 8);
+            vParam[0] = (length >= 16) ? Get32(p + 12) : 0;
+            vParam[1] = (length >= 20) ? Get32(p + 16) : 0;
+            vParam[2] = (length >= 24) ? Get32(p + 20) : 0;
+            return(true);
+        }
+    }
+}
+
+
+static uint16_t
+Transaction(uint16_t code, uint32_t n, uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t e)
+{
+    if (!HostCommand(code, n, a, b, c, d, e) || !HostResponse())
+    {
+        return(0);
+    }
+    return(vResponse);
+}
+
+
+/* Class requests on the control endpoint */
+static void
+HostCancel(void)
+{
+    USBD_SetupReqTypedef req = {0x21, 0x64, 0, 0, 6};
+
+    TEST_CLASS.Setup(&vDev, &req);
+    vUsb.ctlRxBuf[0] = 0x01;
+    vUsb.ctlRxBuf[1] = 0x40;
+    Put32(&vUsb.ctlRxBuf[2], vTransaction - 1);
+    vDev.request = req;
+    TEST_CLASS.EP0_RxReady(&vDev);
+}
+
+
+static uint16_t
+HostDeviceStatus(void)
+{
+    USBD_SetupReqTypedef req = {0xA1, 0x67, 0, 0, 64};
+
+    vUsb.ctlTxLength = 0;
+    TEST_CLASS.Setup(&vDev, &req);
+    return((vUsb.ctlTxLength >= 4) ? vUsb.ctlTx[2] | (vUsb.ctlTx[3] << 8) : 0);
+}
+
+
+static void
+HostConfigure(void)
+{
+    vDev.dev_speed = (TEST_EP_SIZE == MTP_HS_EP_SIZE) ? USBD_SPEED_HIGH : USBD_SPEED_FULL;
+    vDev.dev_state = USBD_STATE_CONFIGURED;
+    TEST_CLASS.Init(&vDev, 0);
+}
+
+
+/* Name of an object, from the ObjectInfo dataset, in ASCII */
+static bool
+ObjectName(uint32_t handle, char* name, uint32_t size)
+{
+    uint32_t i;
+
+    if ((Transaction(0x1008, 1, handle, 0, 0, 0, 0) != 0x2001) || (vDataLength < 12 + 53))
+    {
+        return(false);
+    }
+    for (i = 0; (i < vData[64]) && (i < size - 1); i++)
+    {
+        name[i] = vData[65 + 2 * i];
+    }
+    name[i] = 0;
+    return(true);
+}
+
+
+static uint32_t
+FindObject(uint32_t parent, const char* name)
+{
+    static uint32_t handles[64];
+    char found[64];
+    uint32_t i, n;
+
+    if ((Transaction(0x1007, 3, TEST_STORAGE, 0, parent, 0, 0) != 0x2001) || (vDataLength < 16))
+    {
+        return(0);
+    }
+    n = Get32(&vData[12]);
+    n = (n < 64) ? n : 64;
+    memcpy(handles, &vData[16], 4 * n);
+    for (i = 0; i < n; i++)
+    {
+        if (ObjectName(handles[i], found, sizeof(found)) && (strcmp(found, name) == 0))
+        {
+            return(handles[i]);
+        }
+    }
+    return(0);
+}
+
+
+static void
+MakeFile(const char* name, uint32_t size)
+{
+    FILE* f = fopen(name, "wb");
+    uint32_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        fputc((i * 7 + size) & 0xFF, f);
+    }
+    fclose(f);
+}
+
+
+/* An ASCII string as PTP string, returns its size */
+static uint32_t
+PutString(uint8_t* p, const char* str)
+{
+    uint32_t i, n = strlen(str);
+
+    p[0] = n + 1;
+    for (i = 0; i <= n; i++)
+    {
+        p[1 + 2 * i] = str[i];
+        p[2 + 2 * i] = 0;
+    }
+    return(1 + 2 * (n + 1));
+}
+
+
+/* SetObjectPropValue of ObjectFileName */
+static uint16_t
+Rename(uint32_t handle, const char* name)
+{
+    uint8_t buf[1 + 2 * 256];
+    uint32_t len = PutString(buf, name);
+
+    if (!HostCommand(0x9804, 2, handle, 0xDC07) || !HostDataOut(0x9804, buf, len, len) || !HostResponse())
+    {
+        return(0);
+    }
+    return(vResponse);
+}
+
+
+/* Data phases that fill whole packets, and whole transfers, end with a
+ * zero-length packet; the others with a short packet */
+static void
+TestZeroLengthPacket(void)
+{
+    uint32_t sizes[] = {TEST_EP_SIZE - 12, TEST_EP_SIZE - 11, 2 * TEST_EP_SIZE - 12, 2 * TEST_EP_SIZE - 13,
+                        MTP_TX_BUF_SIZE - 12, 2 * MTP_TX_BUF_SIZE - 12, 2 * MTP_TX_BUF_SIZE + 1, 0};
+    char name[16];
+    uint32_t i, j, handle, zlp;
+    bool same;
+
+    printf("zero-length packets\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        sprintf(name, "Z%u.BIN", sizes[i]);
+        MakeFile(name, sizes[i]);
+        handle = FindObject(0xFFFFFFFF, name);
+        CHECK(handle != 0);
+
+        zlp = vZlp;
+        CHECK(Transaction(0x1009, 1, handle, 0, 0, 0, 0) == 0x2001);
+        CHECK(vDataLength == 12 + sizes[i]);
+        for (j = 0, same = true; (j < sizes[i]) && (j + 12 < vDataLength); j++)
+        {
+            same &= (vData[12 + j] == ((j * 7 + sizes[i]) & 0xFF));
+        }
+        CHECK(same);
+        CHECK((vZlp - zlp) == (((12 + sizes[i]) % TEST_EP_SIZE) == 0));
+    }
+    CHECK(vUsb.txOverlap == 0);
+}
+
+
+/* A cancel request drops the transfer on the wire and the chunk waiting
+ * behind it, a cancelled SendObject removes the partial file */
+static void
+TestCancel(void)
+{
+    static uint8_t buf[MTP_TX_BUF_SIZE];
+    uint8_t info[128] = {0};
+    uint32_t handle, flushes, len;
+
+    printf("cancel\n");
+    MakeFile("BIG.BIN", 64 * MTP_TX_BUF_SIZE);
+    handle = FindObject(0xFFFFFFFF, "BIG.BIN");
+    CHECK(handle != 0);
+
+    CHECK(HostCommand(0x1009, 1, handle));
+    CHECK(HostTransferIn(buf) == MTP_TX_BUF_SIZE);
+    CHECK(HostTransferIn(buf) == MTP_TX_BUF_SIZE);
+    flushes = vUsb.flushes;
+    HostCancel();
+#ifdef MTP_WORKER
+    // Repeated requests wait as one
+    HostCancel();
+    HostCancel();
+    CHECK(((TEST_HANDLE*)vDev.pClassData)->Work.cancel == 1);
+    // Busy until the worker has dropped the transfer
+    CHECK(HostDeviceStatus() == 0x2019);
+#endif
+    CHECK(HostTransferIn(buf) < 0);
+    CHECK(vUsb.flushes == flushes + 1);
+    CHECK(HostDeviceStatus() == 0x2001);
+    CHECK(Transaction(0x1001, 0, 0, 0, 0, 0, 0) == 0x2001);
+
+    // ObjectInfo with the format at 4, the size at 8 and the name at 52
+    info[4] = 0x00;
+    info[5] = 0x30;
+    Put32(&info[8], 3 * MTP_RX_BUF_SIZE);
+    info[52] = 7;
+    memcpy(&info[53], "C\0A\0N\0C\0E\0L\0\0\0", 14);
+    CHECK(HostCommand(0x100C, 2, TEST_STORAGE, 0xFFFFFFFF));
+    CHECK(HostDataOut(0x100C, info, 53 + 14 + 3, 53 + 14 + 3));
+    CHECK(HostResponse() && (vResponse == 0x2001));
+    CHECK(HostCommand(0x100D, 0));
+    len = 2 * MTP_RX_BUF_SIZE;
+    CHECK(HostDataOut(0x100D, vData, 3 * MTP_RX_BUF_SIZE, len - 12));
+    CHECK(access("CANCEL", F_OK) == 0);
+    HostCancel();
+#ifdef MTP_WORKER
+    CHECK(HostDeviceStatus() == 0x2019);
+    CHECK(access("CANCEL", F_OK) == 0);
+#endif
+    Worker();
+    CHECK(HostDeviceStatus() == 0x201F);
+    CHECK(HostDeviceStatus() == 0x2001);
+    CHECK(access("CANCEL", F_OK) != 0);
+    CHECK(Transaction(0x1001, 0, 0, 0, 0, 0, 0) == 0x2001);
+}
+
+
+/* Handle arrays and property lists far beyond a transfer are generated a
+ * packet at a time, resuming where the previous packet stopped */
+static void
+TestCursorResume(void)
+{
+    static uint32_t handles[TEST_FOLDER_FILES];
+    static bool seen[TEST_FOLDER_FILES];
+    char name[32];
+    uint8_t* p;
+    uint32_t folder, i, j, n, k;
+    bool ok;
+
+    printf("cursor resume\n");
+    mkdir("MANY", 0777);
+    for (i = 0; i < TEST_FOLDER_FILES; i++)
+    {
+        sprintf(name, "MANY/F%03u.TXT", i);
+        MakeFile(name, i);
+    }
+    folder = FindObject(0xFFFFFFFF, "MANY");
+    CHECK(folder != 0);
+
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0, folder, 0, 0) == 0x2001);
+    n = Get32(&vData[12]);
+    CHECK(n == TEST_FOLDER_FILES);
+    CHECK(vDataLength == 16 + 4 * n);
+    n = (n < TEST_FOLDER_FILES) ? n : TEST_FOLDER_FILES;
+    memcpy(handles, &vData[16], 4 * n);
+
+    // ObjectFileName of every object in the folder
+    CHECK(Transaction(0x9805, 5, folder, 0, 0xDC07, 0, 1) == 0x2001);
+    CHECK(Get32(&vData[12]) == n);
+    for (i = 0, p = &vData[16], ok = true; (i < n) && (p < vData + vDataLength); i++)
+    {
+        for (j = 0; (j < n) && (handles[j] != Get32(p)); j++)
+        {
+        }
+        ok &= (j < n) && (p[4] == 0x07) && (p[5] == 0xDC) && (p[6] == 0xFF) && (p[7] == 0xFF);
+        for (k = 0; (k < p[8]) && (k < sizeof(name) - 1); k++)
+        {
+            name[k] = p[9 + 2 * k];
+        }
+        name[k] = 0;
+        ok &= (sscanf(name, "F%u.TXT", &k) == 1) && (k < n) && !seen[k];
+        if (k < n)
+        {
+            seen[k] = true;
+        }
+        p += 9 + 2 * p[8];
+    }
+    CHECK(ok);
+    CHECK(p == vData + vDataLength);
+}
+
+
+/* Folder handles stay valid across sessions and engine resets, as the folder
+ * index is kept in /_.MTP. An index left dirty by a change that was cut off is
+ * rebuilt, and its old handles no longer resolve. */
+static void
+TestFolderIndex(void)
+{
+    FILE* f;
+    uint32_t root, a, b, dirty;
+
+    printf("folder index\n");
+    mkdir("IDX", 0777);
+    mkdir("IDX/A", 0777);
+    mkdir("IDX/B", 0777);
+    root = FindObject(0xFFFFFFFF, "IDX");
+    a = FindObject(root, "A");
+    b = FindObject(root, "B");
+    CHECK((root != 0) && (a != 0) && (b != 0) && (a != b));
+
+    // Resolved straight from the index, without listing the folders first
+    CHECK(Transaction(0x1003, 0, 0, 0, 0, 0, 0) == 0x2001);
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(Transaction(0x1008, 1, b, 0, 0, 0, 0) == 0x2001);
+    TEST_CLASS.DeInit(&vDev, 0);
+    HostConfigure();
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(Transaction(0x1008, 1, a, 0, 0, 0, 0) == 0x2001);
+    CHECK(FindObject(root, "B") == b);
+
+    // The dirty flag follows count, free and the volume fingerprint in the header
+    CHECK(Transaction(0x1003, 0, 0, 0, 0, 0, 0) == 0x2001);
+    dirty = 1;
+    CHECK((f = fopen("_.MTP", "r+b")) != NULL);
+    fseek(f, 20, SEEK_SET);
+    fwrite(&dirty, sizeof(dirty), 1, f);
+    fclose(f);
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(Transaction(0x1008, 1, a, 0, 0, 0, 0) != 0x2001);
+    CHECK((f = fopen("_.MTP", "rb")) != NULL);
+    fseek(f, 20, SEEK_SET);
+    CHECK((fread(&dirty, sizeof(dirty), 1, f) == 1) && (dirty == 0));
+    fclose(f);
+    CHECK((root = FindObject(0xFFFFFFFF, "IDX")) != 0);
+    CHECK(FindObject(root, "A") != 0);
+    CHECK(FindObject(root, "B") != 0);
+}
+
+
+/* A renamed file keeps its handle for the rest of the session, until a new
+ * file takes the old name; a renamed folder keeps it for good. Deleting a
+ * folder leaves the folder index alone for subfolders it never listed. */
+static void
+TestRenameAlias(void)
+{
+    char name[32];
+    uint32_t folder, h, n, sub, del, opens;
+
+    printf("rename aliases\n");
+    mkdir("REN", 0777);
+    mkdir("REN/SUB", 0777);
+    mkdir("REN/DEL", 0777);
+    mkdir("REN/DEL/INNER", 0777);
+    MakeFile("REN/OLD.TXT", 10);
+    folder = FindObject(0xFFFFFFFF, "REN");
+    h = FindObject(folder, "OLD.TXT");
+    CHECK(h != 0);
+
+    CHECK(Rename(h, "NEW.TXT") == 0x2001);
+    CHECK(ObjectName(h, name, sizeof(name)) && (strcmp(name, "NEW.TXT") == 0));
+    CHECK(FindObject(folder, "NEW.TXT") == h);
+    CHECK(FindObject(folder, "OLD.TXT") == 0);
+    CHECK(Rename(h, "A/B") == 0xA803);
+
+    // A new file with the old name takes the handle back
+    MakeFile("REN/OLD.TXT", 1);
+    CHECK(FindObject(folder, "OLD.TXT") == h);
+    n = FindObject(folder, "NEW.TXT");
+    CHECK((n != 0) && (n != h));
+
+    // An alias lasts for the session only, the folder index keeps a folder's
+    CHECK(Rename(n, "THIRD.TXT") == 0x2001);
+    CHECK(FindObject(folder, "THIRD.TXT") == n);
+    sub = FindObject(folder, "SUB");
+    CHECK(Rename(sub, "DIR") == 0x2001);
+    CHECK(FindObject(folder, "DIR") == sub);
+    CHECK(Transaction(0x1003, 0, 0, 0, 0, 0, 0) == 0x2001);
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(ObjectName(sub, name, sizeof(name)) && (strcmp(name, "DIR") == 0));
+    CHECK(FindObject(folder, "THIRD.TXT") != n);
+
+    // INNER was never listed, only DEL itself is taken out of the index
+    del = FindObject(folder, "DEL");
+    opens = vVfsIndexOpens[1];
+    CHECK(Transaction(0x100B, 1, del, 0, 0, 0, 0) == 0x2001);
+    CHECK(vVfsIndexOpens[1] == opens + 1);
+    CHECK(access("REN/DEL", F_OK) != 0);
+}
+
+
+/* GetObjectPropValue sends the bare value of the property of an existing
+ * object */
+static void
+TestObjectPropValue(void)
+{
+    uint32_t h;
+
+    printf("object property value\n");
+    MakeFile("PROP.BIN", 300);
+    h = FindObject(0xFFFFFFFF, "PROP.BIN");
+    CHECK(h != 0);
+
+    CHECK(Transaction(0x9803, 2, h, 0xDC04, 0, 0, 0) == 0x2001);
+    CHECK((vDataLength == 12 + 8) && (Get32(&vData[12]) == 300) && (Get32(&vData[16]) == 0));
+    CHECK(Transaction(0x9803, 2, h, 0xDC07, 0, 0, 0) == 0x2001);
+    CHECK((vDataLength == 12 + 1 + 2 * 9) && (vData[12] == 9) && (vData[13] == 'P') && (vData[27] == 'N'));
+    CHECK(Transaction(0x9803, 2, h, 0xDC0B, 0, 0, 0) == 0x2001);
+    CHECK((vDataLength == 12 + 4) && (Get32(&vData[12]) == 0));
+
+    CHECK(Transaction(0x9803, 2, h ^ 1, 0xDC04, 0, 0, 0) == 0x2009);
+    CHECK(Transaction(0x9803, 2, h, 0xDCFF, 0, 0, 0) == 0xA80A);
+}
+
+
+/* GetObjectPropList keeps only the objects of the requested format, and the
+ * properties of the requested group when no property is given */
+static void
+TestPropListFilter(void)
+{
+    uint32_t folder, jpg, all, list, detail;
+
+    printf("property list filters\n");
+    mkdir("FLT", 0777);
+    mkdir("FLT/SUB", 0777);
+    MakeFile("FLT/A.LOG", 10);
+    MakeFile("FLT/B.JPG", 20);
+    MakeFile("FLT/C.TXT", 30);
+    folder = FindObject(0xFFFFFFFF, "FLT");
+    jpg = FindObject(folder, "B.JPG");
+    CHECK(jpg != 0);
+
+    // One object: all properties, then each group on its own
+    CHECK(Transaction(0x9805, 5, jpg, 0, 0xFFFFFFFF, 0, 0) == 0x2001);
+    all = Get32(&vData[12]);
+    CHECK(Transaction(0x9805, 5, jpg, 0, 0, 1, 0) == 0x2001);
+    list = Get32(&vData[12]);
+    CHECK(Transaction(0x9805, 5, jpg, 0, 0, 2, 0) == 0x2001);
+    detail = Get32(&vData[12]);
+    CHECK((list != 0) && (detail != 0) && (list + detail == all));
+    CHECK(Transaction(0x9805, 5, jpg, 0, 0, 7, 0) == 0xA805);
+
+    // A format the object does not have leaves an empty list
+    CHECK(Transaction(0x9805, 5, jpg, 0x3004, 0xDC07, 0, 0) == 0x2001);
+    CHECK(Get32(&vData[12]) == 0);
+    CHECK(Transaction(0x9805, 5, jpg, 0x3801, 0xDC07, 0, 0) == 0x2001);
+    CHECK(Get32(&vData[12]) == 1);
+
+    // The children of the folder: two text files, one image, one folder
+    CHECK(Transaction(0x9805, 5, folder, 0x3004, 0xDC07, 0, 1) == 0x2001);
+    CHECK(Get32(&vData[12]) == 2);
+    CHECK(Transaction(0x9805, 5, folder, 0x3801, 0xFFFFFFFF, 0, 1) == 0x2001);
+    CHECK((Get32(&vData[12]) == all) && (Get32(&vData[16]) == jpg));
+    CHECK(Transaction(0x9805, 5, folder, 0x3001, 0, 1, 1) == 0x2001);
+    CHECK(Get32(&vData[12]) == list);
+    CHECK(Transaction(0x9805, 5, folder, 0, 0, 2, 1) == 0x2001);
+    CHECK(Get32(&vData[12]) == 4 * detail);
+}
+
+
+/* GetObjectHandles lists only the objects of the requested format */
+static void
+TestHandlesFilter(void)
+{
+    uint32_t folder, jpg, sub;
+
+    printf("object handle filters\n");
+    mkdir("FMT", 0777);
+    mkdir("FMT/SUB", 0777);
+    MakeFile("FMT/X1.JPG", 1);
+    MakeFile("FMT/x2.jpeg", 2);
+    MakeFile("FMT/N.TXT", 3);
+    MakeFile("FMT/Z.ZIP", 4);
+    MakeFile("FMT/NOEXT", 5);
+    folder = FindObject(0xFFFFFFFF, "FMT");
+    jpg = FindObject(folder, "X1.JPG");
+    sub = FindObject(folder, "SUB");
+    CHECK((jpg != 0) && (sub != 0));
+
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3801, folder, 0, 0) == 0x2001);
+    CHECK((Get32(&vData[12]) == 2) && ((Get32(&vData[16]) == jpg) || (Get32(&vData[20]) == jpg)));
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3001, folder, 0, 0) == 0x2001);
+    CHECK((Get32(&vData[12]) == 1) && (Get32(&vData[16]) == sub));
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3000, folder, 0, 0) == 0x2001);
+    CHECK(Get32(&vData[12]) == 2);
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3009, folder, 0, 0) == 0x2001);
+    CHECK((Get32(&vData[12]) == 0) && (vDataLength == 16));
+
+    // Nothing of the folder shows up in a filtered listing of the root
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3801, 0xFFFFFFFF, 0, 0) == 0x2001);
+    CHECK(Get32(&vData[12]) == 0);
+}
+
+
+/* GetObjectHandles with parent 0 walks the whole store in one data phase.
+ * Coming back up from a subfolder must not search the folder index again for
+ * every sibling before it. */
+static void
+TestStoreWalk(void)
+{
+    static uint32_t handles[4096];
+    char name[32];
+    uint32_t folder, d, in, f, opens, n, i, j;
+
+    printf("store walk\n");
+    mkdir("WALK", 0777);
+    for (i = 0; i < 40; i++)
+    {
+        snprintf(name, sizeof(name), "WALK/D%02u", i);
+        mkdir(name, 0777);
+        snprintf(name, sizeof(name), "WALK/D%02u/IN", i);
+        mkdir(name, 0777);
+        snprintf(name, sizeof(name), "WALK/D%02u/IN/F.TXT", i);
+        MakeFile(name, i);
+    }
+    folder = FindObject(0xFFFFFFFF, "WALK");
+    CHECK(folder != 0);
+
+    opens = vVfsIndexOpens[0] + vVfsIndexOpens[1];
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0, 0, 0, 0) == 0x2001);
+    // A few opens per folder, for both the counting pass and the data phase
+    CHECK(vVfsIndexOpens[0] + vVfsIndexOpens[1] - opens < 25 * 40);
+    n = Get32(&vData[12]);
+    CHECK((n > 3 * 40) && (n <= 4096) && (vDataLength == 16 + 4 * n));
+    n = (n <= 4096) ? n : 4096;
+    memcpy(handles, &vData[16], 4 * n);
+    for (i = 0; i < n; i++)
+    {
+        for (j = i + 1; (j < n) && (handles[j] != handles[i]); j++)
+        {
+        }
+        CHECK(j == n);
+    }
+
+    // The folder, a subfolder deep down and the file in it are all listed
+    d = FindObject(folder, "D33");
+    in = FindObject(d, "IN");
+    f = FindObject(in, "F.TXT");
+    CHECK((d != 0) && (in != 0) && (f != 0));
+    for (i = 0, j = 0; i < n; i++)
+    {
+        j += (handles[i] == folder) + (handles[i] == d) + (handles[i] == in) + (handles[i] == f);
+    }
+    CHECK(j == 4);
+
+    // All storages give the same, there is only one
+    CHECK(Transaction(0x1007, 3, 0xFFFFFFFF, 0, 0, 0, 0) == 0x2001);
+    CHECK(Get32(&vData[12]) == n);
+    CHECK(Transaction(0x1007, 3, TEST_STORAGE, 0x3004, 0, 0, 0) == 0x2001);
+    CHECK((Get32(&vData[12]) >= 40) && (Get32(&vData[12]) < n));
+}
+
+
+/* A file name beyond ASCII goes in as UTF-16 and comes back the same, with
+ * the units and surrogate pairs of the dataset split over several chunks */
+static void
+TestUtf16(void)
+{
+    static const uint16_t units[] = {0x00E4, 0x65E5, 0xD83D, 0xDE00, 'A', 0xD801, 0xDC37, '.', 'T', 'X', 'T', 0};
+    static const char utf8[] = "\xC3\xA4\xE6\x97\xA5\xF0\x9F\x98\x80" "A" "\xF0\x90\x90\xB7" ".TXT";
+    static uint8_t buf[MTP_TX_BUF_SIZE];
+    PtpContext_t* ctx = PtpContext(&vDev);
+    uint8_t data[128] = {0};
+    uint32_t i, n, len, handle;
+    bool same;
+
+    printf("utf-16 names\n");
+    // ObjectInfo of a text file, the name and three empty strings after it
+    len = 12 + 53 + 2 * 12 + 3;
+    Put32(&data[0], len);
+    data[4] = 2;
+    data[6] = 0x0C;
+    data[7] = 0x10;
+    data[12 + 4] = 0x04;
+    data[12 + 5] = 0x30;
+    data[12 + 52] = 12;
+    for (i = 0; i < 12; i++)
+    {
+        data[12 + 53 + 2 * i] = units[i];
+        data[12 + 54 + 2 * i] = units[i] >> 8;
+    }
+    CHECK(HostCommand(0x100C, 2, TEST_STORAGE, 0xFFFFFFFF));
+    Put32(&data[8], vTransaction - 1);
+
+    // Past the fixed part in chunks of three bytes, every unit and pair is cut somewhere
+    for (i = 0; i < len; i += n)
+    {
+        n = (i == 0) ? 12 + 53 : 3;
+        n = (len - i < n) ? len - i : n;
+        CHECK(PtpPayloadIn(ctx, &data[i], n));
+    }
+    CHECK(PtpPayloadOut(ctx, buf, sizeof(buf), TEST_EP_SIZE, &n) && (n >= 24));
+    CHECK((buf[6] | (buf[7] << 8)) == 0x2001);
+    handle = Get32(&buf[20]);
+    CHECK(HostCommand(0x100D, 0));
+    CHECK(HostDataOut(0x100D, buf, 0, 0));
+    CHECK(HostResponse() && (vResponse == 0x2001));
+    CHECK(access(utf8, F_OK) == 0);
+
+    CHECK(Transaction(0x1008, 1, handle, 0, 0, 0, 0) == 0x2001);
+    for (i = 0, same = (vData[64] == 12); same && (i < 12); i++)
+    {
+        same = ((vData[65 + 2 * i] | (vData[66 + 2 * i] << 8)) == units[i]);
+    }
+    CHECK(same);
+    CHECK(Transaction(0x9803, 2, handle, 0xDC07, 0, 0, 0) == 0x2001);
+    CHECK((vDataLength == 12 + 1 + 2 * 12) && (memcmp(&vData[13], &data[12 + 53], 2 * 12) == 0));
+}
+
+
+/* DateModified of an object from its ObjectInfo dataset, in ASCII */
+static bool
+ObjectModified(uint32_t handle, char* str, uint32_t size)
+{
+    uint32_t i, n;
+
+    if (Transaction(0x1008, 1, handle, 0, 0, 0, 0) != 0x2001)
+    {
+        return(false);
+    }
+    n = 64 + 1 + 2 * vData[64];     // Past the name
+    n += 1 + 2 * vData[n];          // Past DateCreated
+    for (i = 0; (i + 1 < vData[n]) && (i < size - 1) && (n + 2 + 2 * i < vDataLength); i++)
+    {
+        str[i] = vData[n + 1 + 2 * i];
+    }
+    str[i] = 0;
+    return(true);
+}
+
+
+/* The modified date of SendObjectInfo is read with tenths and a zone offset
+ * and stored in UTC, GetObjectInfo sends the stored time back in UTC */
+static void
+TestDateTime(void)
+{
+    static const struct
+    {
+        const char* sent;
+        time_t utc;
+        const char* back;
+    } dates[] =
+    {
+        {"20240229T235959.7+0130", 1709245799, "20240229T222959"},
+        {"19991231T233000-0100", 946686600, "20000101T003000"},
+        {"20240301T003000+01", 1709249400, "20240229T233000"},
+        {"21000301T000000Z", 4107542400, "21000301T000000"},
+        {"20000229T000000", 951782400, "20000229T000000"},
+    };
+    struct timeval tv[2] = {{4107542399, 0}, {4107542399, 0}};
+    uint8_t info[128];
+    char name[16];
+    struct stat st;
+    uint32_t i, len, handle;
+
+    printf("date and time\n");
+    for (i = 0; i < sizeof(dates) / sizeof(dates[0]); i++)
+    {
+        // ObjectInfo of a folder, the dates follow the name
+        memset(info, 0, sizeof(info));
+        info[4] = 0x01;
+        info[5] = 0x30;
+        info[42] = 1;
+        sprintf(name, "DT%u", i);
+        len = 52 + PutString(&info[52], name);
+        info[len++] = 0;
+        len += PutString(&info[len], dates[i].sent);
+        info[len++] = 0;
+        CHECK(HostCommand(0x100C, 2, TEST_STORAGE, 0xFFFFFFFF));
+        CHECK(HostDataOut(0x100C, info, len, len));
+        CHECK(HostResponse() && (vResponse == 0x2001));
+        handle = vParam[2];
+        CHECK((stat(name, &st) == 0) && (st.st_mtime == dates[i].utc));
+        CHECK(ObjectModified(handle, name, sizeof(name)) && (strcmp(name, dates[i].back) == 0));
+    }
+
+    // A time set on the media, the last second before a March 1 without leap day
+    mkdir("DTX", 0777);
+    CHECK(utimes("DTX", tv) == 0);
+    handle = FindObject(0xFFFFFFFF, "DTX");
+    CHECK(ObjectModified(handle, name, sizeof(name)) && (strcmp(name, "21000228T235959") == 0));
+}
+
+
+/* The format of a file follows from the last extension of its name, in any
+ * case, and only a whole listed extension counts */
+static void
+TestExtensionFormat(void)
+{
+    static const struct
+    {
+        const char* name;
+        uint16_t format;
+    } files[] =
+    {
+        {"a.jpg", 0x3801},
+        {"B.JpEg", 0x3801},
+        {"C.HTML", 0x3005},
+        {"D.MP4", 0xB982},
+        {"E.xml", 0xBA82},
+        {"F.ZIP.TXT", 0x3004},
+        {"G.TXT.ZIP", 0x3000},
+        {"H.", 0x3000},
+        {"I", 0x3000},
+        {"J.JP", 0x3000},
+        {"K.JPEGS", 0x3000},
+        {"L.XHTML", 0x3000},
+        {"M.JPG.", 0x3000},
+    };
+    char name[32];
+    uint32_t folder, handle, i;
+
+    printf("extension formats\n");
+    mkdir("EXT", 0777);
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        snprintf(name, sizeof(name), "EXT/%s", files[i].name);
+        MakeFile(name, i);
+    }
+    folder = FindObject(0xFFFFFFFF, "EXT");
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        handle = FindObject(folder, files[i].name);
+        CHECK((handle != 0) && (Transaction(0x1008, 1, handle, 0, 0, 0, 0) == 0x2001));
+        CHECK((vData[16] | (vData[17] << 8)) == files[i].format);
+    }
+}
+
+
+#if (TEST_INSTANCES > 1)
+/* The engines share the folder index, the handle index and the aliases. A
+ * session opening or closing on the second core leaves them alone while the
+ * first one still has its session open. */
+static void
+TestSharedSession(void)
+{
+    char name[32];
+    uint32_t folder, h;
+
+    printf("shared session\n");
+    mkdir("TWO", 0777);
+    MakeFile("TWO/A.TXT", 1);
+    folder = FindObject(0xFFFFFFFF, "TWO");
+    h = FindObject(folder, "A.TXT");
+    CHECK(Rename(h, "B.TXT") == 0x2001);
+
+    vHost = 1;
+    HostConfigure();
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(FindObject(0xFFFFFFFF, "TWO") == folder);
+    CHECK(FindObject(folder, "B.TXT") == h);
+    CHECK(Transaction(0x1003, 0, 0, 0, 0, 0, 0) == 0x2001);
+    TEST_CLASS.DeInit(&vDev, 0);
+    Worker();
+    vHost = 0;
+
+    CHECK(ObjectName(folder, name, sizeof(name)) && (strcmp(name, "TWO") == 0));
+    CHECK(ObjectName(h, name, sizeof(name)) && (strcmp(name, "B.TXT") == 0));
+    CHECK(FindObject(folder, "B.TXT") == h);
+}
+#endif
+
+
+/* Configuration changes in the middle of a transfer end the session, and the
+ * pipe starts over */
+static void
+TestReset(void)
+{
+    static uint8_t buf[MTP_TX_BUF_SIZE];
+    uint32_t handle;
+
+    printf("reset\n");
+    handle = FindObject(0xFFFFFFFF, "BIG.BIN");
+    CHECK(handle != 0);
+    CHECK(HostCommand(0x1009, 1, handle));
+    CHECK(HostTransferIn(buf) == MTP_TX_BUF_SIZE);
+    TEST_CLASS.DeInit(&vDev, 0);
+    HostConfigure();
+    CHECK(HostTransferIn(buf) < 0);
+    // The same session again, not SessionAlreadyOpen
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    CHECK(FindObject(0xFFFFFFFF, "BIG.BIN") == handle);
+}
+
+
+/* A USB core beyond MTP_INSTANCES, one by default, has no engine and its class
+ * fails to initialise */
+static void
+TestInstance(void)
+{
+    USBD_HandleTypeDef dev = vDev;
+
+    printf("instance\n");
+    dev.id = TEST_INSTANCES;
+    dev.pClassData = NULL;
+    CHECK(TEST_CLASS.Init(&dev, 0) == USBD_FAIL);
+    CHECK(dev.pClassData == NULL);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    char root[] = "/tmp/mtp_test.XXXXXX";
+    char cmd[64];
+    uint32_t i;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+    if ((mkdtemp(root) == NULL) || (chdir(root) != 0))
+    {
+        return(2);
+    }
+    vVfsRoot = root;
+    printf("%u byte packets, %u byte transfers\n", TEST_EP_SIZE, MTP_TX_BUF_SIZE);
+    for (i = 0; i < TEST_INSTANCES; i++)
+    {
+        vDevs[i].id = i;
+    }
+
+    HostConfigure();
+    CHECK(Transaction(0x1002, 1, 1, 0, 0, 0, 0) == 0x2001);
+    TestZeroLengthPacket();
+    TestCancel();
+    TestCursorResume();
+    TestFolderIndex();
+    TestRenameAlias();
+    TestObjectPropValue();
+    TestPropListFilter();
+    TestHandlesFilter();
+    TestStoreWalk();
+    TestUtf16();
+    TestDateTime();
+    TestExtensionFormat();
+#if (TEST_INSTANCES > 1)
+    TestSharedSession();
+#endif
+    TestReset();
+    TestInstance();
+    TEST_CLASS.DeInit(&vDev, 0);
+    Worker();
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    system(cmd);
+    printf("%s, %u failed\n", vFailed ? "FAIL" : "PASS", vFailed);
+    return(vFailed ? 1 : 0);
+}
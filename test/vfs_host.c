@@ -0,0 +1,278 @@
+/* File system layer of the host test, volume 0 ("0:") is the directory
+ * vVfsRoot. Names starting with "_." are reported hidden, as on the target. */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vfs.h"
+
+
+typedef struct
+{
+    DIR* dir;
+    char path[MAX_PATH + 512];
+}
+HostDir_t;
+
+const char* vVfsRoot = ".";
+uint32_t vVfsIndexOpens[2];
+static FileSystem_t vHostFs;
+
+
+static void
+HostPath(const char* path, char* out, size_t len)
+{
+    const char* p = strchr(path, ':');
+
+    snprintf(out, len, "%s/%s", vVfsRoot, (p != NULL) ? p + 1 : path);
+}
+
+
+static void
+HostInfo(const char* path, const char* name, VfsInfo_t* info)
+{
+    struct stat st;
+
+    memset(info, 0, sizeof(*info));
+    stat(path, &st);
+    strncpy(info->name, name, sizeof(info->name) - 1);
+    info->attrib = (S_ISDIR(st.st_mode) ? ATR_DIR : 0) | ATR_IWRITE;
+    if (strncmp(name, "_.", 2) == 0)
+    {
+        info->attrib |= ATR_HID;
+    }
+    info->size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+    info->created = st.st_mtime;
+    info->modified = st.st_mtime;
+}
+
+
+char*
+vfs_volume(int i)
+{
+    return((i == 0) ? "0:" : NULL);
+}
+
+
+int
+vfs_stat(const char* path, VfsInfo_t* info)
+{
+    char real[MAX_PATH + 512];
+    const char* name = strrchr(path, '/');
+    const char* drive = strchr(path, ':');
+    struct stat st;
+
+    HostPath(path, real, sizeof(real));
+    if (stat(real, &st) != 0)
+    {
+        return(-ENOENT);
+    }
+    if ((drive != NULL) && ((drive[1] == 0) || (strcmp(drive, ":/") == 0)))
+    {
+        memset(info, 0, sizeof(*info));
+        strcpy(info->name, "TEST");
+        info->attrib = ATR_DIR;
+        info->blocks = 2048;
+        info->blocksize = 512;
+        return(0);
+    }
+    HostInfo(real, (name != NULL) ? name + 1 : path, info);
+    return(0);
+}
+
+
+int
+vfs_touch(const char* path, VfsInfo_t* info)
+{
+    char real[MAX_PATH + 512];
+    struct timespec ts[2] = {{info->modified, 0}, {info->modified, 0}};
+
+    HostPath(path, real, sizeof(real));
+    return(utimensat(AT_FDCWD, real, ts, 0));
+}
+
+
+int
+vfs_file_open(VfsFile_t* f, const char* path, int mode)
+{
+    char real[MAX_PATH + 512];
+
+    HostPath(path, real, sizeof(real));
+    if (strstr(path, "/_.MTP") != NULL)
+    {
+        vVfsIndexOpens[(mode & VFS_RDWR) != VFS_RDONLY]++;
+    }
+    if (mode & VFS_TRUNC)
+    {
+        f->fp = fopen(real, "w+b");
+    }
+    else if ((mode & VFS_RDWR) == VFS_RDONLY)
+    {
+        f->fp = fopen(real, "rb");
+    }
+    else if (f->fp = fopen(real, "r+b"), (f->fp == NULL) && (mode & VFS_CREAT))
+    {
+        f->fp = fopen(real, "w+b");
+    }
+    f->filesys = (f->fp != NULL) ? &vHostFs : NULL;
+    return((f->fp != NULL) ? 0 : -ENOENT);
+}
+
+
+int
+vfs_file_close(VfsFile_t* f)
+{
+    if (f->fp != NULL)
+    {
+        fclose(f->fp);
+    }
+    f->fp = NULL;
+    f->filesys = NULL;
+    return(0);
+}
+
+
+int
+vfs_file_read(VfsFile_t* f, void* buf, size_t len)
+{
+    return((f->fp != NULL) ? (int)fread(buf, 1, len, f->fp) : -EBADF);
+}
+
+
+int
+vfs_file_write(VfsFile_t* f, const void* buf, size_t len)
+{
+    return((f->fp != NULL) ? (int)fwrite(buf, 1, len, f->fp) : -EBADF);
+}
+
+
+int
+vfs_file_seek(VfsFile_t* f, long off, int whence)
+{
+    return(((f->fp != NULL) && (fseek(f->fp, off, whence) == 0)) ? 0 : -EINVAL);
+}
+
+
+long
+vfs_file_size(VfsFile_t* f)
+{
+    struct stat st;
+
+    return(((f->fp != NULL) && (fstat(fileno(f->fp), &st) == 0)) ? st.st_size : -EBADF);
+}
+
+
+int
+vfs_file_eof(VfsFile_t* f)
+{
+    return((f->fp == NULL) || (ftell(f->fp) >= vfs_file_size(f)));
+}
+
+
+int
+vfs_file_sync(VfsFile_t* f)
+{
+    return((f->fp != NULL) ? fflush(f->fp) : -EBADF);
+}
+
+
+int
+vfs_dir_open(VfsDir_t* d, const char* path)
+{
+    HostDir_t* h = malloc(sizeof(HostDir_t));
+
+    HostPath(path, h->path, sizeof(h->path));
+    if (h->dir = opendir(h->path), h->dir == NULL)
+    {
+        free(h);
+        return(-ENOENT);
+    }
+    d->d = h;
+    return(0);
+}
+
+
+int
+vfs_dir_read(VfsDir_t* d, VfsInfo_t* info)
+{
+    HostDir_t* h = d->d;
+    struct dirent* e;
+    char real[2 * MAX_PATH + 512];
+
+    if (e = readdir(h->dir), e == NULL)
+    {
+        return(-ENOENT);
+    }
+    snprintf(real, sizeof(real), "%s/%s", h->path, e->d_name);
+    HostInfo(real, e->d_name, info);
+    return(0);
+}
+
+
+int
+vfs_dir_close(VfsDir_t* d)
+{
+    HostDir_t* h = d->d;
+
+    if (h != NULL)
+    {
+        closedir(h->dir);
+        free(h);
+    }
+    d->d = NULL;
+    return(0);
+}
+
+
+int
+vfs_remove(const char* path)
+{
+    char real[MAX_PATH + 512];
+
+    HostPath(path, real, sizeof(real));
+    return(((unlink(real) == 0) || (rmdir(real) == 0)) ? 0 : -errno);
+}
+
+
+int
+vfs_rename(const char* from, const char* to)
+{
+    char a[MAX_PATH + 512], b[MAX_PATH + 512];
+
+    HostPath(from, a, sizeof(a));
+    HostPath(to, b, sizeof(b));
+    return((rename(a, b) == 0) ? 0 : -errno);
+}
+
+
+int
+vfs_mkdir(const char* path)
+{
+    char real[MAX_PATH + 512];
+
+    HostPath(path, real, sizeof(real));
+    return((mkdir(real, 0777) == 0) ? 0 : -errno);
+}
+
+
+int
+vfs_format(const char* drive)
+{
+    return(-EIO);
+}
+
+
+int64_t
+vfs_fs_size(const char* path)
+{
+    return(1024 * 1024);
+}
+
+
+int64_t
+vfs_fs_free(const char* path)
+{
+    return(512 * 1024);
+}